@@ -0,0 +1,108 @@
+#!/bin/sh
+# Benchmark ccodemerge on a synthetic source tree.
+#
+# Settings come from the environment:
+#   BENCH_DEPTH, BENCH_FANOUT, BENCH_FILES   Shape of the tree (default 3, 6, 5000)
+#   BENCH_SIZES       File size distribution (default lognormal:4000:1.0)
+#   BENCH_EXCLUDED    Share of excluded directories (default 0.1)
+#   BENCH_SYMLINKS    Share of files that are symlinks (default 0.02)
+#   BENCH_SEED        Seed of the tree generator (default 1)
+#   BENCH_ITERATIONS  Timed runs per scenario, after one warm-up run (default 10)
+#   BENCH_ARGS        Extra ccodemerge options, e.g. "-z zstd" or "-s -c"
+#   BENCH_DIR         Where trees and outputs are kept (default /tmp/ccodemerge-bench)
+#   BENCH_RESULTS     JSON file with all samples (default $BENCH_DIR/results.json)
+#   BENCH_BINARY      ccodemerge binary to run (default the one in the source tree)
+#
+# Scenarios:
+#   scan-only   Wall time of a dry run (scan and sort only)
+#   write-only  Write phase of a full run, as reported by --stats
+#   end-to-end  Wall time of a full run
+#
+# Besides the times, the syscall count and peak RSS reported by --stats are
+# recorded for every run.
+
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+ccodemerge=${BENCH_BINARY:-$here/../ccodemerge}
+gentree="$here/gentree"
+
+depth=${BENCH_DEPTH:-3}
+fanout=${BENCH_FANOUT:-6}
+files=${BENCH_FILES:-5000}
+sizes=${BENCH_SIZES:-lognormal:4000:1.0}
+excluded=${BENCH_EXCLUDED:-0.1}
+symlinks=${BENCH_SYMLINKS:-0.02}
+seed=${BENCH_SEED:-1}
+iterations=${BENCH_ITERATIONS:-10}
+args=${BENCH_ARGS:-}
+dir=${BENCH_DIR:-/tmp/ccodemerge-bench}
+results=${BENCH_RESULTS:-$dir/results.json}
+
+# The same settings always produce the same tree, so it is generated only once
+tree="$dir/tree-d$depth-f$fanout-n$files-$sizes-x$excluded-l$symlinks-r$seed"
+if [ ! -d "$tree" ]; then
+    echo "Generating $tree"
+    mkdir -p "$dir"
+    rm -rf "$tree.tmp"
+    "$gentree" --depth="$depth" --fanout="$fanout" --files="$files" --sizes="$sizes" \
+        --excluded="$excluded" --symlinks="$symlinks" --seed="$seed" "$tree.tmp"
+    mv "$tree.tmp" "$tree"
+fi
+out="$dir/merged.out"
+
+# Extract a number from the --stats=json line on stdin
+stat_field() {
+    sed "s/.*\"$1\":\([0-9.]*\).*/\1/"
+}
+
+# Run one scenario and print "wall_ms syscalls max_rss_kb" for every run
+run_scenario() {
+    case $1 in
+    scan-only) run_args="--dry-run" ;;
+    *) run_args="-o $out" ;;
+    esac
+    i=0
+    while [ "$i" -le "$iterations" ]; do
+        start=$(date +%s%N)
+        stats=$(cd "$tree" && "$ccodemerge" $run_args --stats=json $args | tail -n 1)
+        end=$(date +%s%N)
+        if [ "$1" = write-only ]; then
+            ms=$(echo "$stats" | sed 's/.*"write":{"wall":\([0-9.]*\).*/\1/' | awk '{ printf "%.3f", $1 * 1000 }')
+        else
+            ms=$(awk "BEGIN { printf \"%.3f\", ($end - $start) / 1e6 }")
+        fi
+        # The first run only warms the page cache
+        if [ "$i" -gt 0 ]; then
+            echo "$ms $(echo "$stats" | stat_field syscalls) $(echo "$stats" | stat_field max_rss_kb)"
+        fi
+        i=$((i + 1))
+    done
+}
+
+# Print count, min, median, p90, p99 and max of the samples on stdin
+summarize() {
+    sort -n | awk '
+        { v[NR] = $1 }
+        function rank(p,   r) { r = int(p * NR + 0.999999); return v[r < 1 ? 1 : r] }
+        END { printf "%6d %10.3f %10.3f %10.3f %10.3f %10.3f\n", NR, v[1], rank(0.5), rank(0.9), rank(0.99), v[NR] }'
+}
+
+echo "Tree: depth $depth, fan-out $fanout, $files files, sizes $sizes, excluded $excluded, symlinks $symlinks"
+[ -n "$args" ] && echo "Options: $args"
+printf "%-12s %6s %10s %10s %10s %10s %10s\n" "Scenario" "Runs" "Min ms" "Median" "p90" "p99" "Max"
+
+json="{\"tree\":{\"depth\":$depth,\"fanout\":$fanout,\"files\":$files,\"sizes\":\"$sizes\","
+json="$json\"excluded\":$excluded,\"symlinks\":$symlinks,\"seed\":$seed},\"args\":\"$args\",\"scenarios\":{"
+sep=""
+for scenario in scan-only write-only end-to-end; do
+    samples=$(run_scenario "$scenario")
+    printf "%-12s %s\n" "$scenario" "$(echo "$samples" | cut -d' ' -f1 | summarize)"
+    json="$json$sep\"$scenario\":{\"wall_ms\":[$(echo "$samples" | cut -d' ' -f1 | paste -sd, -)],"
+    json="$json\"syscalls\":[$(echo "$samples" | cut -d' ' -f2 | paste -sd, -)],"
+    json="$json\"max_rss_kb\":[$(echo "$samples" | cut -d' ' -f3 | paste -sd, -)]}"
+    sep=","
+done
+echo "$json}}" >"$results"
+rm -f "$out"
+echo "Samples written to $results"
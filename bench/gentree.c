@@ -0,0 +1,398 @@
+// gentree - generate a synthetic source tree for benchmarking ccodemerge
+//
+// The tree is fully determined by the options and the seed, so runs on
+// different machines or commits measure the same input.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_PATH_LENGTH 4096
+
+// Directory names that ccodemerge skips
+static const char *const EXCLUDED_NAMES[] = {"build", "node_modules", "target", "dist", ".venv", ".cache"};
+#define EXCLUDED_NAMES_COUNT (sizeof(EXCLUDED_NAMES) / sizeof(EXCLUDED_NAMES[0]))
+
+// Build files, at most one of each per directory
+static const char *const BUILD_NAMES[] = {"Makefile", "CMakeLists.txt", "meson.build", "BUILD.bazel"};
+#define BUILD_NAMES_COUNT (sizeof(BUILD_NAMES) / sizeof(BUILD_NAMES[0]))
+
+// How file sizes are drawn
+typedef enum
+{
+    SIZE_FIXED,      // Every file has the same size
+    SIZE_UNIFORM,    // Uniform between a minimum and a maximum
+    SIZE_LOGNORMAL   // Log-normal around a median, like real source trees
+} SizeKind;
+
+// Generator settings
+typedef struct
+{
+    int depth;              // Directory levels below the root
+    int fanout;             // Subdirectories per directory
+    long files;             // Files to create, spread over all directories
+    SizeKind size_kind;
+    double size_a;          // Fixed size, minimum or median
+    double size_b;          // Maximum or sigma
+    double excluded_ratio;  // Share of directories with an excluded name
+    double symlink_ratio;   // Share of files that are symlinks to other files
+    uint64_t seed;
+} TreeOptions;
+
+// Directory of the generated tree
+typedef struct
+{
+    char *path;
+    unsigned build_files;  // Bit set of the BUILD_NAMES already created
+} TreeDir;
+
+static uint64_t rng_state;
+
+// xorshift64* generator, deterministic for a given seed
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+// Uniform double in [0, 1)
+static double rng_double(void)
+{
+    return (double)(rng_next() >> 11) / 9007199254740992.0;
+}
+
+// Draw a file size from the configured distribution
+static size_t draw_size(const TreeOptions *opts)
+{
+    double size = opts->size_a;
+    if (opts->size_kind == SIZE_UNIFORM)
+    {
+        size = opts->size_a + rng_double() * (opts->size_b - opts->size_a);
+    }
+    else if (opts->size_kind == SIZE_LOGNORMAL)
+    {
+        // Box-Muller transform
+        double u = rng_double(), v = rng_double();
+        double normal = sqrt(-2.0 * log(u > 0 ? u : 1e-12)) * cos(2.0 * M_PI * v);
+        size = opts->size_a * exp(opts->size_b * normal);
+    }
+    return size < 1 ? 1 : (size_t)size;
+}
+
+// Parse a size distribution: fixed:N, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA
+static int parse_distribution(const char *arg, TreeOptions *opts)
+{
+    double a = 0, b = 0;
+    if (sscanf(arg, "fixed:%lf", &a) == 1)
+        opts->size_kind = SIZE_FIXED;
+    else if (sscanf(arg, "uniform:%lf:%lf", &a, &b) == 2 && b >= a)
+        opts->size_kind = SIZE_UNIFORM;
+    else if (sscanf(arg, "lognormal:%lf:%lf", &a, &b) == 2)
+        opts->size_kind = SIZE_LOGNORMAL;
+    else
+        return -1;
+    opts->size_a = a;
+    opts->size_b = b;
+    return a > 0 ? 0 : -1;
+}
+
+// Create the directory tree breadth first and collect all directories
+static TreeDir *create_dirs(const char *root, const TreeOptions *opts, size_t *count)
+{
+    size_t total = 1, level = 1;
+    for (int d = 0; d < opts->depth; d++)
+    {
+        level *= (size_t)opts->fanout;
+        total += level;
+    }
+    TreeDir *dirs = calloc(total, sizeof(TreeDir));
+    if (!dirs)
+        return NULL;
+
+    dirs[0].path = strdup(root);
+    if (mkdir(root, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", root, strerror(errno));
+        return NULL;
+    }
+    size_t n = 1, level_start = 0, level_end = 1;
+    for (int d = 0; d < opts->depth; d++)
+    {
+        for (size_t parent = level_start; parent < level_end; parent++)
+        {
+            for (int i = 0; i < opts->fanout; i++)
+            {
+                char path[MAX_PATH_LENGTH];
+                if (rng_double() < opts->excluded_ratio)
+                    snprintf(path, sizeof(path), "%s/%s", dirs[parent].path,
+                             EXCLUDED_NAMES[rng_next() % EXCLUDED_NAMES_COUNT]);
+                else
+                    snprintf(path, sizeof(path), "%s/dir%d", dirs[parent].path, i);
+                // Two excluded names may collide, the directory is then shared
+                if (mkdir(path, 0755) == -1 && errno != EEXIST)
+                {
+                    fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+                    return NULL;
+                }
+                dirs[n++].path = strdup(path);
+            }
+        }
+        level_start = level_end;
+        level_end = n;
+    }
+    *count = n;
+    return dirs;
+}
+
+// Append generated C code to buf until it holds size bytes
+static size_t fill_code(char *buf, size_t size, long id, bool header)
+{
+    static const char license[] = "/*\n * Copyright (c) Synthetic Benchmark Authors\n"
+                                  " * SPDX-License-Identifier: MIT\n */\n\n";
+    size_t len = 0;
+    if (size > sizeof(license))
+    {
+        memcpy(buf, license, sizeof(license) - 1);
+        len = sizeof(license) - 1;
+    }
+    for (long line = 0; len < size; line++)
+    {
+        char text[160];
+        int n;
+        switch (rng_next() % 6)
+        {
+        case 0:
+            n = snprintf(text, sizeof(text), "// Helper %ld of unit %ld\n", line, id);
+            break;
+        case 1:
+            n = snprintf(text, sizeof(text), "\n");
+            break;
+        case 2:
+            n = snprintf(text, sizeof(text), header ? "int unit%ld_fn%ld(int value);\n"
+                                                    : "int unit%ld_fn%ld(int value) { return value * 3 + 1; }\n",
+                         id, line);
+            break;
+        case 3:
+            n = snprintf(text, sizeof(text), "static const char *name%ld = \"unit %ld // not a comment\";\n", line,
+                         id);
+            break;
+        case 4:
+            n = snprintf(text, sizeof(text), "/* block comment %ld */ #define VALUE_%ld_%ld %lu\n", line, id, line,
+                         (unsigned long)(rng_next() % 100000));
+            break;
+        default:
+            n = snprintf(text, sizeof(text), "    total += table[%lu] ^ 0x%lx;\n", (unsigned long)(rng_next() % 64),
+                         (unsigned long)(rng_next() & 0xffff));
+            break;
+        }
+        size_t take = (size_t)n < size - len ? (size_t)n : size - len;
+        memcpy(buf + len, text, take);
+        len += take;
+    }
+    return len;
+}
+
+// Write a file of the given size
+static int write_file(const char *path, const char *data, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ssize_t written = write(fd, data, len);
+    close(fd);
+    if (written != (ssize_t)len)
+    {
+        fprintf(stderr, "Write error for %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Create all files and symlinks. Symlinks are relative, so the tree can be moved.
+static int create_files(const char *root, TreeDir *dirs, size_t dir_count, const TreeOptions *opts)
+{
+    size_t root_len = strlen(root);
+    char **regular = calloc((size_t)opts->files, sizeof(char *));
+    size_t regular_count = 0;
+    char *buf = NULL;
+    size_t buf_size = 0;
+    if (!regular)
+        return -1;
+
+    int result = 0;
+    for (long i = 0; i < opts->files && result == 0; i++)
+    {
+        TreeDir *dir = &dirs[rng_next() % dir_count];
+        char path[MAX_PATH_LENGTH];
+        double kind = rng_double();
+
+        if (regular_count > 0 && rng_double() < opts->symlink_ratio)
+        {
+            snprintf(path, sizeof(path), "%s/link%ld.c", dir->path, i);
+            char target[MAX_PATH_LENGTH] = "";
+            for (const char *p = dir->path + root_len; *p; p++)
+            {
+                if (*p == '/')
+                    strcat(target, "../");
+            }
+            strcat(target, regular[rng_next() % regular_count] + root_len + 1);
+            if (symlink(target, path) == -1)
+            {
+                fprintf(stderr, "Error creating symlink %s: %s\n", path, strerror(errno));
+                result = -1;
+            }
+            continue;
+        }
+
+        unsigned build = (unsigned)(rng_next() % BUILD_NAMES_COUNT);
+        bool header = false;
+        if (kind < 0.05 && !(dir->build_files & (1u << build)))
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir->path, BUILD_NAMES[build]);
+            dir->build_files |= 1u << build;
+        }
+        else if (kind < 0.35)
+        {
+            snprintf(path, sizeof(path), "%s/unit%ld.h", dir->path, i);
+            header = true;
+        }
+        else if (kind < 0.85)
+        {
+            snprintf(path, sizeof(path), "%s/unit%ld.c", dir->path, i);
+        }
+        else
+        {
+            // Files ccodemerge does not pick up
+            snprintf(path, sizeof(path), "%s/notes%ld.txt", dir->path, i);
+        }
+
+        size_t size = draw_size(opts);
+        if (size > buf_size)
+        {
+            char *tmp = realloc(buf, size);
+            if (!tmp)
+            {
+                result = -1;
+                break;
+            }
+            buf = tmp;
+            buf_size = size;
+        }
+        size_t len = fill_code(buf, size, i, header);
+        if (write_file(path, buf, len) == -1)
+            result = -1;
+        else
+            regular[regular_count++] = strdup(path);
+    }
+
+    for (size_t i = 0; i < regular_count; i++)
+        free(regular[i]);
+    free(regular);
+    free(buf);
+    return result;
+}
+
+// Print command line help
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [OPTIONS] ROOT\n\n", prog);
+    printf("Generate a synthetic source tree for benchmarking ccodemerge.\n\n");
+    printf("Options:\n");
+    printf("  -d, --depth=N          Directory levels below ROOT (default 3)\n");
+    printf("  -f, --fanout=N         Subdirectories per directory (default 4)\n");
+    printf("  -n, --files=N          Number of files (default 2000)\n");
+    printf("  -s, --sizes=DIST       fixed:N, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA\n");
+    printf("                         (default lognormal:4000:1.0)\n");
+    printf("  -x, --excluded=RATIO   Share of directories with an excluded name (default 0.1)\n");
+    printf("  -l, --symlinks=RATIO   Share of files that are symlinks (default 0.02)\n");
+    printf("  -r, --seed=N           Random seed (default 1)\n");
+    printf("  -h, --help             Show this help and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+    TreeOptions opts = {3, 4, 2000, SIZE_LOGNORMAL, 4000, 1.0, 0.1, 0.02, 1};
+
+    static const struct option long_options[] = {
+        {"depth", required_argument, NULL, 'd'},
+        {"fanout", required_argument, NULL, 'f'},
+        {"files", required_argument, NULL, 'n'},
+        {"sizes", required_argument, NULL, 's'},
+        {"excluded", required_argument, NULL, 'x'},
+        {"symlinks", required_argument, NULL, 'l'},
+        {"seed", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:f:n:s:x:l:r:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            opts.depth = atoi(optarg);
+            break;
+        case 'f':
+            opts.fanout = atoi(optarg);
+            break;
+        case 'n':
+            opts.files = atol(optarg);
+            break;
+        case 's':
+            if (parse_distribution(optarg, &opts) == -1)
+            {
+                fprintf(stderr, "Invalid size distribution: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'x':
+            opts.excluded_ratio = atof(optarg);
+            break;
+        case 'l':
+            opts.symlink_ratio = atof(optarg);
+            break;
+        case 'r':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || opts.depth < 0 || opts.fanout < 1 || opts.files < 0)
+    {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // A zero state would make xorshift return zeros forever
+    rng_state = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    size_t dir_count = 0;
+    TreeDir *dirs = create_dirs(argv[optind], &opts, &dir_count);
+    if (!dirs)
+        return EXIT_FAILURE;
+    int result = create_files(argv[optind], dirs, dir_count, &opts);
+    for (size_t i = 0; i < dir_count; i++)
+        free(dirs[i].path);
+    free(dirs);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,252 @@
+// microbench - time ccodemerge's per-entry functions on real file name corpora
+//
+// Each fixture in bench/fixtures lists the files of an existing tree, one
+// relative path per line. The paths are fed through the same functions the
+// scan and sort use, and the time per call is reported.
+
+// Pull in the implementation so the static functions can be called directly
+#include "../libccodemerge.c"
+
+#define MIN_SECONDS 0.2  // Repeat each measurement for at least this long
+
+// File name corpus loaded from a fixture
+typedef struct
+{
+    char **paths;      // "./dir/file" as seen by scan_directory
+    char **names;      // File name part of each path
+    char **components; // Every directory name of every path
+    size_t count;
+    size_t component_count;
+} Corpus;
+
+// Keeps the compiler from dropping results
+static volatile size_t sink;
+static size_t compare_calls;
+
+// Monotonic clock in nanoseconds
+static double clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Append a string to a growing array
+static int push(char ***array, size_t *count, size_t *capacity, char *value)
+{
+    if (*count == *capacity)
+    {
+        size_t new_cap = *capacity ? *capacity * 2 : 1024;
+        char **tmp = realloc(*array, new_cap * sizeof(char *));
+        if (!tmp)
+            return -1;
+        *array = tmp;
+        *capacity = new_cap;
+    }
+    (*array)[(*count)++] = value;
+    return 0;
+}
+
+// Load a fixture and split its paths into names and directory components
+static int load_corpus(const char *file, Corpus *c)
+{
+    memset(c, 0, sizeof(*c));
+    FILE *f = fopen(file, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Error opening %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    size_t path_cap = 0, name_cap = 0, comp_cap = 0, name_count = 0;
+    char line[MAX_PATH_LENGTH];
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        char *path = strdup(line);
+        char *slash = strrchr(path, '/');
+        if (push(&c->paths, &c->count, &path_cap, path) == -1 ||
+            push(&c->names, &name_count, &name_cap, slash ? slash + 1 : path) == -1)
+            return -1;
+        // Directory names only, the file name is not checked against the list
+        char *copy = strdup(line);
+        char *last = strrchr(copy, '/');
+        *(last ? last : copy) = '\0';
+        for (char *part = strtok(copy, "/"); part; part = strtok(NULL, "/"))
+        {
+            if (push(&c->components, &c->component_count, &comp_cap, strdup(part)) == -1)
+                return -1;
+        }
+        free(copy);
+    }
+    fclose(f);
+    return 0;
+}
+
+// Run fn over all items of an array until MIN_SECONDS have passed, return ns per call
+static double time_calls(size_t (*fn)(char **items, size_t count), char **items, size_t count)
+{
+    size_t calls = 0;
+    double start = clock_ns(), elapsed;
+    do
+    {
+        sink += fn(items, count);
+        calls += count;
+        elapsed = clock_ns() - start;
+    } while (elapsed < MIN_SECONDS * 1e9);
+    return elapsed / (double)calls;
+}
+
+// Classify every file name
+static size_t run_categorize(char **names, size_t count)
+{
+    size_t matched = 0;
+    for (size_t i = 0; i < count; i++)
+        matched += categorize_file(names[i]) != CAT_COUNT;
+    return matched;
+}
+
+// Check every directory name against the exclusion list
+static size_t run_is_excluded(char **components, size_t count)
+{
+    size_t excluded = 0;
+    for (size_t i = 0; i < count; i++)
+        excluded += is_excluded_dir(components[i]);
+    return excluded;
+}
+
+// Check every path for an excluded directory
+static size_t run_contains_excluded(char **paths, size_t count)
+{
+    size_t excluded = 0;
+    for (size_t i = 0; i < count; i++)
+        excluded += contains_excluded_dir(paths[i]);
+    return excluded;
+}
+
+// qsort comparison by path, the order sort_entries must reproduce
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const FileEntry *)a)->path, ((const FileEntry *)b)->path);
+}
+
+// compare_entries, counting its calls
+static int counting_compare(const void *a, const void *b)
+{
+    compare_calls++;
+    return compare_entries(a, b);
+}
+
+// Sort shuffled copies of the corpus with qsort and compare_entries, and with
+// sort_entries. Reports the time per comparison and per qsort, and per
+// sort_entries call.
+static void time_sort(const Corpus *c, double *ns_per_compare, double *ms_per_sort, double *ms_per_sort_entries)
+{
+    FileEntry *entries = malloc(c->count * sizeof(FileEntry));
+    FileEntry *work = malloc(c->count * sizeof(FileEntry));
+    if (!entries || !work)
+        exit(EXIT_FAILURE);
+    // Absolute paths, like the scan produces
+    for (size_t i = 0; i < c->count; i++)
+    {
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "/home/user/src%s", c->paths[i] + 1);
+        entries[i] = (FileEntry){strdup(path), 0, 0};
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = c->count; i > 1; i--)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t j = (size_t)(state >> 33) % i;
+        FileEntry tmp = entries[i - 1];
+        entries[i - 1] = entries[j];
+        entries[j] = tmp;
+    }
+
+    // Count the comparisons once, then time the plain sort
+    memcpy(work, entries, c->count * sizeof(FileEntry));
+    compare_calls = 0;
+    qsort(work, c->count, sizeof(FileEntry), counting_compare);
+    size_t compares = compare_calls;
+
+    size_t sorts = 0;
+    double total = 0;
+    do
+    {
+        memcpy(work, entries, c->count * sizeof(FileEntry));
+        double start = clock_ns();
+        qsort(work, c->count, sizeof(FileEntry), compare_entries);
+        total += clock_ns() - start;
+        sorts++;
+    } while (total < MIN_SECONDS * 1e9);
+    sink += (size_t)work[0].path[0];
+
+    // The same order, checked once, then timed
+    FileEntry *expected = malloc(c->count * sizeof(FileEntry));
+    if (!expected)
+        exit(EXIT_FAILURE);
+    memcpy(expected, work, c->count * sizeof(FileEntry));
+    memcpy(work, entries, c->count * sizeof(FileEntry));
+    sort_entries(work, c->count);
+    for (size_t i = 0; i < c->count; i++)
+    {
+        if (strcmp(work[i].path, expected[i].path) != 0)
+        {
+            fprintf(stderr, "sort_entries and qsort disagree at %zu: %s, %s\n", i, work[i].path, expected[i].path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(expected);
+    size_t radix_sorts = 0;
+    double radix_total = 0;
+    do
+    {
+        memcpy(work, entries, c->count * sizeof(FileEntry));
+        double start = clock_ns();
+        sort_entries(work, c->count);
+        radix_total += clock_ns() - start;
+        radix_sorts++;
+    } while (radix_total < MIN_SECONDS * 1e9);
+    sink += (size_t)work[0].path[0];
+
+    *ms_per_sort_entries = radix_total / (double)radix_sorts / 1e6;
+    *ns_per_compare = total / (double)sorts / (double)compares;
+    *ms_per_sort = total / (double)sorts / 1e6;
+    for (size_t i = 0; i < c->count; i++)
+        free(entries[i].path);
+    free(entries);
+    free(work);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s FIXTURE...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-18s %-22s %10s %10s\n", "Corpus", "Function", "Items", "ns/call");
+    for (int i = 1; i < argc; i++)
+    {
+        Corpus c;
+        if (load_corpus(argv[i], &c) == -1)
+            return EXIT_FAILURE;
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+
+        printf("%-18s %-22s %10zu %10.1f\n", name, "categorize_file", c.count,
+               time_calls(run_categorize, c.names, c.count));
+        printf("%-18s %-22s %10zu %10.1f\n", name, "is_excluded_dir", c.component_count,
+               time_calls(run_is_excluded, c.components, c.component_count));
+        printf("%-18s %-22s %10zu %10.1f\n", name, "contains_excluded_dir", c.count,
+               time_calls(run_contains_excluded, c.paths, c.count));
+        double ns_per_compare, ms_per_sort, ms_per_sort_entries;
+        time_sort(&c, &ns_per_compare, &ms_per_sort, &ms_per_sort_entries);
+        printf("%-18s %-22s %10zu %10.1f  (%.3f ms per sort)\n", name, "compare_entries", c.count, ns_per_compare,
+               ms_per_sort);
+        printf("%-18s %-22s %10zu %10.1f  (%.3f ms per sort)\n", name, "sort_entries", c.count,
+               ms_per_sort_entries * 1e6 / (double)c.count, ms_per_sort_entries);
+    }
+    return EXIT_SUCCESS;
+}
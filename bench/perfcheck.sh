@@ -0,0 +1,129 @@
+#!/bin/sh
+# Compare the standard benchmark scenarios against bench/baseline.json and exit
+# with status 1 if wall time, syscall count or peak RSS regressed.
+#
+# Usage: bench/perfcheck.sh [--update]
+#   --update  Record a new baseline instead of comparing
+#
+# A metric counts as regressed only if both of these hold:
+#   - its median got worse by more than the tolerance
+#   - a one-sided Mann-Whitney U test finds the shift significant (p < PERFCHECK_ALPHA)
+# Noise within a run therefore does not fail the check, and neither do tiny but
+# consistent shifts.
+#
+# Settings from the environment:
+#   PERFCHECK_ITERATIONS      Runs per scenario (default 15)
+#   PERFCHECK_ALPHA           Significance level (default 0.01)
+#   PERFCHECK_TIME_TOLERANCE  Allowed wall time increase in percent (default 10)
+#   PERFCHECK_SYSCALL_TOLERANCE  Allowed syscall increase in percent (default 2)
+#   PERFCHECK_RSS_TOLERANCE   Allowed peak RSS increase in percent (default 10)
+#
+# Timings depend on the machine. Record the baseline on the machine that runs
+# the check.
+
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+baseline="$here/baseline.json"
+alpha=${PERFCHECK_ALPHA:-0.01}
+
+# The standard scenarios use the bench.sh defaults
+unset BENCH_DEPTH BENCH_FANOUT BENCH_FILES BENCH_SIZES BENCH_EXCLUDED BENCH_SYMLINKS BENCH_SEED BENCH_ARGS
+BENCH_ITERATIONS=${PERFCHECK_ITERATIONS:-15}
+export BENCH_ITERATIONS
+
+if [ "${1:-}" = "--update" ]; then
+    BENCH_RESULTS="$baseline" "$here/bench.sh"
+    echo "Baseline updated"
+    exit 0
+fi
+if [ ! -f "$baseline" ]; then
+    echo "No baseline at $baseline, run 'make perfcheck-baseline' first" >&2
+    exit 1
+fi
+
+current=$(mktemp)
+trap 'rm -f "$current"' EXIT
+BENCH_RESULTS="$current" "$here/bench.sh"
+echo
+
+# Print the samples of one scenario and metric from a results file, comma-separated
+samples() {
+    grep -o "\"$2\":{[^}]*}" "$1" | sed "s/.*\"$3\":\[\([^]]*\)\].*/\1/"
+}
+
+# Compare baseline and current samples. Prints the medians, the change, the
+# p-value and the verdict, and exits with status 1 on a regression.
+compare() {
+    awk -v base="$1" -v cur="$2" -v tolerance="$3" -v alpha="$alpha" '
+        function median(a, n,   s, i, j, t) {
+            for (i = 1; i <= n; i++) s[i] = a[i]
+            for (i = 2; i <= n; i++)
+                for (j = i; j > 1 && s[j - 1] > s[j]; j--) { t = s[j]; s[j] = s[j - 1]; s[j - 1] = t }
+            return n % 2 ? s[(n + 1) / 2] : (s[n / 2] + s[n / 2 + 1]) / 2
+        }
+        # Complementary error function, Abramowitz and Stegun 7.1.26
+        function erfc(x,   t, y) {
+            if (x < 0) return 2 - erfc(-x)
+            t = 1 / (1 + 0.3275911 * x)
+            y = t * (0.254829592 + t * (-0.284496736 + t * (1.421413741 + t * (-1.453152027 + t * 1.061405429))))
+            return y * exp(-x * x)
+        }
+        BEGIN {
+            n1 = split(base, b, ",")
+            n2 = split(cur, c, ",")
+            # Rank the pooled samples, ties get their average rank
+            n = 0
+            for (i = 1; i <= n1; i++) { n++; v[n] = b[i] + 0; g[n] = 1 }
+            for (i = 1; i <= n2; i++) { n++; v[n] = c[i] + 0; g[n] = 2 }
+            for (i = 2; i <= n; i++)
+                for (j = i; j > 1 && v[j - 1] > v[j]; j--) {
+                    t = v[j]; v[j] = v[j - 1]; v[j - 1] = t
+                    t = g[j]; g[j] = g[j - 1]; g[j - 1] = t
+                }
+            r2 = 0; ties = 0
+            for (i = 1; i <= n; i = j) {
+                for (j = i + 1; j <= n && v[j] == v[i]; j++) ;
+                k = j - i
+                ties += k * k * k - k
+                for (m = i; m < j; m++) if (g[m] == 2) r2 += (i + j - 1) / 2
+            }
+            # U of the current samples, large when they tend to be bigger
+            u = r2 - n2 * (n2 + 1) / 2
+            sigma = sqrt(n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1))))
+            p = sigma > 0 ? 0.5 * erfc((u - n1 * n2 / 2 - 0.5) / sigma / sqrt(2)) : 1
+            mb = median(b, n1); mc = median(c, n2)
+            change = mb > 0 ? (mc - mb) / mb * 100 : 0
+            regressed = change > tolerance && p < alpha
+            printf "%12.1f %12.1f %+8.1f%% %9.2g  %s\n", mb, mc, change, p, regressed ? "REGRESSION" : "ok"
+            exit regressed
+        }'
+}
+
+printf "%-12s %-11s %12s %12s %9s %9s  %s\n" "Scenario" "Metric" "Baseline" "Current" "Change" "p" "Result"
+status=0
+for scenario in scan-only write-only end-to-end; do
+    for metric in wall_ms syscalls max_rss_kb; do
+        case $metric in
+        wall_ms) tolerance=${PERFCHECK_TIME_TOLERANCE:-10} ;;
+        syscalls) tolerance=${PERFCHECK_SYSCALL_TOLERANCE:-2} ;;
+        max_rss_kb) tolerance=${PERFCHECK_RSS_TOLERANCE:-10} ;;
+        esac
+        base=$(samples "$baseline" "$scenario" "$metric")
+        cur=$(samples "$current" "$scenario" "$metric")
+        if [ -z "$base" ] || [ -z "$cur" ]; then
+            printf "%-12s %-11s missing samples\n" "$scenario" "$metric"
+            status=1
+            continue
+        fi
+        printf "%-12s %-11s " "$scenario" "$metric"
+        compare "$base" "$cur" "$tolerance" || status=1
+    done
+done
+
+if [ "$status" -ne 0 ]; then
+    echo "Performance check failed"
+else
+    echo "Performance check passed"
+fi
+exit "$status"
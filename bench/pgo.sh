@@ -0,0 +1,105 @@
+#!/bin/sh
+# Build ccodemerge with profile-guided optimization and measure the speedup.
+#
+# Steps:
+#   1. Build the regular binary and keep a copy as the reference
+#   2. Build an instrumented binary (make PGO=generate)
+#   3. Run it over the synthetic benchmark trees with the common option sets
+#   4. Rebuild with the collected profiles (make PGO=use)
+#   5. Time the reference and the optimized binary on the same tree
+#
+# The optimized binary replaces ./ccodemerge. The profiles are kept in
+# pgo-data/, so "make PGO=use" rebuilds with them without retraining.
+#
+# Settings from the environment:
+#   PGO_ITERATIONS  Timed runs per binary (default 20)
+#   BENCH_DIR       Where trees and outputs are kept (default /tmp/ccodemerge-bench)
+
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(cd "$here/.." && pwd)
+dir=${BENCH_DIR:-/tmp/ccodemerge-bench}
+iterations=${PGO_ITERATIONS:-20}
+make=${MAKE:-make}
+
+mkdir -p "$dir"
+reference="$dir/ccodemerge.reference"
+
+echo "Building the reference binary"
+rm -f "$root"/*.o "$root/libccodemerge.a" "$root/ccodemerge"
+$make -C "$root" --no-print-directory ccodemerge
+cp "$root/ccodemerge" "$reference"
+
+echo "Building the instrumented binary"
+rm -rf "$root/pgo-data"
+rm -f "$root"/*.o "$root/libccodemerge.a" "$root/ccodemerge"
+$make -C "$root" --no-print-directory PGO=generate ccodemerge
+
+# Training trees: the default benchmark tree, and one with many small files and
+# deep nesting so the scan and classification paths get their share
+train() {
+    tree="$dir/pgo-$1"
+    if [ ! -d "$tree" ]; then
+        echo "Generating $tree"
+        rm -rf "$tree.tmp"
+        "$here/gentree" $2 "$tree.tmp"
+        mv "$tree.tmp" "$tree"
+    fi
+    out="$dir/pgo.out"
+    for opts in "--dry-run" "" "-s -c" "-d -t" "-b copy -u" "-m 64K -H 20 -T 20" \
+        "-f jsonl" "-f json" "-f xml" "-f archive" "-z gzip" "-z zstd"; do
+        echo "  $1: ${opts:-defaults}"
+        # Compression may not be compiled in, those runs fail harmlessly
+        (cd "$tree" && "$root/ccodemerge" $opts -o "$out" >/dev/null 2>&1) || true
+    done
+    rm -f "$out"
+}
+echo "Collecting profiles"
+train default "--depth=3 --fanout=6 --files=5000 --sizes=lognormal:4000:1.0 --excluded=0.1 --symlinks=0.02 --seed=1"
+train small "--depth=5 --fanout=4 --files=20000 --sizes=lognormal:800:1.2 --excluded=0.2 --symlinks=0.05 --seed=2"
+
+echo "Building the optimized binary"
+rm -f "$root"/*.o "$root/libccodemerge.a" "$root/ccodemerge"
+$make -C "$root" --no-print-directory PGO=use ccodemerge
+
+# Compare both binaries on the standard benchmark tree. The runs alternate
+# between the binaries so drift in the machine's load hits both alike, and the
+# CPU time of each phase is compared, since that is what the profile changes.
+tree="$dir/pgo-default"
+out="$dir/pgo.out"
+samples="$dir/pgo-samples.txt"
+: >"$samples"
+echo "Comparing on $tree, $iterations runs per binary"
+i=0
+while [ "$i" -le "$iterations" ]; do
+    for build in reference pgo; do
+        [ "$build" = reference ] && binary="$reference" || binary="$root/ccodemerge"
+        stats=$(cd "$tree" && "$binary" -s -c -o "$out" --stats=json | tail -n 1)
+        # The first round only warms the page cache
+        [ "$i" -gt 0 ] && echo "$stats" | sed "s/^/$build /" >>"$samples"
+    done
+    i=$((i + 1))
+done
+rm -f "$out"
+
+# Print the median of a field over the runs of one build, in milliseconds
+median() {
+    grep "^$1 " "$samples" | sed "s/.*$2\([0-9.]*\).*/\1/" | sort -n |
+        awk '{ v[NR] = $1 * 1000 } END { print NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+echo
+printf "%-12s %14s %14s %9s\n" "Median" "Reference ms" "PGO ms" "Speedup"
+for metric in scan-cpu write-cpu total-cpu total-wall; do
+    case $metric in
+    scan-cpu) pattern='"scan":{"wall":[0-9.]*,"cpu":' ;;
+    write-cpu) pattern='"write":{"wall":[0-9.]*,"cpu":' ;;
+    total-cpu) pattern='},"wall":[0-9.]*,"cpu":' ;;
+    total-wall) pattern='},"wall":' ;;
+    esac
+    ref=$(median reference "$pattern")
+    pgo=$(median pgo "$pattern")
+    awk -v m="$metric" -v r="$ref" -v p="$pgo" \
+        'BEGIN { printf "%-12s %14.3f %14.3f %8.2fx\n", m, r, p, (p > 0 ? r / p : 0) }'
+done
+rm -f "$reference" "$samples"
@@ -1,522 +1,1193 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_PATH_LENGTH 4096
+#include "ccodemerge.h"
+
 #define PROGB_WIDTH 50
-#define VERSION "1.2"
+#define OPT_TRACE 256
+#define OPT_PERF_COUNTERS 257
+#define OPT_INCLUDE_CATEGORY 258
+#define OPT_EXCLUDE_CATEGORY 259
+#define OPT_EXCLUDE 260
+#define OPT_EXT 261
+#define OPT_BATCH 262
+#define OPT_BATCH_MEMORY 263
+#define OPT_SORT_MEMORY 264
+#define OPT_STREAM 265
+#define OPT_BATCH_FORMAT 266
+#define DEFAULT_BATCH_MEMORY (1024LL * 1024 * 1024)
+#define BATCH_RESERVE_STEP (1024 * 1024)  // Growth of a job's reservation while it scans
+
+// File name extensions of the output formats
+static const char *const FORMAT_EXTENSIONS[] = {"txt", "cma", "jsonl", "json", "xml"};
+
+static const char *const PHASE_NAMES[CCM_PHASE_COUNT] = {"scan", "sort", "write"};
 
-// Data structure to store a list of files with dynamic allocation
+static const char *const PERF_EVENT_NAMES[CCM_PERF_COUNT] = {"cycles", "instructions", "cache-misses",
+                                                             "branch-misses", "context-switches"};
+
+// Scan filters from the command line, applied to every context
 typedef struct
 {
-    char **items;     // Array of file paths
-    size_t count;     // Current number of items
-    size_t capacity;  // Total capacity of the array
-} FileList;
+    uint32_t categories;      // Bit mask of the merged categories
+    const char **excludes;    // --exclude globs
+    int exclude_count;
+    const char **extensions;  // --ext arguments
+    int extension_count;
+} Filters;
 
-// Enumeration of supported file categories
-typedef enum
+// One repository of a batch manifest and the outcome of its merge
+typedef struct
 {
-    CAT_MAKEFILE,  // GNU Make files
-    CAT_MESON,     // Meson build system files
-    CAT_CMAKE,     // CMake build system files
-    CAT_AUTOTOOLS, // GNU Autotools files
-    CAT_NINJA,     // Ninja build system files
-    CAT_BAZEL,     // Bazel build system files
-    CAT_QMAKE,     // QMake (Qt) build system files
-    CAT_SCONS,     // SCons build system files
-    CAT_HEADER,    // C/C++ header files
-    CAT_SOURCE,    // C/C++ source files
-    CAT_COUNT      // Total number of categories (must be last)
-} FileCategory;
-
-// Structure to map filenames to their categories
+    char *root;
+    char *output;
+    bool ok;
+    size_t files;
+    uint64_t bytes_written;
+    double wall[CCM_PHASE_COUNT];
+    double total;     // Seconds from the start of its scan to the end of its merge
+    size_t reserved;  // Bytes of the batch budget the job holds
+    char error[512];
+} BatchJob;
+
+// Repositories merged by a pool of worker threads. Each worker takes the next
+// job from the manifest, so the pool stays busy however the repository sizes
+// vary. Jobs reserve their memory from a shared budget before the scan, and
+// more as their file lists grow.
 typedef struct
 {
-    const char *filename;   // Name or extension of the file
-    FileCategory category;  // Corresponding category
-} BuildFile;
-
-// Array of known build system files and their categories
-static const BuildFile BUILD_FILES[] = {
-    {"Makefile", CAT_MAKEFILE},
-    {"makefile", CAT_MAKEFILE},
-    {"GNUmakefile", CAT_MAKEFILE},
-    {"meson.build", CAT_MESON},
-    {"meson_options.txt", CAT_MESON},
-    {"CMakeLists.txt", CAT_CMAKE},
-    {"CMakeCache.txt", CAT_CMAKE},
-    {".cmake", CAT_CMAKE}, // Für .cmake Dateien
-    {"configure.ac", CAT_AUTOTOOLS},
-    {"configure.in", CAT_AUTOTOOLS},
-    {"Makefile.am", CAT_AUTOTOOLS},
-    {"Makefile.in", CAT_AUTOTOOLS},
-    {"build.ninja", CAT_NINJA},
-    {".ninja", CAT_NINJA}, // Für .ninja Dateien
-    {"WORKSPACE", CAT_BAZEL},
-    {"BUILD", CAT_BAZEL},
-    {"BUILD.bazel", CAT_BAZEL},
-    {".bzl", CAT_BAZEL}, // Für Bazel Skripte
-    {".pro", CAT_QMAKE}, // Qt Project Dateien
-    {".pri", CAT_QMAKE}, // Qt Include Dateien
-    {"SConstruct", CAT_SCONS},
-    {"SConscript", CAT_SCONS},
-};
-
-// Calculate the number of build file types
-static const size_t BUILD_FILES_COUNT = sizeof(BUILD_FILES) / sizeof(BUILD_FILES[0]);
-
-// List of directories to exclude from processing
-static const char *EXCLUDED_DIRS[] = {
-    ".cache",
-    ".env",
-    ".idea",
-    ".venv",
-    "build",
-    "builddir",
-    "cmake-build-debug",
-    "cmake-build-release",    // CMake release build directory
-    "dist",
-    "env",
-    "node_modules",
-    "target",
-    "venv",
-    ".git",
-    ".vscode",
-    ".vs",                    // Visual Studio directory
-    ".pytest_cache",          // Python test cache
-    "__pycache__",            // Python bytecode cache
-    "out",                    // Common output directory
-    "bin",                    // Binary output directory
-    "obj",                    // Object files directory
-    "Debug",                  // Visual Studio debug build
-    "Release",                // Visual Studio release build
-    "x64",                    // Visual Studio 64-bit builds
-    "x86",                    // Visual Studio 32-bit builds
-    "deps",                   // Dependencies directory
-    "vendor",                 // Third-party code
-    "external",               // External dependencies
-    "third_party",            // Third-party libraries
-    ".github",                // GitHub specific files
-    ".gitlab",                // GitLab specific files
-    "coverage",               // Code coverage reports
-    "docs/_build",            // Documentation builds
-    "logs"                    // Log files directory
-};
-
-// Calculate the number of excluded directories
-static const size_t EXCLUDED_DIRS_COUNT = sizeof(EXCLUDED_DIRS) / sizeof(EXCLUDED_DIRS[0]);
-
-// Compare function for string sorting (used by qsort)
-static int compare_strings(const void *a, const void *b)
+    BatchJob *jobs;
+    size_t count;
+    size_t next;              // Next job to start
+    const CcmOptions *opts;
+    const CcmSink *sink;      // Template for the file sink of each job
+    const Filters *filters;
+    bool dry_run;
+    bool json;
+    size_t sort_memory;       // Memory limit of each file list, 0 for none
+    size_t budget;            // Memory jobs may hold at the same time
+    size_t reserved;
+    size_t holders;           // Jobs holding part of the budget
+    size_t stalled;           // Holders waiting for more
+    size_t failed;
+    pthread_mutex_t lock;
+    pthread_cond_t released;  // Signalled when a job returns its memory or stalls
+} Batch;
+
+// Scan state of one batch job
+typedef struct
 {
-    return strcmp(*(const char **)a, *(const char **)b);
-}
+    Batch *batch;
+    BatchJob *job;
+    CcmFileSet *files;
+    size_t overhead;  // Memory the merge needs besides the file list
+} BatchScan;
 
-// Prüft, ob ein Verzeichnis ausgeschlossen werden soll (lineare Suche statt bsearch)
-static bool is_excluded_dir(const char *dirname)
+// Parse a size such as 4096, 64K or 2M
+static off_t parse_size(const char *str)
 {
-    for (size_t i = 0; i < EXCLUDED_DIRS_COUNT; i++) {
-        if (strcmp(dirname, EXCLUDED_DIRS[i]) == 0)
-            return true;
+    char *end;
+    errno = 0;
+    long long value = strtoll(str, &end, 10);
+    if (errno || end == str || value < 0)
+        return -1;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        value *= 1024;
+        // fall through
+    case 'M':
+        value *= 1024;
+        // fall through
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    default:
+        break;
     }
-    return false;
+    return *end ? -1 : (off_t)value;
 }
 
-// Check if a filename has a specific file extension
-static bool has_extension(const char *filename, const char *ext)
+// Category with the name str[0..len), CCM_CAT_COUNT if there is none
+static CcmCategory find_category(const char *str, size_t len)
 {
-    const char *dot = strrchr(filename, '.');
-    return dot && strcmp(dot, ext) == 0;
+    int cat = 0;
+    while (cat < CCM_CAT_COUNT && (strlen(ccm_category_name((CcmCategory)cat)) != len ||
+                                   strncmp(str, ccm_category_name((CcmCategory)cat), len) != 0))
+        cat++;
+    return (CcmCategory)cat;
 }
 
-// Check if a string ends with a specific suffix
-static bool ends_with(const char *str, const char *suffix)
+// Parse a comma-separated list of category names into a bit mask
+static int parse_categories(const char *list, uint32_t *mask)
 {
-    size_t str_len = strlen(str);
-    size_t suffix_len = strlen(suffix);
-
-    if (suffix_len > str_len)
+    while (*list)
     {
-        return false;
+        size_t len = strcspn(list, ",");
+        CcmCategory cat = find_category(list, len);
+        if (cat == CCM_CAT_COUNT)
+            return -1;
+        *mask |= 1u << cat;
+        list += len;
+        if (*list == ',')
+            list++;
     }
+    return 0;
+}
 
-    return strcmp(str + str_len - suffix_len, suffix) == 0;
+// Parse EXT[:CATEGORY] and add it to the context, the category defaults to source
+static int add_extension(CcmContext *ctx, const char *arg)
+{
+    char ext[256];
+    const char *colon = strchr(arg, ':');
+    size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    CcmCategory cat = colon ? find_category(colon + 1, strlen(colon + 1)) : CCM_CAT_SOURCE;
+    if (len == 0 || len >= sizeof(ext) || cat == CCM_CAT_COUNT)
+        return -1;
+    memcpy(ext, arg, len);
+    ext[len] = '\0';
+    return ccm_add_extension(ctx, ext, cat);
 }
 
-// Determine the category of a file based on its name or extension
-static FileCategory categorize_file(const char *filename)
+// Apply the command line filters to a context
+static int apply_filters(CcmContext *ctx, const Filters *filters)
 {
-    // First check for build system files
-    for (size_t i = 0; i < BUILD_FILES_COUNT; i++)
+    ccm_set_categories(ctx, filters->categories);
+    for (int i = 0; i < filters->exclude_count; i++)
     {
-        // Check for exact filename matches
-        if (strcmp(filename, BUILD_FILES[i].filename) == 0)
-        {
-            return BUILD_FILES[i].category;
-        }
-        // Check for extension matches (like .cmake, .ninja, .bzl)
-        if (BUILD_FILES[i].filename[0] == '.' && ends_with(filename, BUILD_FILES[i].filename))
+        if (ccm_add_exclude(ctx, filters->excludes[i]) == -1)
         {
-            return BUILD_FILES[i].category;
+            fprintf(stderr, "Memory allocation error\n");
+            return -1;
         }
     }
-
-    // Then check for header files
-    if (has_extension(filename, ".h") ||
-        has_extension(filename, ".hpp") ||
-        has_extension(filename, ".hxx") ||
-        has_extension(filename, ".hh"))
+    for (int i = 0; i < filters->extension_count; i++)
     {
-        return CAT_HEADER;
+        if (add_extension(ctx, filters->extensions[i]) == -1)
+        {
+            fprintf(stderr, "Invalid extension: %s\n", filters->extensions[i]);
+            return -1;
+        }
     }
+    return 0;
+}
 
-    // Finally check for source files
-    if (has_extension(filename, ".c") ||
-        has_extension(filename, ".cpp") ||
-        has_extension(filename, ".cxx") ||
-        has_extension(filename, ".cc"))
+// Scan visitor collecting the files of all roots
+static int add_file(const CcmEntry *entry, void *user)
+{
+    if (ccm_files_add(user, entry) == -1)
     {
-        return CAT_SOURCE;
+        // Running out of memory is reported by the caller, this is a failed spill
+        if (errno != ENOMEM)
+            fprintf(stderr, "Error spilling the file list: %s\n", strerror(errno));
+        return -1;
     }
+    return 0;
+}
 
-    return CAT_COUNT;  // File type not recognized
+// Visitor adding the file sizes of a dry run up per category
+static int sum_sizes(const CcmEntry *entry, void *user)
+{
+    long long *bytes = user;
+    bytes[entry->category] += entry->size;
+    return 0;
 }
 
-// Initialize an empty FileList structure
-static void init_filelist(FileList *list)
+// Directory for the spilled runs of the file list
+static const char *temp_dir(void)
 {
-    list->items = NULL;
-    list->count = 0;
-    list->capacity = 0;
+    const char *dir = getenv("TMPDIR");
+    return dir && *dir ? dir : "/tmp";
 }
 
-// Free all memory associated with a FileList
-static void free_filelist(FileList *list)
+// Print library errors and warnings
+static void print_error(const char *message, void *user)
 {
-    for (size_t i = 0; i < list->count; i++)
-        free(list->items[i]);
-    free(list->items);
-    init_filelist(list);
+    (void)user;
+    fprintf(stderr, "%s\n", message);
 }
 
-// Add a new file path to the FileList, growing the array if needed
-static int add_to_filelist(FileList *list, const char *path)
+// Display a progress bar showing the current processing status
+static void print_progress(size_t current, size_t total, void *user)
 {
-    if (list->count >= list->capacity)
-    {
-        size_t new_cap = list->capacity ? list->capacity * 2 : 16;
-        char **tmp = realloc(list->items, new_cap * sizeof(char *));
-        if (!tmp)
-            return -1;
-        list->items = tmp;
-        list->capacity = new_cap;
-    }
+    (void)user;
+    if (total == 0)
+        return;
 
-    list->items[list->count] = strdup(path);
-    if (!list->items[list->count])
-        return -1;
-    list->count++;
-    return 0;
+    int width = PROGB_WIDTH - 2;
+    int pos = (int)((double)current / total * width);
+    fprintf(stderr, "\r[");
+    for (int i = 0; i < width; i++)
+        fputc(i < pos ? '=' : ' ', stderr);
+    fprintf(stderr, "] %3zu%%", (current * 100) / total);
+    fflush(stderr);
 }
 
-// Resolve a symbolic link to its target path
-static char *resolve_symlink(const char *path)
+// Print the compression ratio and speed
+static void print_compress_stats(FILE *stream, const CcmMergeResult *r, CcmCompress algo, int level)
 {
-    char *resolved = malloc(MAX_PATH_LENGTH);
-    if (!resolved)
-        return NULL;
+    double in_mb = (double)r->compressed_in / (1024.0 * 1024.0);
+    double out_mb = (double)r->compressed_out / (1024.0 * 1024.0);
+    fprintf(stream, "Compressed %.1f MiB to %.1f MiB (%.1f%%) with %s level %d, %d threads\n", in_mb, out_mb,
+            r->compressed_in ? 100.0 * (double)r->compressed_out / (double)r->compressed_in : 0.0,
+            algo == CCM_COMPRESS_ZSTD ? "zstd" : "gzip", level, r->compress_threads);
+    fprintf(stream, "Compression speed: %.1f MiB/s per thread, %.1f MiB/s overall\n",
+            r->compress_busy > 0 ? in_mb / r->compress_busy : 0.0,
+            r->compress_wall > 0 ? in_mb / r->compress_wall : 0.0);
+}
 
-    ssize_t len = readlink(path, resolved, MAX_PATH_LENGTH - 1);
-    if (len == -1)
+// Print the counters of every phase, as a table or as a single JSON object.
+// Events that could not be opened are shown as n/a or null.
+static void print_perf_counters(FILE *stream, bool json, const CcmStats *st)
+{
+    if (json)
     {
-        free(resolved);
-        return NULL;
+        fprintf(stream, "{\"perf_counters\":{");
+        for (int p = 0; p < CCM_PHASE_COUNT; p++)
+        {
+            fprintf(stream, "%s\"%s\":{", p ? "," : "", PHASE_NAMES[p]);
+            for (int i = 0; i < CCM_PERF_COUNT; i++)
+            {
+                if (!st->perf_available[i])
+                    fprintf(stream, "%s\"%s\":null", i ? "," : "", PERF_EVENT_NAMES[i]);
+                else
+                    fprintf(stream, "%s\"%s\":%llu", i ? "," : "", PERF_EVENT_NAMES[i],
+                            (unsigned long long)st->perf[p][i]);
+            }
+            fprintf(stream, "}");
+        }
+        fprintf(stream, "}}\n");
+        return;
     }
-    resolved[len] = '\0';
 
-    if (resolved[0] != '/')
+    fprintf(stream, "%-8s", "Phase");
+    for (int i = 0; i < CCM_PERF_COUNT; i++)
+        fprintf(stream, " %16s", PERF_EVENT_NAMES[i]);
+    fprintf(stream, " %6s\n", "IPC");
+    for (int p = 0; p < CCM_PHASE_COUNT; p++)
     {
-        char *dir = strdup(path);
-        char *last_slash = strrchr(dir, '/');
-        if (last_slash)
+        const uint64_t *v = st->perf[p];
+        fprintf(stream, "%-8s", PHASE_NAMES[p]);
+        for (int i = 0; i < CCM_PERF_COUNT; i++)
         {
-            *last_slash = '\0';
-            char temp[MAX_PATH_LENGTH];
-            snprintf(temp, MAX_PATH_LENGTH, "%s/%s", dir, resolved);
-            strcpy(resolved, temp);
+            if (!st->perf_available[i])
+                fprintf(stream, " %16s", "n/a");
+            else
+                fprintf(stream, " %16llu", (unsigned long long)v[i]);
         }
-        free(dir);
+        if (st->perf_available[CCM_PERF_CYCLES] && st->perf_available[CCM_PERF_INSTRUCTIONS] &&
+            v[CCM_PERF_CYCLES] > 0)
+            fprintf(stream, " %6.2f\n", (double)v[CCM_PERF_INSTRUCTIONS] / (double)v[CCM_PERF_CYCLES]);
+        else
+            fprintf(stream, " %6s\n", "n/a");
+    }
+}
+
+// Print the --stats report, as a table or as a single JSON object
+static void print_stats(FILE *stream, bool json, size_t files, const CcmStats *st)
+{
+    double wall = 0, cpu = 0;
+    for (int i = 0; i < CCM_PHASE_COUNT; i++)
+    {
+        wall += st->wall[i];
+        cpu += st->cpu[i];
+    }
+    // Throughput is measured over the write phase, file rate over the whole run
+    double write_wall = st->wall[CCM_PHASE_WRITE] > 0 ? st->wall[CCM_PHASE_WRITE] : 1e-9;
+    double read_mbps = (double)st->bytes_read / 1e6 / write_wall;
+    double write_mbps = (double)st->bytes_written / 1e6 / write_wall;
+    double files_per_s = wall > 0 ? (double)files / wall : 0;
+    // File system calls issued by ccodemerge itself, directory reads are not counted
+    unsigned long long syscalls = st->opens + st->stats + st->reads + st->writes;
+    struct rusage usage;
+    long max_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+
+    if (json)
+    {
+        fprintf(stream, "{\"phases\":{");
+        for (int i = 0; i < CCM_PHASE_COUNT; i++)
+            fprintf(stream, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", i ? "," : "", PHASE_NAMES[i], st->wall[i],
+                    st->cpu[i]);
+        fprintf(stream,
+                "},\"wall\":%.6f,\"cpu\":%.6f,\"files\":%zu,\"directories\":%llu,\"entries\":%llu,"
+                "\"stats\":%llu,\"opens\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,"
+                "\"syscalls\":%llu,\"max_rss_kb\":%ld,"
+                "\"read_mb_per_s\":%.1f,\"write_mb_per_s\":%.1f,\"files_per_s\":%.0f}\n",
+                wall, cpu, files, (unsigned long long)st->directories, (unsigned long long)st->entries,
+                (unsigned long long)st->stats, (unsigned long long)st->opens, (unsigned long long)st->bytes_read,
+                (unsigned long long)st->bytes_written, syscalls, max_rss_kb, read_mbps, write_mbps, files_per_s);
+        return;
     }
 
-    return resolved;
+    fprintf(stream, "%-8s %10s %10s\n", "Phase", "Wall (s)", "CPU (s)");
+    for (int i = 0; i < CCM_PHASE_COUNT; i++)
+        fprintf(stream, "%-8s %10.4f %10.4f\n", PHASE_NAMES[i], st->wall[i], st->cpu[i]);
+    fprintf(stream, "%-8s %10.4f %10.4f\n", "total", wall, cpu);
+    fprintf(stream, "Directories:   %llu\n", (unsigned long long)st->directories);
+    fprintf(stream, "Entries:       %llu\n", (unsigned long long)st->entries);
+    fprintf(stream, "stat calls:    %llu\n", (unsigned long long)st->stats);
+    fprintf(stream, "Opens:         %llu\n", (unsigned long long)st->opens);
+    fprintf(stream, "Bytes read:    %llu (%.1f MB/s)\n", (unsigned long long)st->bytes_read, read_mbps);
+    fprintf(stream, "Bytes written: %llu (%.1f MB/s)\n", (unsigned long long)st->bytes_written, write_mbps);
+    fprintf(stream, "Files:         %zu (%.0f files/s)\n", files, files_per_s);
+    fprintf(stream, "Syscalls:      %llu (opens, stats, reads and writes)\n", syscalls);
+    fprintf(stream, "Peak RSS:      %ld KiB\n", max_rss_kb);
 }
 
-// Process a single file or directory entry
-static int process_entry(const char *path, const char *filename, FileList categories[CAT_COUNT])
+// Monotonic clock in seconds
+static double now_seconds(void)
 {
-    struct stat st;
-    if (lstat(path, &st) == -1)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Read a batch manifest: one repository per line, its root directory and its
+// output separated by a tab, or by spaces if there is no tab. Blank lines and
+// lines starting with # are ignored.
+static int load_manifest(const char *path, Batch *batch)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f)
     {
-        fprintf(stderr, "Error accessing %s: %s\n", path, strerror(errno));
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
         return -1;
     }
-
-    char *actual_path = NULL;
-    if (S_ISLNK(st.st_mode))
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int line_no = 0;
+    int result = 0;
+    while (result == 0 && (len = getline(&line, &line_cap, f)) != -1)
     {
-        actual_path = resolve_symlink(path);
-        if (!actual_path)
+        line_no++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        char *root = line + strspn(line, " \t");
+        if (*root == '\0' || *root == '#')
+            continue;
+        char *sep = strchr(root, '\t') ? strchr(root, '\t') : strpbrk(root, " ");
+        char *output = sep ? sep + strspn(sep, " \t") : NULL;
+        if (!output || *output == '\0')
         {
-            fprintf(stderr, "Error resolving symlink %s: %s\n", path, strerror(errno));
-            return -1;
+            fprintf(stderr, "%s:%d: expected a root directory and an output file\n", path, line_no);
+            result = -1;
+            break;
         }
-        if (stat(actual_path, &st) == -1)
+        *sep = '\0';
+        for (char *end = output + strlen(output); end > output && (end[-1] == ' ' || end[-1] == '\t');)
+            *--end = '\0';
+        if (batch->count == capacity)
         {
-            fprintf(stderr, "Error accessing symlink target %s: %s\n", actual_path, strerror(errno));
-            free(actual_path);
-            return -1;
+            capacity = capacity ? capacity * 2 : 64;
+            BatchJob *tmp = realloc(batch->jobs, capacity * sizeof(BatchJob));
+            if (!tmp)
+            {
+                fprintf(stderr, "Memory allocation error\n");
+                result = -1;
+                break;
+            }
+            batch->jobs = tmp;
+        }
+        BatchJob *job = &batch->jobs[batch->count];
+        memset(job, 0, sizeof(*job));
+        job->root = strdup(root);
+        job->output = strdup(output);
+        batch->count++;
+        if (!job->root || !job->output)
+        {
+            fprintf(stderr, "Memory allocation error\n");
+            result = -1;
         }
     }
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    return result;
+}
 
-    if (S_ISDIR(st.st_mode))
+// Print a string as a JSON string literal
+static void print_json_string(FILE *stream, const char *str)
+{
+    fputc('"', stream);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++)
     {
-        free(actual_path);
-        return 0;
+        if (*p == '"' || *p == '\\')
+            fprintf(stream, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(stream, "\\u%04x", *p);
+        else
+            fputc(*p, stream);
     }
+    fputc('"', stream);
+}
 
-    FileCategory cat = categorize_file(filename);
-    if (cat == CAT_COUNT)
+// Print the outcome of one repository, as a table row or as a JSON object
+static void print_batch_job(const BatchJob *job, bool json)
+{
+    if (json)
     {
-        free(actual_path);
-        return 0;
+        printf("{\"root\":");
+        print_json_string(stdout, job->root);
+        printf(",\"output\":");
+        print_json_string(stdout, job->output);
+        printf(",\"ok\":%s,\"files\":%zu,\"bytes_written\":%llu,\"scan\":%.6f,\"sort\":%.6f,\"write\":%.6f,"
+               "\"wall\":%.6f",
+               job->ok ? "true" : "false", job->files, (unsigned long long)job->bytes_written,
+               job->wall[CCM_PHASE_SCAN], job->wall[CCM_PHASE_SORT], job->wall[CCM_PHASE_WRITE], job->total);
+        if (!job->ok)
+        {
+            printf(",\"error\":");
+            print_json_string(stdout, job->error);
+        }
+        printf("}\n");
     }
-
-    if (filename[0] == '.' &&
-        cat != CAT_MAKEFILE &&
-        cat != CAT_MESON &&
-        cat != CAT_CMAKE &&
-        cat != CAT_NINJA &&
-        cat != CAT_BAZEL)
+    else
     {
-        free(actual_path);
-        return 0;
+        printf("%-6s %8zu files %14llu bytes %9.3f s scan %9.3f s write %9.3f s  %s -> %s\n",
+               job->ok ? "ok" : "FAILED", job->files, (unsigned long long)job->bytes_written,
+               job->wall[CCM_PHASE_SCAN], job->wall[CCM_PHASE_WRITE], job->total, job->root, job->output);
     }
+    fflush(stdout);
+}
 
-    char *abs_path = realpath(actual_path ? actual_path : path, NULL);
-    free(actual_path);
+// Print the errors of a batch job, prefixed with its root
+static void print_job_error(const char *message, void *user)
+{
+    const BatchJob *job = user;
+    fprintf(stderr, "%s: %s\n", job->root, message);
+}
 
-    if (!abs_path)
+// Grow the share of the budget a job holds to need bytes. The job waits while
+// that exceeds the budget, but only as long as another job holding memory is
+// not waiting as well and can still return some. So jobs never wait for each
+// other in a circle, and a job larger than the whole budget runs alone.
+static void batch_reserve(Batch *batch, BatchJob *job, size_t need)
+{
+    pthread_mutex_lock(&batch->lock);
+    bool holder = job->reserved > 0;
+    if (batch->reserved - job->reserved + need > batch->budget)
     {
-        fprintf(stderr, "Error resolving path %s: %s\n", path, strerror(errno));
-        return -1;
+        if (holder)
+        {
+            batch->stalled++;
+            pthread_cond_broadcast(&batch->released);
+        }
+        while (batch->reserved - job->reserved + need > batch->budget && batch->holders > batch->stalled)
+            pthread_cond_wait(&batch->released, &batch->lock);
+        if (holder)
+            batch->stalled--;
+    }
+    if (!holder)
+        batch->holders++;
+    batch->reserved += need - job->reserved;
+    job->reserved = need;
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Return the share of the budget a job holds
+static void batch_release(Batch *batch, BatchJob *job)
+{
+    pthread_mutex_lock(&batch->lock);
+    if (job->reserved > 0)
+    {
+        batch->reserved -= job->reserved;
+        batch->holders--;
+        job->reserved = 0;
+        pthread_cond_broadcast(&batch->released);
     }
+    pthread_mutex_unlock(&batch->lock);
+}
 
-    int result = add_to_filelist(&categories[cat], abs_path);
-    free(abs_path);
-    return result;
+// Scan visitor of a batch job, charging the growing file list to the budget
+static int batch_add_file(const CcmEntry *entry, void *user)
+{
+    BatchScan *scan = user;
+    if (add_file(entry, scan->files) == -1)
+        return -1;
+    size_t need = ccm_files_memory(scan->files) + scan->overhead;
+    if (need > scan->job->reserved)
+        batch_reserve(scan->batch, scan->job, need + BATCH_RESERVE_STEP);
+    return 0;
 }
 
-// Check if any part of the path contains an excluded directory
-static bool contains_excluded_dir(const char *path) {
-    char *path_copy = strdup(path);
-    if (!path_copy) {
-        return false;
+// Scan and merge one repository of a batch
+static void run_batch_job(Batch *batch, BatchJob *job)
+{
+    double start = now_seconds();
+    CcmContext *ctx = ccm_new();
+    CcmFileSet *files = ccm_files_new();
+    if (!ctx || !files || apply_filters(ctx, batch->filters) == -1 ||
+        (batch->sort_memory && ccm_files_set_memory_limit(files, batch->sort_memory, temp_dir()) == -1))
+    {
+        snprintf(job->error, sizeof(job->error), "Memory allocation error");
+        ccm_files_free(files);
+        ccm_free(ctx);
+        return;
     }
+    ccm_set_error_handler(ctx, print_job_error, job);
 
-    bool excluded = false;
-    char *token = strtok(path_copy, "/");
-    
-    while (token != NULL) {
-        if (is_excluded_dir(token)) {
-            excluded = true;
-            break;
+    // The merge buffers and the start of the file list are reserved up front,
+    // the rest of the list as the scan finds it
+    BatchScan scan = {batch, job, files, 0};
+    if (!batch->dry_run)
+        scan.overhead = CCM_MERGE_MEMORY + (batch->opts->compress != CCM_COMPRESS_NONE ? CCM_COMPRESS_MEMORY : 0);
+    batch_reserve(batch, job, scan.overhead + BATCH_RESERVE_STEP);
+    if (ccm_scan(ctx, job->root, batch_add_file, &scan) == 0 && ccm_files_sort(ctx, files) == 0)
+    {
+        job->files = ccm_files_count(files, CCM_CAT_COUNT);
+        if (batch->dry_run)
+        {
+            job->ok = true;
         }
-        token = strtok(NULL, "/");
+        else
+        {
+            CcmSink sink = *batch->sink;
+            sink.path = job->output;
+            job->ok = ccm_merge(ctx, files, batch->opts, &sink, NULL) == 0;
+        }
+    }
+    else if (errno == ENOMEM)
+    {
+        ccm_set_error_handler(ctx, NULL, NULL);
+        fprintf(stderr, "%s: Memory allocation error\n", job->root);
+        snprintf(job->error, sizeof(job->error), "Memory allocation error");
     }
+    if (!job->ok && job->error[0] == '\0')
+        snprintf(job->error, sizeof(job->error), "%s", ccm_last_error(ctx));
 
-    free(path_copy);
-    return excluded;
+    CcmStats st;
+    ccm_get_stats(ctx, &st);
+    memcpy(job->wall, st.wall, sizeof(job->wall));
+    job->bytes_written = st.bytes_written;
+    job->total = now_seconds() - start;
+    ccm_files_free(files);
+    ccm_free(ctx);
+    batch_release(batch, job);
 }
 
-// Recursively scan a directory for files to process
-static int scan_directory(const char *dir_path, FileList categories[CAT_COUNT])
+// Worker thread of a batch, runs jobs until the manifest is exhausted
+static void *batch_worker(void *arg)
 {
-    DIR *dir = opendir(dir_path);
-    if (!dir)
+    Batch *batch = arg;
+    pthread_mutex_lock(&batch->lock);
+    while (batch->next < batch->count)
     {
-        fprintf(stderr, "Error opening %s: %s\n", dir_path, strerror(errno));
-        return -1;
+        BatchJob *job = &batch->jobs[batch->next++];
+        pthread_mutex_unlock(&batch->lock);
+        run_batch_job(batch, job);
+        pthread_mutex_lock(&batch->lock);
+        if (!job->ok)
+            batch->failed++;
+        print_batch_job(job, batch->json);
     }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)))
+// Merge every repository of a manifest with a pool of threads. Returns the exit status.
+static int run_batch(const char *manifest, CcmOptions opts, const CcmSink *sink, const Filters *filters,
+                     int threads, size_t budget, size_t sort_memory, bool dry_run, bool json)
+{
+    Batch batch = {0};
+    if (load_manifest(manifest, &batch) == -1)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-
-        char sub_path[MAX_PATH_LENGTH];
-        int written = snprintf(sub_path, MAX_PATH_LENGTH, "%s/%s", dir_path, entry->d_name);
-        if (written >= MAX_PATH_LENGTH)
+        for (size_t i = 0; i < batch.count; i++)
         {
-            fprintf(stderr, "Path too long: %s/%s\n", dir_path, entry->d_name);
-            continue;
+            free(batch.jobs[i].root);
+            free(batch.jobs[i].output);
         }
+        free(batch.jobs);
+        return EXIT_FAILURE;
+    }
+    // The pool is the parallelism, each merge compresses on its own worker
+    opts.jobs = 1;
+    batch.opts = &opts;
+    batch.sink = sink;
+    batch.filters = filters;
+    batch.dry_run = dry_run;
+    batch.json = json;
+    batch.budget = budget;
+    batch.sort_memory = sort_memory;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.released, NULL);
 
-        // Check if the path contains any excluded directory
-        if (contains_excluded_dir(sub_path))
-            continue;
-
-        if (process_entry(sub_path, entry->d_name, categories) == -1)
-        {
-            closedir(dir);
-            return -1;
-        }
+    double start = now_seconds();
+    if ((size_t)threads > batch.count)
+        threads = batch.count ? (int)batch.count : 1;
+    pthread_t *pool = calloc((size_t)threads, sizeof(pthread_t));
+    int started = 0;
+    while (pool && started < threads && pthread_create(&pool[started], NULL, batch_worker, &batch) == 0)
+        started++;
+    // Without any thread the jobs run here
+    if (started == 0)
+        batch_worker(&batch);
+    for (int i = 0; i < started; i++)
+        pthread_join(pool[i], NULL);
+    free(pool);
+    double wall = now_seconds() - start;
 
-        struct stat st;
-        if (lstat(sub_path, &st) == -1)
-        {
-            fprintf(stderr, "Error accessing %s: %s\n", sub_path, strerror(errno));
-            continue;
-        }
+    if (json)
+        printf("{\"repositories\":%zu,\"failed\":%zu,\"threads\":%d,\"wall\":%.6f}\n", batch.count, batch.failed,
+               started ? started : 1, wall);
+    else
+        printf("%s %zu of %zu repositories in %.3f s with %d thread%s\n", dry_run ? "Scanned" : "Merged",
+               batch.count - batch.failed, batch.count, wall, started ? started : 1, started > 1 ? "s" : "");
 
-        if (S_ISDIR(st.st_mode))
-        {
-            if (scan_directory(sub_path, categories) == -1)
-            {
-                closedir(dir);
-                return -1;
-            }
-        }
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.released);
+    for (size_t i = 0; i < batch.count; i++)
+    {
+        free(batch.jobs[i].root);
+        free(batch.jobs[i].output);
     }
+    free(batch.jobs);
+    return batch.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-    closedir(dir);
+// Print the requested reports and write the trace
+static int finish_reports(CcmContext *ctx, FILE *stream, bool stats, bool stats_json, bool perf,
+                          const char *trace_path, size_t files)
+{
+    CcmStats st;
+    ccm_get_stats(ctx, &st);
+    if (stats)
+        print_stats(stream, stats_json, files, &st);
+    if (perf)
+        print_perf_counters(stream, stats_json, &st);
+    if (trace_path && ccm_write_trace(ctx, trace_path) == -1)
+    {
+        fprintf(stderr, "Error writing trace %s: %s\n", trace_path, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-// Display a progress bar showing the current processing status
-static void print_progress(size_t current, size_t total)
+// Print command line help
+static void print_usage(const char *prog)
 {
-    if (total == 0)
-        return;
-
-    int width = PROGB_WIDTH - 2;
-    int pos = (int)((double)current / total * width);
-    printf("\r[");
-    for (int i = 0; i < width; i++)
-        putchar(i < pos ? '=' : ' ');
-    printf("] %3zu%%", (current * 100) / total);
-    fflush(stdout);
+    printf("Usage: %s [OPTIONS] [DIR...]\n", prog);
+    printf("       %s [OPTIONS] --batch=MANIFEST\n", prog);
+    printf("       %s list ARCHIVE\n", prog);
+    printf("       %s extract ARCHIVE PATH...\n\n", prog);
+    printf("Merge all C/C++ sources and build files below the given directories (default: the current\n");
+    printf("directory) into one file\n\n");
+    printf("Options:\n");
+    printf("  -s, --strip-comments  Remove comments from C/C++ files\n");
+    printf("  -c, --compact         Remove blank lines from C/C++ files\n");
+    printf("  -d, --dedup-license   Write the most common leading comment block only once\n");
+    printf("  -b, --binary=MODE     Handle binary and non-UTF-8 files: summary (default), skip, copy\n");
+    printf("  -u, --validate-utf8   Validate whole files, not only their first 64 KiB\n");
+    printf("  -m, --max-file-size=SIZE\n");
+    printf("                        Truncate files larger than SIZE bytes (K, M, G suffixes)\n");
+    printf("  -H, --head-lines=N    Keep the first N lines of files over the size cap\n");
+    printf("  -T, --tail-lines=N    Keep the last N lines of files over the size cap\n");
+    printf("  -o, --output=FILE     Write to FILE instead of merged.txt, - for stdout\n");
+    printf("  -z, --compress=ALGO[:LEVEL]\n");
+    printf("                        Compress the output with gzip or zstd\n");
+    printf("  -j, --jobs=N          Number of worker threads (default: number of CPUs)\n");
+    printf("  -f, --format=FORMAT   Output format: text (default), archive, jsonl, json or xml\n");
+    printf("  -t, --toc             Start the text output with a table of contents\n");
+    printf("  -i, --incremental     Patch only the sections of changed files into the existing output\n");
+    printf("  -F, --fsync=MODE      Sync the output before publishing it: none (default), file, full\n");
+    printf("      --include-category=LIST\n");
+    printf("                        Merge only these categories (comma-separated, e.g. header,source)\n");
+    printf("      --exclude-category=LIST\n");
+    printf("                        Leave out these categories\n");
+    printf("      --exclude=GLOB    Skip files and directories matching GLOB, may be repeated\n");
+    printf("      --ext=EXT[:CATEGORY]\n");
+    printf("                        Also merge files ending in EXT, as CATEGORY (default: source)\n");
+    printf("      --batch=MANIFEST  Merge every ROOT OUTPUT pair listed in MANIFEST (- for stdin) in parallel\n");
+    printf("      --batch-format=FORMAT\n");
+    printf("                        Print one result line per repository as text (default) or json\n");
+    printf("      --batch-memory=SIZE\n");
+    printf("                        Memory the merges of a batch may hold at once (default: 1G)\n");
+    printf("      --sort-memory=SIZE\n");
+    printf("                        Keep at most SIZE bytes of the file list in memory, spill the rest\n");
+    printf("                        to sorted runs in $TMPDIR (at least 256K)\n");
+    printf("      --stream          Write the first category while the scan is still running\n");
+    printf("  -n, --dry-run         Scan and report the files per category, but write nothing\n");
+    printf("  -S, --stats[=FORMAT]  Report phase timings and I/O counters as text (default) or json\n");
+    printf("      --trace=FILE      Record scan, read, write and compression spans as a Chrome trace\n");
+    printf("      --perf-counters   Count cycles, instructions, cache and branch misses per phase\n");
+    printf("  -h, --help            Show this help and exit\n");
+    printf("  -v, --version         Show version and exit\n");
 }
 
-// Write a single file's contents to the output file
-static int write_file(FILE *dest, const char *path, bool *is_first)
+int main(int argc, char *argv[])
 {
-    FILE *src = fopen(path, "r");
-    if (!src)
+    CcmContext *ctx = ccm_new();
+    if (!ctx)
     {
-        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
-        return -1;
+        fprintf(stderr, "Memory allocation error\n");
+        return EXIT_FAILURE;
     }
+    ccm_set_error_handler(ctx, print_error, NULL);
 
-    struct stat st;
-    if (stat(path, &st) == -1 || st.st_size == 0)
+    if (argc >= 3 && strcmp(argv[1], "list") == 0)
     {
-        fclose(src);
-        return 0;
+        int result = ccm_archive_list(ctx, argv[2], stdout);
+        ccm_free(ctx);
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
+    if (argc >= 4 && strcmp(argv[1], "extract") == 0)
+    {
+        int result = ccm_archive_extract(ctx, argv[2], (const char *const *)argv + 3, argc - 3, STDOUT_FILENO);
+        ccm_free(ctx);
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    CcmOptions opts = {0};
+    CcmSink sink = {.type = CCM_SINK_FILE};
+    const char *output_path = NULL;
+    bool stats = false;
+    bool stats_json = false;
+    const char *trace_path = NULL;
+    bool perf = false;
+    bool dry_run = false;
+    uint32_t include_categories = 0;
+    uint32_t exclude_categories = 0;
+    Filters filters = {0};
+    const char *manifest = NULL;
+    off_t batch_memory = DEFAULT_BATCH_MEMORY;
+    bool batch_json = false;
+    off_t sort_memory = 0;
+    bool stream = false;
+    int status = EXIT_FAILURE;
 
-    if (*is_first)
+    filters.excludes = calloc((size_t)argc, sizeof(char *));
+    filters.extensions = calloc((size_t)argc, sizeof(char *));
+    if (!filters.excludes || !filters.extensions)
     {
-        fprintf(dest, "# Created by CCodemerge v%s\n# https://github.com/Lennart1978/ccodemerge\n\n", VERSION);
-        *is_first = false;
+        fprintf(stderr, "Memory allocation error\n");
+        goto done;
     }
 
-    fprintf(dest, "\nFile: %s\n\n", path);
+    static const struct option long_options[] = {
+        {"strip-comments", no_argument, NULL, 's'},
+        {"compact", no_argument, NULL, 'c'},
+        {"dedup-license", no_argument, NULL, 'd'},
+        {"binary", required_argument, NULL, 'b'},
+        {"validate-utf8", no_argument, NULL, 'u'},
+        {"max-file-size", required_argument, NULL, 'm'},
+        {"head-lines", required_argument, NULL, 'H'},
+        {"tail-lines", required_argument, NULL, 'T'},
+        {"output", required_argument, NULL, 'o'},
+        {"compress", required_argument, NULL, 'z'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"format", required_argument, NULL, 'f'},
+        {"toc", no_argument, NULL, 't'},
+        {"fsync", required_argument, NULL, 'F'},
+        {"incremental", no_argument, NULL, 'i'},
+        {"stats", optional_argument, NULL, 'S'},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {"perf-counters", no_argument, NULL, OPT_PERF_COUNTERS},
+        {"include-category", required_argument, NULL, OPT_INCLUDE_CATEGORY},
+        {"exclude-category", required_argument, NULL, OPT_EXCLUDE_CATEGORY},
+        {"exclude", required_argument, NULL, OPT_EXCLUDE},
+        {"ext", required_argument, NULL, OPT_EXT},
+        {"batch", required_argument, NULL, OPT_BATCH},
+        {"batch-format", required_argument, NULL, OPT_BATCH_FORMAT},
+        {"batch-memory", required_argument, NULL, OPT_BATCH_MEMORY},
+        {"sort-memory", required_argument, NULL, OPT_SORT_MEMORY},
+        {"stream", no_argument, NULL, OPT_STREAM},
+        {"dry-run", no_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {"version", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}
+    };
 
-    char buffer[8192];
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), src)) > 0)
+    int opt;
+    while ((opt = getopt_long(argc, argv, "scdb:um:H:T:o:z:j:f:tF:iS::nhv", long_options, NULL)) != -1)
     {
-        if (fwrite(buffer, 1, bytes, dest) != bytes)
+        switch (opt)
         {
-            fprintf(stderr, "Write error for %s: %s\n", path, strerror(errno));
-            fclose(src);
-            return -1;
+        case 's':
+            opts.strip_comments = true;
+            break;
+        case 'c':
+            opts.compact = true;
+            break;
+        case 'd':
+            opts.dedup_license = true;
+            break;
+        case 'b':
+            if (strcmp(optarg, "summary") == 0)
+                opts.binary_mode = CCM_BINARY_SUMMARY;
+            else if (strcmp(optarg, "skip") == 0)
+                opts.binary_mode = CCM_BINARY_SKIP;
+            else if (strcmp(optarg, "copy") == 0)
+                opts.binary_mode = CCM_BINARY_COPY;
+            else
+            {
+                fprintf(stderr, "Invalid binary mode: %s\n", optarg);
+                goto done;
+            }
+            break;
+        case 'u':
+            opts.validate_utf8 = true;
+            break;
+        case 'm':
+            opts.max_file_size = parse_size(optarg);
+            if (opts.max_file_size <= 0)
+            {
+                fprintf(stderr, "Invalid file size: %s\n", optarg);
+                goto done;
+            }
+            break;
+        case 'H':
+        case 'T':
+        {
+            char *end;
+            unsigned long lines = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0')
+            {
+                fprintf(stderr, "Invalid line count: %s\n", optarg);
+                goto done;
+            }
+            if (opt == 'H')
+                opts.head_lines = lines;
+            else
+                opts.tail_lines = lines;
+            break;
+        }
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'z':
+        {
+            // ALGO[:LEVEL]
+            opts.compress = CCM_COMPRESS_GZIP;
+            const char *colon = strchr(optarg, ':');
+            size_t name_len = colon ? (size_t)(colon - optarg) : strlen(optarg);
+            if (name_len == 4 && strncmp(optarg, "zstd", 4) == 0)
+                opts.compress = CCM_COMPRESS_ZSTD;
+            else if (name_len != 4 || strncmp(optarg, "gzip", 4) != 0)
+            {
+                fprintf(stderr, "Invalid compression: %s\n", optarg);
+                goto done;
+            }
+            opts.compress_level = 0;
+            if (colon)
+            {
+                char *end;
+                opts.compress_level = (int)strtol(colon + 1, &end, 10);
+                if (colon[1] == '\0' || *end != '\0' || opts.compress_level < 1 ||
+                    opts.compress_level > (opts.compress == CCM_COMPRESS_ZSTD ? 22 : 9))
+                {
+                    fprintf(stderr, "Invalid compression level: %s\n", colon + 1);
+                    goto done;
+                }
+            }
+            break;
+        }
+        case 'j':
+        {
+            char *end;
+            long jobs = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || jobs < 1 || jobs > 1024)
+            {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                goto done;
+            }
+            opts.jobs = (int)jobs;
+            break;
+        }
+        case 'f':
+            if (strcmp(optarg, "text") == 0)
+                opts.format = CCM_FORMAT_TEXT;
+            else if (strcmp(optarg, "archive") == 0)
+                opts.format = CCM_FORMAT_ARCHIVE;
+            else if (strcmp(optarg, "jsonl") == 0)
+                opts.format = CCM_FORMAT_JSONL;
+            else if (strcmp(optarg, "json") == 0)
+                opts.format = CCM_FORMAT_JSON;
+            else if (strcmp(optarg, "xml") == 0)
+                opts.format = CCM_FORMAT_XML;
+            else
+            {
+                fprintf(stderr, "Invalid format: %s\n", optarg);
+                goto done;
+            }
+            break;
+        case 't':
+            opts.toc = true;
+            break;
+        case 'F':
+            if (strcmp(optarg, "none") == 0)
+                sink.fsync = CCM_FSYNC_NONE;
+            else if (strcmp(optarg, "file") == 0)
+                sink.fsync = CCM_FSYNC_FILE;
+            else if (strcmp(optarg, "full") == 0)
+                sink.fsync = CCM_FSYNC_FULL;
+            else
+            {
+                fprintf(stderr, "Invalid fsync mode: %s\n", optarg);
+                goto done;
+            }
+            break;
+        case 'i':
+            sink.incremental = true;
+            break;
+        case 'S':
+            stats = true;
+            if (optarg && strcmp(optarg, "json") == 0)
+                stats_json = true;
+            else if (optarg && strcmp(optarg, "text") != 0)
+            {
+                fprintf(stderr, "Invalid stats format: %s\n", optarg);
+                goto done;
+            }
+            break;
+        case OPT_TRACE:
+            trace_path = optarg;
+            break;
+        case OPT_PERF_COUNTERS:
+            perf = true;
+            break;
+        case OPT_INCLUDE_CATEGORY:
+        case OPT_EXCLUDE_CATEGORY:
+            if (parse_categories(optarg, opt == OPT_INCLUDE_CATEGORY ? &include_categories : &exclude_categories) == -1)
+            {
+                fprintf(stderr, "Invalid category list: %s\n", optarg);
+                goto done;
+            }
+            break;
+        case OPT_EXCLUDE:
+            filters.excludes[filters.exclude_count++] = optarg;
+            break;
+        case OPT_EXT:
+            filters.extensions[filters.extension_count++] = optarg;
+            break;
+        case OPT_BATCH:
+            manifest = optarg;
+            break;
+        case OPT_BATCH_FORMAT:
+            if (strcmp(optarg, "json") == 0)
+                batch_json = true;
+            else if (strcmp(optarg, "text") != 0)
+            {
+                fprintf(stderr, "Invalid batch format: %s\n", optarg);
+                goto done;
+            }
+            break;
+        case OPT_BATCH_MEMORY:
+            batch_memory = parse_size(optarg);
+            if (batch_memory <= 0)
+            {
+                fprintf(stderr, "Invalid memory size: %s\n", optarg);
+                goto done;
+            }
+            break;
+        case OPT_SORT_MEMORY:
+            sort_memory = parse_size(optarg);
+            if (sort_memory <= 0)
+            {
+                fprintf(stderr, "Invalid memory size: %s\n", optarg);
+                goto done;
+            }
+            if (sort_memory < CCM_SORT_MEMORY_MIN)
+            {
+                fprintf(stderr, "--sort-memory must be at least %dK\n", CCM_SORT_MEMORY_MIN / 1024);
+                goto done;
+            }
+            break;
+        case OPT_STREAM:
+            stream = true;
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            status = EXIT_SUCCESS;
+            goto done;
+        case 'v':
+            printf("CCodemerge v%s\nSIMD kernels: %s\n", CCM_VERSION, ccm_simd_level());
+            status = EXIT_SUCCESS;
+            goto done;
+        default:
+            print_usage(argv[0]);
+            goto done;
         }
     }
 
-    if (ferror(src))
+    // The remaining arguments are the directories to merge
+    static const char *const default_roots[] = {"."};
+    const char *const *roots = optind < argc ? (const char *const *)argv + optind : default_roots;
+    int root_count = optind < argc ? argc - optind : 1;
+    filters.categories = (include_categories ? include_categories : ~0u) & ~exclude_categories;
+    if (apply_filters(ctx, &filters) == -1)
+        goto done;
+
+    // Report option conflicts in terms of the command line before the library checks them
+    if (opts.format != CCM_FORMAT_TEXT && (opts.toc || opts.dedup_license))
     {
-        fprintf(stderr, "Read error for %s: %s\n", path, strerror(errno));
-        fclose(src);
-        return -1;
+        fprintf(stderr, "--toc and --dedup-license are only supported by the text format\n");
+        goto done;
+    }
+    if ((opts.format == CCM_FORMAT_JSONL || opts.format == CCM_FORMAT_JSON || opts.format == CCM_FORMAT_XML) &&
+        opts.binary_mode == CCM_BINARY_COPY)
+    {
+        fprintf(stderr, "--binary=copy would produce invalid %s output\n",
+                opts.format == CCM_FORMAT_XML ? "XML" : "JSON");
+        goto done;
+    }
+    if ((opts.head_lines || opts.tail_lines) && !opts.max_file_size)
+    {
+        fprintf(stderr, "--head-lines and --tail-lines require --max-file-size\n");
+        goto done;
     }
 
-    fprintf(dest, "\n-------------------------- End of %s --------------------------\n", path);
-    fclose(src);
-    return 0;
-}
-
-int main(void)
-{
-    FileList categories[CAT_COUNT];
-    for (int i = 0; i < CAT_COUNT; i++)
-        init_filelist(&categories[i]);
-
-    if (scan_directory(".", categories) == -1)
+    // Default name: merged.<format extension>[.gz|.zst]
+    char default_output[32];
+    if (!output_path)
     {
-        for (int i = 0; i < CAT_COUNT; i++)
-            free_filelist(&categories[i]);
-        return EXIT_FAILURE;
+        snprintf(default_output, sizeof(default_output), "merged.%s%s", FORMAT_EXTENSIONS[opts.format],
+                 opts.compress == CCM_COMPRESS_NONE ? "" : opts.compress == CCM_COMPRESS_GZIP ? ".gz" : ".zst");
+        output_path = default_output;
+    }
+    bool to_stdout = strcmp(output_path, "-") == 0;
+    if (to_stdout)
+    {
+        sink.type = CCM_SINK_FD;
+        sink.fd = STDOUT_FILENO;
+    }
+    sink.path = output_path;
+    if (sink.incremental && (opts.format != CCM_FORMAT_TEXT || opts.toc || opts.compress != CCM_COMPRESS_NONE ||
+                             to_stdout))
+    {
+        fprintf(stderr, "--incremental needs an uncompressed text output file without --toc\n");
+        goto done;
+    }
+    // A spilled file list can only be streamed once, in order
+    if (sort_memory && (opts.toc || opts.dedup_license || opts.format == CCM_FORMAT_ARCHIVE || sink.incremental))
+    {
+        fprintf(stderr, "--sort-memory cannot be combined with --toc, --dedup-license, --incremental or the "
+                        "archive format\n");
+        goto done;
+    }
+    // Streaming writes before the scan has seen every file
+    if (stream && (opts.toc || opts.dedup_license || opts.format == CCM_FORMAT_ARCHIVE || sink.incremental))
+    {
+        fprintf(stderr, "--stream cannot be combined with --toc, --dedup-license, --incremental or the archive "
+                        "format\n");
+        goto done;
     }
+    if (ccm_check_options(ctx, &opts, &sink) == -1)
+        goto done;
 
-    FILE *output = fopen("merged.txt", "w");
-    if (!output)
+    if (manifest)
     {
-        fprintf(stderr, "Error creating output: %s\n", strerror(errno));
-        for (int i = 0; i < CAT_COUNT; i++)
-            free_filelist(&categories[i]);
-        return EXIT_FAILURE;
+        // Each repository gets a result line instead of the reports of a single run
+        if (optind < argc || output_path != default_output || stats || trace_path || perf || stream)
+        {
+            fprintf(stderr, "--batch takes the directories and outputs from the manifest and cannot be combined "
+                            "with directories, --output, --stats, --trace, --perf-counters or --stream; "
+                            "use --batch-format=json for JSON result lines\n");
+            goto done;
+        }
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        status = run_batch(manifest, opts, &sink, &filters, opts.jobs ? opts.jobs : cpus > 0 ? (int)cpus : 1,
+                           (size_t)batch_memory, (size_t)sort_memory, dry_run, batch_json);
+        goto done;
     }
 
-    bool is_first = true;
-    size_t total_files = 0;
-    size_t processed = 0;
+    if (perf)
+        ccm_enable_perf_counters(ctx);
+    if (trace_path)
+        ccm_enable_trace(ctx);
 
-    for (int i = 0; i < CAT_COUNT; i++)
+    CcmFileSet *files = ccm_files_new();
+    if (!files || (sort_memory && ccm_files_set_memory_limit(files, (size_t)sort_memory, temp_dir()) == -1))
     {
-        qsort(categories[i].items, categories[i].count, sizeof(char *), compare_strings);
-        total_files += categories[i].count;
+        fprintf(stderr, "Memory allocation error\n");
+        ccm_files_free(files);
+        goto done;
     }
 
-    for (int cat = 0; cat < CAT_COUNT; cat++)
+    // Keep stdout clean when it carries the merged output
+    FILE *messages = to_stdout ? stderr : stdout;
+    bool show_progress = !dry_run && isatty(STDERR_FILENO);
+    if (show_progress)
+        ccm_set_progress_handler(ctx, print_progress, NULL);
+
+    CcmMergeResult result;
+    int merge_result = 0;
+    if (stream && !dry_run)
+    {
+        merge_result = ccm_merge_stream(ctx, roots, root_count, files, &opts, &sink, &result);
+    }
+    else
     {
-        for (size_t i = 0; i < categories[cat].count; i++)
+        for (int i = 0; i < root_count; i++)
         {
-            if (write_file(output, categories[cat].items[i], &is_first) == -1)
+            if (ccm_scan(ctx, roots[i], add_file, files) != 0)
             {
-                fclose(output);
-                for (int j = 0; j < CAT_COUNT; j++)
-                    free_filelist(&categories[j]);
-                return EXIT_FAILURE;
+                if (errno == ENOMEM)
+                    fprintf(stderr, "Memory allocation error\n");
+                goto free_files;
             }
-            processed++;
-            print_progress(processed, total_files);
         }
+        if (ccm_files_sort(ctx, files) == -1)
+            goto free_files;
     }
+    size_t total_files = ccm_files_count(files, CCM_CAT_COUNT);
+
+    // Report what would be merged without opening a single file
+    if (dry_run)
+    {
+        long long bytes[CCM_CAT_COUNT] = {0};
+        if (ccm_files_foreach(ctx, files, sum_sizes, bytes) == -1)
+            goto free_files;
+        for (int i = 0; i < CCM_CAT_COUNT; i++)
+            printf("%-9s %8zu files %14lld bytes\n", ccm_category_name((CcmCategory)i),
+                   ccm_files_count(files, (CcmCategory)i), bytes[i]);
+        if (finish_reports(ctx, stdout, stats, stats_json, perf, trace_path, total_files) == 0)
+            status = EXIT_SUCCESS;
+        goto free_files;
+    }
+
+    if (!stream)
+        merge_result = ccm_merge(ctx, files, &opts, &sink, &result);
+    if (show_progress)
+        fputc('\n', stderr);
+    if (merge_result == -1)
+        goto free_files;
 
-    fclose(output);
-    for (int i = 0; i < CAT_COUNT; i++)
-        free_filelist(&categories[i]);
+    if (result.patched)
+        fprintf(messages, "Updated %zu of %zu files in %s\n", result.rewritten, total_files, output_path);
+    else
+        fprintf(messages, "Successfully merged %zu files into %s\n", total_files, to_stdout ? "stdout" : output_path);
+    if (result.omitted)
+        fprintf(messages, "%zu binary or non-UTF-8 files were %s\n", result.omitted,
+                opts.binary_mode == CCM_BINARY_SKIP ? "skipped" : "summarized");
+    if (opts.compress != CCM_COMPRESS_NONE)
+        print_compress_stats(messages, &result, opts.compress,
+                             opts.compress_level ? opts.compress_level : opts.compress == CCM_COMPRESS_ZSTD ? 3 : 6);
+    if (finish_reports(ctx, messages, stats, stats_json, perf, trace_path, total_files) == 0)
+        status = EXIT_SUCCESS;
 
-    printf("\nSuccessfully merged %zu files into merged.txt\n", total_files);
-    return EXIT_SUCCESS;
+free_files:
+    ccm_files_free(files);
+done:
+    free(filters.excludes);
+    free(filters.extensions);
+    ccm_free(ctx);
+    return status;
 }
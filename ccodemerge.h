@@ -0,0 +1,340 @@
+// ccodemerge.h - scan source trees and merge them into one file
+//
+// The library behind the ccodemerge command. A CcmContext holds everything a
+// run accumulates (statistics, trace events, performance counters and the
+// last error), so independent contexts can be used from different threads.
+// Nothing is printed: errors go to an optional handler and are kept for
+// ccm_last_error, progress goes to an optional callback.
+//
+// Typical use:
+//
+//     CcmContext *ctx = ccm_new();
+//     CcmFileSet *files = ccm_files_new();
+//     CcmOptions opts = {0};
+//     CcmSink sink = {.type = CCM_SINK_FILE, .path = "merged.txt"};
+//     if (ccm_scan_files(ctx, "src", files) == -1 || ccm_merge(ctx, files, &opts, &sink, NULL) == -1)
+//         fprintf(stderr, "%s\n", ccm_last_error(ctx));
+//     ccm_files_free(files);
+//     ccm_free(ctx);
+//
+// Functions returning int return 0 on success and -1 on error unless noted.
+
+#ifndef CCODEMERGE_H
+#define CCODEMERGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CCM_VERSION "1.2"
+
+// File categories, in the order they are merged
+typedef enum
+{
+    CCM_CAT_MAKEFILE,  // GNU Make files
+    CCM_CAT_MESON,     // Meson build system files
+    CCM_CAT_CMAKE,     // CMake build system files
+    CCM_CAT_AUTOTOOLS, // GNU Autotools files
+    CCM_CAT_NINJA,     // Ninja build system files
+    CCM_CAT_BAZEL,     // Bazel build system files
+    CCM_CAT_QMAKE,     // QMake (Qt) build system files
+    CCM_CAT_SCONS,     // SCons build system files
+    CCM_CAT_HEADER,    // C/C++ header files
+    CCM_CAT_SOURCE,    // C/C++ source files
+    CCM_CAT_COUNT      // Not a category: files that are not merged
+} CcmCategory;
+
+// Layouts of the merged output
+typedef enum
+{
+    CCM_FORMAT_TEXT,    // Plain text with "File:" headers and separator lines
+    CCM_FORMAT_ARCHIVE, // Binary archive with a table of contents
+    CCM_FORMAT_JSONL,   // One JSON object per line and file
+    CCM_FORMAT_JSON,    // One JSON array of file objects
+    CCM_FORMAT_XML      // XML document with one <file> element per file
+} CcmFormat;
+
+// How files that do not look like UTF-8 text are handled
+typedef enum
+{
+    CCM_BINARY_SUMMARY,  // Write a one-line summary instead of the content
+    CCM_BINARY_SKIP,     // Leave the file out completely
+    CCM_BINARY_COPY      // Copy the file unchanged
+} CcmBinaryMode;
+
+// Compression of the merged output
+typedef enum
+{
+    CCM_COMPRESS_NONE,
+    CCM_COMPRESS_GZIP,  // Concatenated gzip members
+    CCM_COMPRESS_ZSTD   // Concatenated zstd frames
+} CcmCompress;
+
+// When a file sink is flushed to stable storage before it is published
+typedef enum
+{
+    CCM_FSYNC_NONE,  // Rely on the kernel, the rename is still atomic for readers
+    CCM_FSYNC_FILE,  // fsync the file before the rename
+    CCM_FSYNC_FULL   // fsync the file before and its directory after the rename
+} CcmFsync;
+
+// Where the merged output goes
+typedef enum
+{
+    CCM_SINK_FILE,     // A path, replaced atomically once the merge succeeds
+    CCM_SINK_FD,       // An open descriptor, written sequentially and left open
+    CCM_SINK_BUFFER,   // A malloc'ed buffer returned in data and size
+    CCM_SINK_CALLBACK  // A function receiving the output in large blocks
+} CcmSinkType;
+
+// Phases timed in CcmStats
+typedef enum
+{
+    CCM_PHASE_SCAN,
+    CCM_PHASE_SORT,
+    CCM_PHASE_WRITE,
+    CCM_PHASE_COUNT
+} CcmPhase;
+
+// Events counted per phase after ccm_enable_perf_counters
+typedef enum
+{
+    CCM_PERF_CYCLES,
+    CCM_PERF_INSTRUCTIONS,
+    CCM_PERF_CACHE_MISSES,
+    CCM_PERF_BRANCH_MISSES,
+    CCM_PERF_CONTEXT_SWITCHES,
+    CCM_PERF_COUNT
+} CcmPerfEvent;
+
+typedef struct CcmContext CcmContext;
+typedef struct CcmFileSet CcmFileSet;
+
+// A file accepted by the scan
+typedef struct
+{
+    const char *path;      // Absolute path with symbolic links resolved
+    CcmCategory category;
+    int64_t size;          // Size and modification time at scan time
+    int64_t mtime;
+    int64_t mtime_nsec;    // Nanoseconds of the modification time
+} CcmEntry;
+
+// Called for every file the scan accepts. Returning anything but 0 stops the
+// scan, ccm_scan then returns that value.
+typedef int (*CcmVisitFn)(const CcmEntry *entry, void *user);
+
+// Receives every error and warning message, without a trailing newline
+typedef void (*CcmErrorFn)(const char *message, void *user);
+
+// Called by ccm_merge after each file
+typedef void (*CcmProgressFn)(size_t done, size_t total, void *user);
+
+// Receives the output of a CCM_SINK_CALLBACK sink. Returns 0, or -1 with
+// errno set to abort the merge.
+typedef int (*CcmWriteFn)(const void *data, size_t len, void *user);
+
+// How files are written. A zero-initialized struct gives the defaults.
+typedef struct
+{
+    bool strip_comments;  // Remove C/C++ comments from headers and sources
+    bool compact;         // Remove blank lines from headers and sources
+    bool dedup_license;   // Write the most common leading comment block only once (text only)
+    bool validate_utf8;   // Validate whole files instead of only the first 64 KiB
+    CcmBinaryMode binary_mode;
+    int64_t max_file_size;  // Truncate files after this many bytes, 0 for no limit
+    size_t head_lines;    // Lines kept from the start of files over the size cap
+    size_t tail_lines;    // Lines kept from the end of files over the size cap
+    CcmFormat format;
+    bool toc;             // Start the text output with a table of contents
+    CcmCompress compress;
+    int compress_level;   // 0 for the default of the algorithm
+    int jobs;             // Compression threads, 0 for the number of CPUs
+} CcmOptions;
+
+// Destination of ccm_merge
+typedef struct
+{
+    CcmSinkType type;
+    const char *path;     // CCM_SINK_FILE
+    CcmFsync fsync;       // CCM_SINK_FILE
+    bool incremental;     // CCM_SINK_FILE: patch only changed sections, keeps an index in path.ccmi
+    int fd;               // CCM_SINK_FD
+    CcmWriteFn write;     // CCM_SINK_CALLBACK
+    void *user;           // CCM_SINK_CALLBACK
+    char *data;           // CCM_SINK_BUFFER: set by ccm_merge, release it with free()
+    size_t size;          // CCM_SINK_BUFFER
+} CcmSink;
+
+// Outcome of ccm_merge
+typedef struct
+{
+    size_t files;            // Files in the set
+    size_t omitted;          // Binary or non-UTF-8 files that were skipped or summarized
+    size_t rewritten;        // Files written, less than files when an incremental run patched
+    bool patched;            // An incremental run updated the existing output in place
+    uint64_t compressed_in;  // Uncompressed and compressed bytes
+    uint64_t compressed_out;
+    int compress_threads;
+    double compress_busy;    // Seconds spent compressing, summed over threads
+    double compress_wall;    // Seconds from the start of compression to the end
+} CcmMergeResult;
+
+// Counters accumulated by a context over all its runs
+typedef struct
+{
+    double wall[CCM_PHASE_COUNT];  // Elapsed seconds per phase
+    double cpu[CCM_PHASE_COUNT];   // Process CPU seconds per phase, all threads
+    uint64_t directories;          // Directories opened by the scan
+    uint64_t entries;              // Directory entries seen by the scan
+    uint64_t stats;                // stat and lstat calls on scanned paths
+    uint64_t opens;                // Directories and source files opened
+    uint64_t bytes_read;           // Source bytes read or touched through a mapping
+    uint64_t bytes_written;        // Bytes written to the output, after compression
+    uint64_t reads;                // Source read calls
+    uint64_t writes;               // Output write calls
+    uint64_t perf[CCM_PHASE_COUNT][CCM_PERF_COUNT];  // Calling thread only
+    bool perf_available[CCM_PERF_COUNT];             // Events that could be opened
+} CcmStats;
+
+// Create and destroy a context
+CcmContext *ccm_new(void);
+void ccm_free(CcmContext *ctx);
+
+// Route error and warning messages to fn as well
+void ccm_set_error_handler(CcmContext *ctx, CcmErrorFn fn, void *user);
+
+// Last error message of the context, "" if there was none
+const char *ccm_last_error(const CcmContext *ctx);
+
+// Report the progress of ccm_merge to fn
+void ccm_set_progress_handler(CcmContext *ctx, CcmProgressFn fn, void *user);
+
+// Category of a file name, CCM_CAT_COUNT if such files are not merged
+CcmCategory ccm_classify(const char *filename);
+
+// Short name of a category ("make", "header", ...)
+const char *ccm_category_name(CcmCategory category);
+
+// Limit scans to the categories whose bits (1u << category) are set. All
+// categories are scanned by default.
+void ccm_set_categories(CcmContext *ctx, uint32_t mask);
+
+// Skip files and directories matching a shell glob. A glob containing a slash
+// is matched against the path relative to the scanned root, others against
+// the file or directory name. A matching directory is skipped with everything
+// below it.
+int ccm_add_exclude(CcmContext *ctx, const char *glob);
+
+// Merge files whose name ends with ext (".cu" or "cu") into category. Added
+// extensions take precedence over the built-in names.
+int ccm_add_extension(CcmContext *ctx, const char *ext, CcmCategory category);
+
+// Scan a directory tree and call visit for every accepted file. Build and
+// dependency directories are skipped, and so is everything the filters set
+// above reject. Returns 0, -1 on error, or the value returned by visit.
+int ccm_scan(CcmContext *ctx, const char *root, CcmVisitFn visit, void *user);
+
+// Set of files to merge, kept per category
+CcmFileSet *ccm_files_new(void);
+void ccm_files_free(CcmFileSet *files);
+
+// Keep at most about limit bytes of entries in memory. Beyond that, the
+// entries are sorted and spilled as runs to an unnamed file in temp_dir,
+// which ccm_merge and ccm_files_foreach merge back in path order. A spilled
+// set cannot be merged with a table of contents, license deduplication, the
+// archive format or incrementally. Limits below CCM_SORT_MEMORY_MIN are
+// raised to it.
+int ccm_files_set_memory_limit(CcmFileSet *files, size_t limit, const char *temp_dir);
+
+// Add a file, the path is copied. Fails with errno set if a spill fails.
+int ccm_files_add(CcmFileSet *files, const CcmEntry *entry);
+
+// Number of files in a category, or in all categories for CCM_CAT_COUNT
+size_t ccm_files_count(const CcmFileSet *files, CcmCategory category);
+
+// File number index of a category. The path stays valid until the set is
+// changed or freed. Only for sets that have not spilled.
+CcmEntry ccm_files_get(const CcmFileSet *files, CcmCategory category, size_t index);
+
+// Whether entries of the set were spilled to disk
+bool ccm_files_spilled(const CcmFileSet *files);
+
+// Call visit for every file of a sorted set, in the order of the merged
+// output. Returns 0, -1 on error, or the value returned by visit.
+int ccm_files_foreach(CcmContext *ctx, const CcmFileSet *files, CcmVisitFn visit, void *user);
+
+// Heap memory held by a set, without allocator overhead and spilled entries
+size_t ccm_files_memory(const CcmFileSet *files);
+
+// Sort every category by path, the order of the merged output. A spilled set
+// merges its runs on disk until they fit the memory limit. Returns -1 if the
+// spill file cannot be read or written.
+int ccm_files_sort(CcmContext *ctx, CcmFileSet *files);
+
+// Scan a tree into a set and sort it
+int ccm_scan_files(CcmContext *ctx, const char *root, CcmFileSet *files);
+
+// Check options and sink before a merge, so that errors show up before the scan
+int ccm_check_options(CcmContext *ctx, const CcmOptions *opts, const CcmSink *sink);
+
+// Approximate memory of a merge besides its set, and per compression thread
+#define CCM_MERGE_MEMORY (2 * 1024 * 1024)
+#define CCM_COMPRESS_MEMORY (4 * 1024 * 1024)
+
+// Smallest file set memory limit: the read buffers of a two-way run merge
+// and as much again for the entries gathered between spills
+#define CCM_SORT_MEMORY_MIN (256 * 1024)
+
+// Merge a sorted set into a sink. result may be NULL.
+int ccm_merge(CcmContext *ctx, const CcmFileSet *files, const CcmOptions *opts, CcmSink *sink,
+              CcmMergeResult *result);
+
+// Scan roots and merge them in one pass. Directories are walked in path
+// order, so the files of the first merged category arrive sorted and are
+// written while the scan is still running. The later categories collect in
+// files, which must be empty, and are written after the scan. files may
+// have a memory limit. A symbolic link that resolves to a path already
+// passed makes file and buffer sinks start over from the collected set; other
+// sinks fail. The table of contents, license deduplication, the archive
+// format and incremental sinks are not supported.
+int ccm_merge_stream(CcmContext *ctx, const char *const *roots, int root_count, CcmFileSet *files,
+                     const CcmOptions *opts, CcmSink *sink, CcmMergeResult *result);
+
+// Whether a compression format was compiled in
+bool ccm_compress_available(CcmCompress algo);
+
+// Print the table of contents of an archive
+int ccm_archive_list(CcmContext *ctx, const char *archive, FILE *stream);
+
+// Write the bodies of the given files from an archive to fd. Relative paths
+// are resolved against the current directory.
+int ccm_archive_extract(CcmContext *ctx, const char *archive, const char *const *paths, int count, int fd);
+
+// Record scan, read, write and compression spans from now on
+void ccm_enable_trace(CcmContext *ctx);
+
+// Write the recorded spans as a Chrome trace and discard them. Must not run
+// concurrently with a scan or merge of the same context.
+int ccm_write_trace(CcmContext *ctx, const char *path);
+
+// Count hardware events of the calling thread per phase. Events the kernel
+// or CPU refuse are reported once through the error handler and left out.
+void ccm_enable_perf_counters(CcmContext *ctx);
+
+// Copy the counters accumulated so far
+void ccm_get_stats(const CcmContext *ctx, CcmStats *stats);
+
+// Widest instruction set the SIMD kernels use on this CPU
+const char *ccm_simd_level(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,5400 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <libgen.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ccodemerge.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// The SIMD kernels are built for several instruction sets and the best one the
+// CPU supports is picked at load time through GNU indirect functions (ifunc).
+// The baseline versions use SSE2 on x86-64. Without ifunc, the AVX2 versions
+// replace them when the compiler targets AVX2 anyway.
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__ELF__)
+#define SIMD_DISPATCH 1
+#define SIMD_AVX2 1
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,popcnt")))
+#define IFUNC(resolver) __attribute__((ifunc(#resolver)))
+#elif defined(__AVX2__)
+#define SIMD_DISPATCH 0
+#define SIMD_AVX2 1
+#define TARGET_AVX2
+#else
+#define SIMD_DISPATCH 0
+#define SIMD_AVX2 0
+#endif
+
+#define MAX_PATH_LENGTH 4096
+#define COPY_BUFFER_SIZE 65536
+#define MAX_RAW_DELIM 16
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define ARCHIVE_MAGIC "CCMARCH1"
+#define ARCHIVE_VERSION 1
+#define INDEX_MAGIC "CCMINDX1"
+#define INDEX_VERSION 2
+#define INDEX_SUFFIX ".ccmi"
+#define TRACE_BUFFER_EVENTS 65536
+#define TRACE_ARG_SIZE 96
+#define SPILL_BUFFER_SIZE 65536
+#define SPILL_RECORD_SIZE 20  // int64 size, int64 mtime, uint32 path length, then the path and a NUL
+#define SORT_INSERTION_MAX 16      // Partitions this small are insertion sorted
+#define SORT_PARALLEL_MIN 32768    // Partitions this large are sorted on their own thread
+#define SORT_MAX_SPAWNS 64
+#define NSEC_PER_SEC 1000000000LL
+#define VERSION CCM_VERSION
+
+// A file found during the scan
+typedef struct
+{
+    char *path;       // Absolute file path
+    off_t size;       // File size at scan time
+    int64_t mtime_ns; // Modification time at scan time, in nanoseconds since the epoch
+} FileEntry;
+
+// Data structure to store a list of files with dynamic allocation
+typedef struct
+{
+    FileEntry *items; // Array of files
+    size_t count;     // Current number of items
+    size_t capacity;  // Total capacity of the array
+} FileList;
+
+// Enumeration of supported file categories
+typedef enum
+{
+    CAT_MAKEFILE,  // GNU Make files
+    CAT_MESON,     // Meson build system files
+    CAT_CMAKE,     // CMake build system files
+    CAT_AUTOTOOLS, // GNU Autotools files
+    CAT_NINJA,     // Ninja build system files
+    CAT_BAZEL,     // Bazel build system files
+    CAT_QMAKE,     // QMake (Qt) build system files
+    CAT_SCONS,     // SCons build system files
+    CAT_HEADER,    // C/C++ header files
+    CAT_SOURCE,    // C/C++ source files
+    CAT_COUNT      // Total number of categories (must be last)
+} FileCategory;
+
+// Short names of the categories, used in listings and structured output
+static const char *const CATEGORY_NAMES[CAT_COUNT] = {
+    "make", "meson", "cmake", "autotools", "ninja", "bazel", "qmake", "scons", "header", "source"
+};
+
+// The public enums mirror the internal ones, values are passed through unchanged
+_Static_assert((int)CCM_CAT_SOURCE == (int)CAT_SOURCE && (int)CCM_CAT_COUNT == (int)CAT_COUNT, "categories");
+
+// Structure to map filenames to their categories
+typedef struct
+{
+    const char *filename;   // Name or extension of the file
+    FileCategory category;  // Corresponding category
+} BuildFile;
+
+// Compression formats of the merged output
+typedef enum
+{
+    COMPRESS_NONE,
+    COMPRESS_GZIP,  // Concatenated gzip members, one per block
+    COMPRESS_ZSTD   // Concatenated zstd frames, one per block
+} CompressAlgo;
+
+// Processing state of a compression block
+typedef enum
+{
+    SLOT_FREE,    // Available for new input
+    SLOT_QUEUED,  // Waiting for a worker
+    SLOT_BUSY,    // Being compressed
+    SLOT_DONE     // Compressed, waiting to be written
+} SlotState;
+
+// One block of output that is compressed independently of all others
+typedef struct
+{
+    char *in;        // Uncompressed input
+    size_t in_len;
+    char *out;       // Compressed output
+    size_t out_len;
+    size_t out_cap;
+    SlotState state;
+    bool failed;
+} CompressSlot;
+
+// Pool of worker threads compressing output blocks in parallel. Blocks are
+// written in submission order, so the result is a valid multi-member stream.
+typedef struct
+{
+    CcmContext *ctx;
+    CompressAlgo algo;
+    int level;
+    pthread_t *threads;
+    int thread_count;
+    CompressSlot *slots;
+    size_t slot_count;
+    size_t next_fill;       // Sequence number of the next block to submit
+    size_t next_job;        // Sequence number of the next block to compress
+    size_t next_write;      // Sequence number of the next block to write
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // Signalled when a block is queued or on stop
+    pthread_cond_t done;    // Signalled when a block is compressed
+    uint64_t bytes_in;      // Uncompressed bytes submitted
+    uint64_t bytes_out;     // Compressed bytes written
+    double busy_seconds;    // Time spent compressing, summed over workers
+    double start_time;
+} Compressor;
+
+// When the output is flushed to stable storage before it is published
+typedef enum
+{
+    FSYNC_NONE,  // Rely on the kernel, the rename is still atomic for readers
+    FSYNC_FILE,  // fsync the file before the rename
+    FSYNC_FULL   // fsync the file before and its directory after the rename
+} FsyncMode;
+
+// Buffered output written straight to a file descriptor, or to a callback
+typedef struct
+{
+    CcmContext *ctx;  // Counts the writes
+    int fd;        // Destination file descriptor, -1 for a callback
+    Compressor *compressor;  // Compress blocks before writing, NULL for plain output
+    char *buf;     // Pending bytes, flushed in large batches
+    size_t len;    // Number of pending bytes
+    off_t offset;  // Total bytes written including pending ones
+    bool failed;   // A write failed, errno holds the reason
+    char *path;        // Final path of a regular output file, NULL otherwise
+    char *temp_path;   // Sibling temp file, NULL for O_TMPFILE or direct output
+    bool anonymous;    // Written to an O_TMPFILE that still needs a name
+    bool in_place;     // Patching an existing file, see output_open_in_place
+    bool keep_fd;      // The descriptor belongs to the caller and stays open
+    FsyncMode fsync_mode;
+    CcmWriteFn sink;   // Receives the output instead of fd
+    void *sink_user;
+} Output;
+
+// How files that do not look like UTF-8 text are handled
+typedef enum
+{
+    BINARY_SUMMARY,  // Write a one-line summary instead of the content
+    BINARY_SKIP,     // Leave the file out completely
+    BINARY_COPY      // Copy the file unchanged
+} BinaryMode;
+
+// Result of sniffing a file's content
+typedef enum
+{
+    TEXT_OK,           // UTF-8 text
+    TEXT_BINARY,       // Contains NUL bytes
+    TEXT_INVALID_UTF8  // Contains invalid UTF-8 sequences
+} TextKind;
+
+// Streaming UTF-8 validator, state survives chunk boundaries
+typedef struct
+{
+    int need;          // Continuation bytes still expected
+    unsigned char lo;  // Allowed range of the next continuation byte
+    unsigned char hi;
+} Utf8Validator;
+
+// Layouts of the merged output
+typedef enum
+{
+    FORMAT_TEXT,    // Plain text with "File:" headers and separator lines
+    FORMAT_ARCHIVE, // Binary archive with a table of contents, see ArchiveHeader
+    FORMAT_JSONL,   // One JSON object per line and file
+    FORMAT_JSON,    // One JSON array of file objects
+    FORMAT_XML      // XML document with one <file> element per file
+} OutputFormat;
+
+// Fixed header at the start of an archive. All fields are little-endian. The
+// header is followed by the table of contents (`count` ArchiveEntry records
+// sorted by path), the path names and the file bodies.
+typedef struct
+{
+    char magic[8];          // ARCHIVE_MAGIC
+    uint32_t version;       // ARCHIVE_VERSION
+    uint32_t count;         // Number of table of contents entries
+    uint64_t toc_offset;    // Start of the table of contents
+    uint64_t names_offset;  // Start of the path names, each NUL-terminated
+    uint64_t names_size;
+    uint64_t data_offset;   // Start of the file bodies
+    uint64_t data_size;
+    uint64_t reserved;
+} ArchiveHeader;
+
+// Table of contents entry of an archive
+typedef struct
+{
+    uint64_t name_offset;  // Path, relative to names_offset
+    uint32_t name_len;     // Path length without the terminating NUL
+    uint32_t category;     // FileCategory
+    uint64_t offset;       // Body, relative to data_offset
+    uint64_t length;       // Body length
+    uint32_t hash;         // CRC32C of the body
+    uint32_t reserved;
+} ArchiveEntry;
+
+_Static_assert((int)CCM_FORMAT_XML == (int)FORMAT_XML && (int)CCM_BINARY_COPY == (int)BINARY_COPY &&
+                   (int)CCM_COMPRESS_ZSTD == (int)COMPRESS_ZSTD && (int)CCM_FSYNC_FULL == (int)FSYNC_FULL,
+               "options");
+_Static_assert(sizeof(ArchiveHeader) == 64, "archive header layout");
+_Static_assert(sizeof(ArchiveEntry) == 40, "archive entry layout");
+_Static_assert(CCM_SORT_MEMORY_MIN >= 2 * SPILL_BUFFER_SIZE, "the smallest limit must hold a two-way merge");
+
+// Header of the section index kept next to a text output for incremental
+// runs. All fields are little-endian. The header is followed by `count`
+// IndexEntry records in output order and the NUL-terminated path names.
+typedef struct
+{
+    char magic[8];              // INDEX_MAGIC
+    uint32_t version;           // INDEX_VERSION
+    uint32_t count;             // Number of scanned files
+    uint32_t fingerprint;       // Hash of the options and the shared license block
+    uint32_t reserved;
+    uint64_t names_size;
+    uint64_t output_size;       // Identity of the output the index describes
+    uint64_t output_inode;
+    int64_t output_mtime_sec;
+    int64_t output_mtime_nsec;
+    int64_t started_ns;         // Coarse real time when the run that wrote it started
+} IndexHeader;
+
+// Index entry of one scanned file
+typedef struct
+{
+    uint64_t start;        // Output offset of the file's section
+    uint64_t length;       // Section length, 0 if the file was omitted
+    int64_t size;          // Source size and modification time in nanoseconds at the last run
+    int64_t mtime_ns;
+    uint32_t name_offset;  // Path, relative to the names
+    uint32_t category;     // FileCategory
+} IndexEntry;
+
+_Static_assert(sizeof(IndexHeader) == 72, "index header layout");
+_Static_assert(sizeof(IndexEntry) == 40, "index entry layout");
+
+// Section of one scanned file in a text output, as recorded in the index
+typedef struct
+{
+    const char *path;
+    FileCategory category;
+    off_t size;
+    int64_t mtime_ns;
+    off_t start;
+    off_t length;
+} IndexRecord;
+
+// Section index loaded from the last run
+typedef struct
+{
+    IndexRecord *records;
+    size_t count;
+    off_t output_size;
+    int64_t started_ns;  // Start of the last run, files modified since may have changed unseen
+    char *data;          // File contents, the record paths point into it
+} MergeIndex;
+
+// Location of one written file section, used to build an archive index
+typedef struct
+{
+    const char *path;
+    FileCategory category;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t lines;
+    uint32_t hash;
+} SectionRecord;
+
+// Options controlling how files are written to the merged output
+typedef struct
+{
+    bool strip_comments;  // Remove C/C++ comments from headers and sources
+    bool compact;         // Remove blank lines from headers and sources
+    bool dedup_license;   // Emit the most common leading comment block only once
+    bool validate_utf8;   // Validate whole files instead of only the first chunk
+    BinaryMode binary_mode;
+    off_t max_file_size;  // Truncate files after this many bytes (0 = no limit)
+    size_t head_lines;    // Lines kept from the start of files over the size cap
+    size_t tail_lines;    // Lines kept from the end of files over the size cap
+    OutputFormat format;
+    bool toc;             // Start the text output with a table of contents
+} MergeOptions;
+
+// Common leading comment block that is emitted once in the output header
+typedef struct
+{
+    char *text;    // Comment text, NULL if no block is shared by several files
+    size_t len;    // Length of the comment text
+    uint32_t hash; // CRC32C of the comment text
+    size_t count;  // Number of files starting with this block
+} LicenseBlock;
+
+// Entry of the hash table used to count leading comment blocks
+typedef struct
+{
+    uint32_t hash;
+    size_t len;
+    size_t count;
+    const char *path;  // First file that starts with this block
+} LicenseCandidate;
+
+// Phases of a merge run, the same as CcmPhase
+typedef enum
+{
+    PHASE_SCAN,
+    PHASE_SORT,
+    PHASE_WRITE,
+    PHASE_COUNT
+} Phase;
+
+static const char *const PHASE_NAMES[PHASE_COUNT] = {"scan", "sort", "write"};
+
+// Events counted per phase, the same as CcmPerfEvent
+typedef enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_EVENT_COUNT
+} PerfEvent;
+
+// Counters of the main thread. The hardware events form one group, so they
+// are always scheduled onto the PMU together and their ratios stay consistent.
+typedef struct
+{
+    bool enabled;
+    int fds[PERF_EVENT_COUNT];    // -1 for events that could not be opened
+    int leader;                   // fd of the hardware group leader, -1 without one
+    int slots[PERF_EVENT_COUNT];  // Position of an event in the group read, -1 if not grouped
+    int slot_count;
+} PerfCounters;
+
+// Timings and I/O counters, copied out by ccm_get_stats
+typedef struct
+{
+    double wall[PHASE_COUNT];  // Elapsed seconds per phase
+    double cpu[PHASE_COUNT];   // Process CPU seconds per phase, all threads
+    uint64_t directories;      // Directories opened by the scan
+    uint64_t entries;          // Directory entries seen by the scan
+    uint64_t stats;            // stat and lstat calls on scanned paths
+    uint64_t opens;            // Directories and source files opened
+    uint64_t bytes_read;       // Source bytes read or touched through a mapping
+    uint64_t bytes_written;    // Bytes written to the output, after compression
+    uint64_t reads;            // Source read calls
+    uint64_t writes;           // Output write calls
+    uint64_t perf[PHASE_COUNT][PERF_EVENT_COUNT];  // Perf counters, calling thread only
+} RunStats;
+
+_Static_assert((int)CCM_PHASE_COUNT == (int)PHASE_COUNT && (int)CCM_PERF_COUNT == (int)PERF_EVENT_COUNT, "stats");
+
+// Start of a timed phase
+typedef struct
+{
+    double wall;
+    double cpu;
+    uint64_t trace;  // Trace timestamp, 0 when tracing is off
+    uint64_t perf[PERF_EVENT_COUNT];
+} PhaseStart;
+
+// One complete ("X") event of the Chrome trace format
+typedef struct
+{
+    const char *name;      // Static strings only
+    const char *cat;
+    const char *arg_name;  // Key of the argument, NULL without one
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    char arg[TRACE_ARG_SIZE];  // The end of a longer value is kept
+} TraceEvent;
+
+// Event ring of one thread. Only the owning thread writes to it, so recording
+// needs no locks. Once full, the oldest events are overwritten. The rings are
+// read after all threads have finished.
+typedef struct TraceBuffer
+{
+    struct TraceBuffer *next;
+    uint64_t context;  // trace_id of the owning context
+    const char *thread_name;
+    int tid;
+    _Atomic uint64_t head;  // Events recorded so far
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+// File name suffix added with ccm_add_extension
+typedef struct
+{
+    char *suffix;  // With the leading dot
+    FileCategory category;
+} Extension;
+
+// Everything one library user accumulates. The statistics are only updated
+// from the thread that calls ccm_scan and ccm_merge.
+struct CcmContext
+{
+    CcmErrorFn error_fn;
+    void *error_user;
+    CcmProgressFn progress_fn;
+    void *progress_user;
+    char error[MAX_PATH_LENGTH + 256];  // Last error message
+    RunStats stats;
+    PerfCounters perf;
+    bool trace_enabled;
+    uint64_t trace_id;                       // Unique over the process lifetime
+    uint64_t trace_origin;                   // Timestamp that becomes 0 in the trace
+    _Atomic(TraceBuffer *) trace_buffers;    // Lock-free list of all thread buffers
+    _Atomic int trace_next_tid;
+    uint32_t categories;      // Bit mask of the categories the scan accepts
+    char **excludes;          // Globs of skipped files and directories
+    size_t exclude_count;
+    Extension *extensions;    // Checked before the built-in names
+    size_t extension_count;
+    bool sorted_scan;         // Walk every directory in path order (ccm_merge_stream)
+    bool entry_linked;        // The entry being visited was reached through a symbolic link
+};
+
+// Trace buffer of the calling thread. It belongs to the context with the id
+// in its context field, a thread working for another context registers anew.
+static _Thread_local TraceBuffer *trace_local;
+static _Atomic uint64_t trace_next_context;
+
+// Sorted run of one category in the spill file
+typedef struct
+{
+    off_t offset;
+    off_t length;      // Bytes in the spill file
+    size_t count;
+    int level;         // Merge passes its entries went through
+} SpillRun;
+
+// Set of files to merge. With a memory limit, the entries are sorted and
+// appended to an unnamed temp file whenever they outgrow the limit, as one run
+// per category. Runs are merged on disk, a fan-in that fits the limit at a
+// time, and FileCursor merges the rest back in path order.
+struct CcmFileSet
+{
+    FileList categories[CAT_COUNT];  // Entries not spilled yet
+    size_t path_bytes;               // Paths held by categories
+    size_t memory_limit;             // 0 for no limit
+    char *temp_dir;
+    int spill_fd;                    // -1 before the first spill
+    off_t spill_size;
+    SpillRun *runs[CAT_COUNT];       // Runs per category, oldest first
+    size_t run_count[CAT_COUNT];
+    size_t run_capacity[CAT_COUNT];
+    size_t spilled[CAT_COUNT];       // Entries per category in the runs
+    bool unsorted[CAT_COUNT];        // Entries in memory were added out of path order
+};
+
+// Buffered writer of one run
+typedef struct
+{
+    CcmFileSet *files;
+    char *buf;
+    size_t len;
+    SpillRun run;      // The run written so far
+} SpillWriter;
+
+// Buffered reader of one spilled run
+typedef struct
+{
+    int fd;
+    off_t pos;         // File offset of the next refill
+    size_t remaining;  // Entries not returned yet
+    char *buf;
+    size_t start;      // Unconsumed bytes are buf[start, len)
+    size_t len;
+    FileEntry entry;   // Current entry, its path points into buf
+} RunReader;
+
+// Iterates the files of one category in path order, merging the sorted runs
+// of a spilled set with the sorted entries still in memory
+typedef struct
+{
+    const FileList *memory;  // NULL when merging runs only
+    size_t memory_index;
+    RunReader *readers;
+    size_t reader_count;
+    size_t *heap;      // Sources with entries left, smallest path on top. Readers
+                       // are numbered by index, the memory list is reader_count.
+    size_t heap_size;
+    bool started;      // The top entry has been returned
+    bool failed;       // A run could not be read, errno holds the reason
+} FileCursor;
+
+// State shared by all write_file calls of one merge run
+typedef struct
+{
+    Output *out;
+    const MergeOptions *opts;
+    const LicenseBlock *license;
+    bool is_first;            // No file section has been written yet
+    off_t body_start;         // Output offset of the current file body
+    uint32_t body_hash;       // CRC32C of the current file body
+    uint64_t body_lines;      // Newlines in the current file body
+    char body_last;           // Last byte of the current file body
+    bool omitted;             // Structured formats: the current file has no content field
+    const FileList *categories;  // All files, for the table of contents
+    off_t toc_offset;         // Start of the reserved table of contents
+    size_t toc_size;
+    SectionRecord *sections;  // Written sections, for the archive index
+    size_t section_count;
+    size_t section_capacity;
+    off_t data_offset;        // Archive: start of the file bodies
+} Writer;
+
+// States of the streaming C/C++ lexer used by the comment stripper
+typedef enum
+{
+    LEX_CODE,          // Ordinary code
+    LEX_SLASH,         // Saw '/', might start a comment
+    LEX_LINE_COMMENT,  // Inside a // comment
+    LEX_BLOCK_COMMENT, // Inside a /* */ comment
+    LEX_BLOCK_STAR,    // Saw '*' inside a block comment
+    LEX_STRING,        // Inside a "..." literal
+    LEX_CHAR,          // Inside a '...' literal
+    LEX_RAW_DELIM,     // Reading the delimiter of R"delim(
+    LEX_RAW_BODY       // Inside the body of a raw string literal
+} LexState;
+
+// Streaming comment and blank-line stripper, state survives chunk boundaries
+typedef struct
+{
+    LexState state;
+    bool strip;             // Remove comments
+    bool compact;           // Remove blank lines
+    bool escape;            // Previous byte was a backslash
+    bool line_has_content;  // Current output line has non-blank content
+    bool line_had_comment;  // A comment was removed from the current line
+    bool continued;         // The previous line ended in a backslash
+    bool number;            // The identifier or number ending at prev[0] started with a digit
+    char last_out;          // Last byte written to the output
+    char prev[3];           // Last three code bytes, prev[0] is the newest
+    size_t pending_len;     // Buffered leading whitespace of the current line
+    char pending[256];
+    size_t raw_len;         // Length of the raw string delimiter
+    int raw_match;          // Matched length of )delim" (-1 = no match)
+    char raw_delim[MAX_RAW_DELIM];
+} CommentStripper;
+
+// Array of known build system files and their categories
+static const BuildFile BUILD_FILES[] = {
+    {"Makefile", CAT_MAKEFILE},
+    {"makefile", CAT_MAKEFILE},
+    {"GNUmakefile", CAT_MAKEFILE},
+    {"meson.build", CAT_MESON},
+    {"meson_options.txt", CAT_MESON},
+    {"CMakeLists.txt", CAT_CMAKE},
+    {"CMakeCache.txt", CAT_CMAKE},
+    {".cmake", CAT_CMAKE}, // Für .cmake Dateien
+    {"configure.ac", CAT_AUTOTOOLS},
+    {"configure.in", CAT_AUTOTOOLS},
+    {"Makefile.am", CAT_AUTOTOOLS},
+    {"Makefile.in", CAT_AUTOTOOLS},
+    {"build.ninja", CAT_NINJA},
+    {".ninja", CAT_NINJA}, // Für .ninja Dateien
+    {"WORKSPACE", CAT_BAZEL},
+    {"BUILD", CAT_BAZEL},
+    {"BUILD.bazel", CAT_BAZEL},
+    {".bzl", CAT_BAZEL}, // Für Bazel Skripte
+    {".pro", CAT_QMAKE}, // Qt Project Dateien
+    {".pri", CAT_QMAKE}, // Qt Include Dateien
+    {"SConstruct", CAT_SCONS},
+    {"SConscript", CAT_SCONS},
+};
+
+// Calculate the number of build file types
+static const size_t BUILD_FILES_COUNT = sizeof(BUILD_FILES) / sizeof(BUILD_FILES[0]);
+
+// List of directories to exclude from processing
+static const char *EXCLUDED_DIRS[] = {
+    ".cache",
+    ".env",
+    ".idea",
+    ".venv",
+    "build",
+    "builddir",
+    "cmake-build-debug",
+    "cmake-build-release",    // CMake release build directory
+    "dist",
+    "env",
+    "node_modules",
+    "target",
+    "venv",
+    ".git",
+    ".vscode",
+    ".vs",                    // Visual Studio directory
+    ".pytest_cache",          // Python test cache
+    "__pycache__",            // Python bytecode cache
+    "out",                    // Common output directory
+    "bin",                    // Binary output directory
+    "obj",                    // Object files directory
+    "Debug",                  // Visual Studio debug build
+    "Release",                // Visual Studio release build
+    "x64",                    // Visual Studio 64-bit builds
+    "x86",                    // Visual Studio 32-bit builds
+    "deps",                   // Dependencies directory
+    "vendor",                 // Third-party code
+    "external",               // External dependencies
+    "third_party",            // Third-party libraries
+    ".github",                // GitHub specific files
+    ".gitlab",                // GitLab specific files
+    "coverage",               // Code coverage reports
+    "docs/_build",            // Documentation builds
+    "logs"                    // Log files directory
+};
+
+// Calculate the number of excluded directories
+static const size_t EXCLUDED_DIRS_COUNT = sizeof(EXCLUDED_DIRS) / sizeof(EXCLUDED_DIRS[0]);
+
+#if !defined(__SSE4_2__) || !defined(__x86_64__)
+// CRC32C (Castagnoli) lookup table, used when SSE4.2 is not available
+static const uint32_t CRC32C_TABLE[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+#endif
+
+// Monotonic clock in nanoseconds, used for trace timestamps
+static uint64_t trace_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Give the calling thread its own trace buffer. Does nothing when tracing is off.
+static void trace_register(CcmContext *ctx, const char *thread_name)
+{
+    if (!ctx->trace_enabled || (trace_local && trace_local->context == ctx->trace_id))
+        return;
+    TraceBuffer *b = calloc(1, sizeof(*b));
+    if (!b)
+        return;
+    b->context = ctx->trace_id;
+    b->thread_name = thread_name;
+    b->tid = atomic_fetch_add(&ctx->trace_next_tid, 1) + 1;
+    b->next = atomic_load(&ctx->trace_buffers);
+    while (!atomic_compare_exchange_weak(&ctx->trace_buffers, &b->next, b))
+        ;
+    trace_local = b;
+}
+
+// Timestamp for the start of a span, 0 when tracing is off
+static uint64_t trace_begin(const CcmContext *ctx)
+{
+    return ctx->trace_enabled ? trace_clock() : 0;
+}
+
+// Record a span of the calling thread that started at start
+static void trace_end(const CcmContext *ctx, const char *name, const char *cat, const char *arg_name, const char *arg,
+                      uint64_t start)
+{
+    TraceBuffer *b = trace_local;
+    if (!ctx->trace_enabled || !b || b->context != ctx->trace_id)
+        return;
+    uint64_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+    TraceEvent *e = &b->events[head % TRACE_BUFFER_EVENTS];
+    e->name = name;
+    e->cat = cat;
+    e->arg_name = arg ? arg_name : NULL;
+    e->start_ns = start;
+    e->dur_ns = trace_clock() - start;
+    if (arg)
+    {
+        // Keep the end of long paths, starting at a character boundary
+        size_t len = strlen(arg);
+        if (len >= TRACE_ARG_SIZE)
+        {
+            arg += len - (TRACE_ARG_SIZE - 1);
+            while ((*arg & 0xC0) == 0x80)
+                arg++;
+        }
+        strcpy(e->arg, arg);
+    }
+    atomic_store_explicit(&b->head, head + 1, memory_order_release);
+}
+
+// Record an error message and pass it to the error handler
+__attribute__((format(printf, 2, 3)))
+static void ccm_error(CcmContext *ctx, const char *fmt, ...)
+{
+    int saved_errno = errno;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(ctx->error, sizeof(ctx->error), fmt, ap);
+    va_end(ap);
+    if (ctx->error_fn)
+        ctx->error_fn(ctx->error, ctx->error_user);
+    errno = saved_errno;
+}
+
+// Sort entries whose paths agree in their first depth bytes
+static void insertion_sort(FileEntry *items, size_t count, size_t depth)
+{
+    for (size_t i = 1; i < count; i++)
+    {
+        FileEntry tmp = items[i];
+        size_t j = i;
+        while (j > 0 && strcmp(items[j - 1].path + depth, tmp.path + depth) > 0)
+        {
+            items[j] = items[j - 1];
+            j--;
+        }
+        items[j] = tmp;
+    }
+}
+
+// Byte depth of a path as strcmp compares it
+static inline unsigned char path_key(const FileEntry *e, size_t depth)
+{
+    return (unsigned char)e->path[depth];
+}
+
+// Part of a sort handed to another thread
+typedef struct
+{
+    FileEntry *items;
+    size_t count;
+    size_t depth;
+    int threads;
+} SortTask;
+
+static void *sort_worker(void *arg);
+
+// Multikey quicksort (Bentley and Sedgewick): partition three ways on the byte
+// at depth, then sort the smaller and larger parts at the same depth and the
+// equal part one byte further. Unlike qsort with strcmp, no byte before depth
+// is looked at again. Parts of at least SORT_PARALLEL_MIN entries go to new
+// threads while threads is above 1.
+static void multikey_sort(FileEntry *items, size_t count, size_t depth, int threads)
+{
+    pthread_t spawned[SORT_MAX_SPAWNS];
+    SortTask tasks[SORT_MAX_SPAWNS];
+    int spawn_count = 0;
+
+    while (count > SORT_INSERTION_MAX)
+    {
+        // Median of three bytes as pivot
+        unsigned char a = path_key(&items[0], depth);
+        unsigned char b = path_key(&items[count / 2], depth);
+        unsigned char c = path_key(&items[count - 1], depth);
+        unsigned char pivot = a < b ? (b < c ? b : a < c ? c : a) : (a < c ? a : b < c ? c : b);
+
+        // [0, lt) below, [lt, gt) equal to and [gt, count) above the pivot
+        size_t lt = 0, i = 0, gt = count;
+        while (i < gt)
+        {
+            unsigned char key = path_key(&items[i], depth);
+            if (key < pivot)
+            {
+                FileEntry tmp = items[lt];
+                items[lt++] = items[i];
+                items[i++] = tmp;
+            }
+            else if (key > pivot)
+            {
+                FileEntry tmp = items[--gt];
+                items[gt] = items[i];
+                items[i] = tmp;
+            }
+            else
+                i++;
+        }
+
+        // Hand the lower part to a thread if it is big enough, otherwise
+        // recurse into the two smaller parts and loop on the largest one
+        SortTask parts[3] = {{items, lt, depth, 1},
+                             {items + lt, pivot ? gt - lt : 0, depth + 1, 1},
+                             {items + gt, count - gt, depth, 1}};
+        int largest = parts[0].count >= parts[1].count ? (parts[0].count >= parts[2].count ? 0 : 2)
+                                                       : (parts[1].count >= parts[2].count ? 1 : 2);
+        for (int p = 0; p < 3; p++)
+        {
+            if (p == largest || parts[p].count < 2)
+                continue;
+            if (threads > 1 && parts[p].count >= SORT_PARALLEL_MIN && spawn_count < SORT_MAX_SPAWNS)
+            {
+                SortTask *task = &tasks[spawn_count];
+                *task = parts[p];
+                task->threads = threads / 2;
+                if (pthread_create(&spawned[spawn_count], NULL, sort_worker, task) == 0)
+                {
+                    spawn_count++;
+                    threads -= task->threads;
+                    continue;
+                }
+            }
+            multikey_sort(parts[p].items, parts[p].count, parts[p].depth, 1);
+        }
+        items = parts[largest].items;
+        count = parts[largest].count;
+        depth = parts[largest].depth;
+    }
+    insertion_sort(items, count, depth);
+
+    for (int i = 0; i < spawn_count; i++)
+        pthread_join(spawned[i], NULL);
+}
+
+// Thread running one part of a multikey sort
+static void *sort_worker(void *arg)
+{
+    SortTask *task = arg;
+    multikey_sort(task->items, task->count, task->depth, task->threads);
+    return NULL;
+}
+
+// Sort entries by path in strcmp order. The prefix all paths share, usually
+// the scanned root, is skipped up front.
+static void sort_entries(FileEntry *items, size_t count)
+{
+    if (count < 2)
+        return;
+    size_t prefix = strlen(items[0].path);
+    for (size_t i = 1; i < count && prefix > 0; i++)
+    {
+        const char *path = items[i].path;
+        size_t j = 0;
+        while (j < prefix && path[j] == items[0].path[j])
+            j++;
+        prefix = j;
+    }
+    int threads = 1;
+    if (count >= 2 * SORT_PARALLEL_MIN)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 1 ? (int)cpus : 1;
+    }
+    multikey_sort(items, count, prefix, threads);
+}
+
+// Prüft, ob ein Verzeichnis ausgeschlossen werden soll (lineare Suche statt bsearch)
+static bool is_excluded_dir(const char *dirname)
+{
+    for (size_t i = 0; i < EXCLUDED_DIRS_COUNT; i++) {
+        if (strcmp(dirname, EXCLUDED_DIRS[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Check if a filename has a specific file extension
+static bool has_extension(const char *filename, const char *ext)
+{
+    const char *dot = strrchr(filename, '.');
+    return dot && strcmp(dot, ext) == 0;
+}
+
+// Check if a string ends with a specific suffix
+static bool ends_with(const char *str, const char *suffix)
+{
+    size_t str_len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+
+    if (suffix_len > str_len)
+    {
+        return false;
+    }
+
+    return strcmp(str + str_len - suffix_len, suffix) == 0;
+}
+
+// Determine the category of a file based on its name or extension
+static FileCategory categorize_file(const char *filename)
+{
+    // First check for build system files
+    for (size_t i = 0; i < BUILD_FILES_COUNT; i++)
+    {
+        // Check for exact filename matches
+        if (strcmp(filename, BUILD_FILES[i].filename) == 0)
+        {
+            return BUILD_FILES[i].category;
+        }
+        // Check for extension matches (like .cmake, .ninja, .bzl)
+        if (BUILD_FILES[i].filename[0] == '.' && ends_with(filename, BUILD_FILES[i].filename))
+        {
+            return BUILD_FILES[i].category;
+        }
+    }
+
+    // Then check for header files
+    if (has_extension(filename, ".h") ||
+        has_extension(filename, ".hpp") ||
+        has_extension(filename, ".hxx") ||
+        has_extension(filename, ".hh"))
+    {
+        return CAT_HEADER;
+    }
+
+    // Finally check for source files
+    if (has_extension(filename, ".c") ||
+        has_extension(filename, ".cpp") ||
+        has_extension(filename, ".cxx") ||
+        has_extension(filename, ".cc"))
+    {
+        return CAT_SOURCE;
+    }
+
+    return CAT_COUNT;  // File type not recognized
+}
+
+// Category of a file name, taking the extensions added to the context into account
+static FileCategory classify(const CcmContext *ctx, const char *filename)
+{
+    for (size_t i = 0; i < ctx->extension_count; i++)
+    {
+        if (ends_with(filename, ctx->extensions[i].suffix))
+            return ctx->extensions[i].category;
+    }
+    return categorize_file(filename);
+}
+
+// Check a path relative to the root against the exclude globs. Globs with a
+// slash match the whole relative path, others only the last component.
+static bool matches_exclude(const CcmContext *ctx, const char *rel_path, const char *name)
+{
+    for (size_t i = 0; i < ctx->exclude_count; i++)
+    {
+        const char *glob = ctx->excludes[i];
+        if (strchr(glob, '/') ? fnmatch(glob, rel_path, FNM_PATHNAME) == 0 : fnmatch(glob, name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Initialize an empty FileList structure
+static void init_filelist(FileList *list)
+{
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// Whole seconds of a time in nanoseconds, rounded down
+static int64_t mtime_seconds(int64_t ns)
+{
+    return ns / NSEC_PER_SEC - (ns % NSEC_PER_SEC < 0);
+}
+
+// Modification time of a public entry in nanoseconds since the epoch
+static int64_t entry_mtime_ns(const CcmEntry *entry)
+{
+    return entry->mtime * NSEC_PER_SEC + entry->mtime_nsec;
+}
+
+// Public view of a file
+static CcmEntry public_entry(const FileEntry *e, FileCategory cat)
+{
+    int64_t sec = mtime_seconds(e->mtime_ns);
+    return (CcmEntry){e->path, (CcmCategory)cat, (int64_t)e->size, sec, e->mtime_ns - sec * NSEC_PER_SEC};
+}
+
+// Free all memory associated with a FileList
+static void free_filelist(FileList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+        free(list->items[i].path);
+    free(list->items);
+    init_filelist(list);
+}
+
+// Add a new file path to the FileList, growing the array if needed
+static int add_to_filelist(FileList *list, const char *path, off_t size, int64_t mtime_ns)
+{
+    if (list->count >= list->capacity)
+    {
+        size_t new_cap = list->capacity ? list->capacity * 2 : 16;
+        FileEntry *tmp = realloc(list->items, new_cap * sizeof(FileEntry));
+        if (!tmp)
+            return -1;
+        list->items = tmp;
+        list->capacity = new_cap;
+    }
+
+    list->items[list->count].path = strdup(path);
+    if (!list->items[list->count].path)
+        return -1;
+    list->items[list->count].size = size;
+    list->items[list->count].mtime_ns = mtime_ns;
+    list->count++;
+    return 0;
+}
+
+// Resolve a symbolic link to its target path
+static char *resolve_symlink(const char *path)
+{
+    char *resolved = malloc(MAX_PATH_LENGTH);
+    if (!resolved)
+        return NULL;
+
+    ssize_t len = readlink(path, resolved, MAX_PATH_LENGTH - 1);
+    if (len == -1)
+    {
+        free(resolved);
+        return NULL;
+    }
+    resolved[len] = '\0';
+
+    if (resolved[0] != '/')
+    {
+        char *dir = strdup(path);
+        char *last_slash = strrchr(dir, '/');
+        if (last_slash)
+        {
+            *last_slash = '\0';
+            char temp[MAX_PATH_LENGTH];
+            snprintf(temp, MAX_PATH_LENGTH, "%s/%s", dir, resolved);
+            strcpy(resolved, temp);
+        }
+        free(dir);
+    }
+
+    return resolved;
+}
+
+// Process a single file or directory entry, passing accepted files to visit
+static int process_entry(CcmContext *ctx, const char *path, const char *filename, CcmVisitFn visit, void *user)
+{
+    struct stat st;
+    ctx->stats.stats++;
+    if (lstat(path, &st) == -1)
+    {
+        ccm_error(ctx, "Error accessing %s: %s", path, strerror(errno));
+        return -1;
+    }
+    mode_t link_mode = st.st_mode;
+
+    char *actual_path = NULL;
+    if (S_ISLNK(st.st_mode))
+    {
+        actual_path = resolve_symlink(path);
+        if (!actual_path)
+        {
+            ccm_error(ctx, "Error resolving symlink %s: %s", path, strerror(errno));
+            return -1;
+        }
+        ctx->stats.stats++;
+        if (stat(actual_path, &st) == -1)
+        {
+            ccm_error(ctx, "Error accessing symlink target %s: %s", actual_path, strerror(errno));
+            free(actual_path);
+            return -1;
+        }
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+        free(actual_path);
+        return 0;
+    }
+
+    FileCategory cat = classify(ctx, filename);
+    if (cat == CAT_COUNT || !(ctx->categories & (1u << cat)))
+    {
+        free(actual_path);
+        return 0;
+    }
+
+    if (filename[0] == '.' &&
+        cat != CAT_MAKEFILE &&
+        cat != CAT_MESON &&
+        cat != CAT_CMAKE &&
+        cat != CAT_NINJA &&
+        cat != CAT_BAZEL)
+    {
+        free(actual_path);
+        return 0;
+    }
+
+    char *abs_path = realpath(actual_path ? actual_path : path, NULL);
+    free(actual_path);
+
+    if (!abs_path)
+    {
+        ccm_error(ctx, "Error resolving path %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    CcmEntry entry = {abs_path, (CcmCategory)cat, (int64_t)st.st_size, (int64_t)st.st_mtim.tv_sec,
+                      (int64_t)st.st_mtim.tv_nsec};
+    ctx->entry_linked = S_ISLNK(link_mode);
+    int result = visit(&entry, user);
+    free(abs_path);
+    return result;
+}
+
+// Check if any part of the path contains an excluded directory
+static bool contains_excluded_dir(const char *path) {
+    char *path_copy = strdup(path);
+    if (!path_copy) {
+        return false;
+    }
+
+    // strtok_r, scans of different contexts may run at the same time
+    bool excluded = false;
+    char *save;
+    char *token = strtok_r(path_copy, "/", &save);
+    
+    while (token != NULL) {
+        if (is_excluded_dir(token)) {
+            excluded = true;
+            break;
+        }
+        token = strtok_r(NULL, "/", &save);
+    }
+
+    free(path_copy);
+    return excluded;
+}
+
+static int scan_directory(CcmContext *ctx, const char *dir_path, size_t root_len, CcmVisitFn visit, void *user);
+
+// Process one entry of a directory and descend into it if it is a directory.
+// Returns nonzero to stop the scan.
+static int scan_entry(CcmContext *ctx, const char *dir_path, const char *name, size_t root_len, CcmVisitFn visit,
+                      void *user)
+{
+    ctx->stats.entries++;
+
+    char sub_path[MAX_PATH_LENGTH];
+    int written = snprintf(sub_path, MAX_PATH_LENGTH, "%s/%s", dir_path, name);
+    if (written >= MAX_PATH_LENGTH)
+    {
+        ccm_error(ctx, "Path too long: %s/%s", dir_path, name);
+        return 0;
+    }
+
+    // Check if the path contains any excluded directory
+    if (contains_excluded_dir(sub_path + root_len))
+        return 0;
+    if (ctx->exclude_count)
+    {
+        const char *rel_path = sub_path + root_len;
+        while (*rel_path == '/')
+            rel_path++;
+        if (matches_exclude(ctx, rel_path, name))
+            return 0;
+    }
+
+    int result = process_entry(ctx, sub_path, name, visit, user);
+    if (result != 0)
+        return result;
+
+    struct stat st;
+    ctx->stats.stats++;
+    if (lstat(sub_path, &st) == -1)
+    {
+        ccm_error(ctx, "Error accessing %s: %s", sub_path, strerror(errno));
+        return 0;
+    }
+
+    if (S_ISDIR(st.st_mode))
+        return scan_directory(ctx, sub_path, root_len, visit, user);
+    return 0;
+}
+
+// Directory entry of a sorted scan
+typedef struct
+{
+    char *name;
+    bool dir;
+} DirName;
+
+// Order directory entries like the paths below them: a directory sorts as
+// its name followed by a slash, so "a.h" comes before the files in "a/"
+static int compare_dir_names(const void *a, const void *b)
+{
+    const DirName *x = a, *y = b;
+    const unsigned char *p = (const unsigned char *)x->name, *q = (const unsigned char *)y->name;
+    while (*p && *p == *q)
+    {
+        p++;
+        q++;
+    }
+    int cp = *p ? *p : x->dir ? '/' : 0;
+    int cq = *q ? *q : y->dir ? '/' : 0;
+    return cp - cq;
+}
+
+// Read all entries of an open directory and sort them, closing the directory.
+// Returns the number of entries, or -1 with errno set.
+static ssize_t read_sorted_dir(CcmContext *ctx, DIR *dir, const char *dir_path, DirName **names)
+{
+    *names = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            DirName *tmp = realloc(*names, capacity * sizeof(DirName));
+            if (!tmp)
+                break;
+            *names = tmp;
+        }
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            char sub_path[MAX_PATH_LENGTH];
+            struct stat st;
+            snprintf(sub_path, sizeof(sub_path), "%s/%s", dir_path, entry->d_name);
+            ctx->stats.stats++;
+            is_dir = lstat(sub_path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        char *name = strdup(entry->d_name);
+        if (!name)
+            break;
+        (*names)[count++] = (DirName){name, is_dir};
+    }
+    // readdir leaves errno alone at the end of the directory
+    bool failed = entry != NULL;
+    closedir(dir);
+    if (failed)
+    {
+        for (size_t i = 0; i < count; i++)
+            free((*names)[i].name);
+        free(*names);
+        *names = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    qsort(*names, count, sizeof(DirName), compare_dir_names);
+    return (ssize_t)count;
+}
+
+// Recursively scan a directory for files to process. Only the part of the
+// paths below the root, which starts at root_len, is checked for excluded
+// directories. A sorted scan visits the entries of each directory in path
+// order, so files that are not symbolic links arrive sorted by their
+// resolved path.
+static int scan_directory(CcmContext *ctx, const char *dir_path, size_t root_len, CcmVisitFn visit, void *user)
+{
+    uint64_t trace_start = trace_begin(ctx);
+    ctx->stats.opens++;
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+    {
+        ccm_error(ctx, "Error opening %s: %s", dir_path, strerror(errno));
+        return -1;
+    }
+    ctx->stats.directories++;
+
+    int result = 0;
+    if (ctx->sorted_scan)
+    {
+        DirName *names;
+        ssize_t count = read_sorted_dir(ctx, dir, dir_path, &names);
+        if (count == -1)
+        {
+            ccm_error(ctx, "Error reading %s: %s", dir_path, strerror(errno));
+            return -1;
+        }
+        for (ssize_t i = 0; i < count; i++)
+        {
+            if (result == 0)
+                result = scan_entry(ctx, dir_path, names[i].name, root_len, visit, user);
+            free(names[i].name);
+        }
+        free(names);
+    }
+    else
+    {
+        struct dirent *entry;
+        while (result == 0 && (entry = readdir(dir)))
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            result = scan_entry(ctx, dir_path, entry->d_name, root_len, visit, user);
+        }
+        closedir(dir);
+    }
+    if (result != 0)
+        return result;
+
+    trace_end(ctx, "scan", "scan", "path", dir_path, trace_start);
+    return 0;
+}
+
+// Return a pointer to the first byte in [p, end) equal to a, b, c or d, or end
+static const char *find_any4_base(const char *p, const char *end, char a, char b, char c, char d)
+{
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c), vd = _mm_set1_epi8(d);
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++)
+    {
+        if (*p == a || *p == b || *p == c || *p == d)
+            return p;
+    }
+    return end;
+}
+
+#if SIMD_AVX2
+// find_any4 with 32 byte AVX2 compares, the rest is left to the baseline version
+TARGET_AVX2 static const char *find_any4_avx2(const char *p, const char *end, char a, char b, char c, char d)
+{
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c), vd = _mm256_set1_epi8(d);
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vd)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_any4_base(p, end, a, b, c, d);
+}
+#endif
+
+#if SIMD_DISPATCH
+typedef const char *FindAny4Fn(const char *, const char *, char, char, char, char);
+
+// Pick the find_any4 version for this CPU
+static FindAny4Fn *resolve_find_any4(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? find_any4_avx2 : find_any4_base;
+}
+
+static const char *find_any4(const char *p, const char *end, char a, char b, char c, char d)
+    IFUNC(resolve_find_any4);
+#elif SIMD_AVX2
+#define find_any4 find_any4_avx2
+#else
+#define find_any4 find_any4_base
+#endif
+
+// Update a CRC32C checksum with a block of data
+static uint32_t crc32c_base(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+#else
+    while (len--)
+        crc = CRC32C_TABLE[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+#endif
+    return ~crc;
+}
+
+#if SIMD_DISPATCH
+// CRC32C with the SSE4.2 crc32 instruction, 8 bytes at a time
+TARGET_SSE42 static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+
+typedef uint32_t Crc32cFn(uint32_t, const void *, size_t);
+
+// Pick the crc32c version for this CPU
+static Crc32cFn *resolve_crc32c(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") ? crc32c_sse42 : crc32c_base;
+}
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len) IFUNC(resolve_crc32c);
+#else
+#define crc32c crc32c_base
+#endif
+
+// Find the comment block at the start of a file. Returns the number of bytes to
+// skip (the comments plus trailing whitespace up to the next code line) and stores
+// the end of the last comment in *comment_end. Returns 0 if buf does not start
+// with a comment block that ends inside buf.
+static size_t leading_comment_length(const char *buf, size_t len, size_t *comment_end)
+{
+    size_t i = 0, end = 0;
+    for (;;)
+    {
+        while (i < len && isspace((unsigned char)buf[i]))
+            i++;
+        if (i + 1 >= len || buf[i] != '/')
+            break;
+        if (buf[i + 1] == '*')
+        {
+            const char *close = memmem(buf + i + 2, len - i - 2, "*/", 2);
+            if (!close)
+                return 0;
+            i = (size_t)(close - buf) + 2;
+        }
+        else if (buf[i + 1] == '/')
+        {
+            const char *nl = memchr(buf + i, '\n', len - i);
+            if (!nl)
+                return 0;
+            i = (size_t)(nl - buf);
+        }
+        else
+        {
+            break;
+        }
+        end = i;
+    }
+    if (end == 0)
+        return 0;
+
+    // Keep the indentation of the first code line
+    while (i > end && buf[i - 1] != '\n')
+        i--;
+    *comment_end = end;
+    return i;
+}
+
+// Validate one UTF-8 byte outside the ASCII range, returns false if it is invalid
+static bool utf8_step(Utf8Validator *v, unsigned char c)
+{
+    if (v->need)
+    {
+        if (c < v->lo || c > v->hi)
+            return false;
+        v->need--;
+        v->lo = 0x80;
+        v->hi = 0xbf;
+        return true;
+    }
+    v->lo = 0x80;
+    v->hi = 0xbf;
+    if (c < 0x80)
+        return true;
+    if (c >= 0xc2 && c <= 0xdf)
+        v->need = 1;
+    else if (c >= 0xe0 && c <= 0xef)
+    {
+        v->need = 2;
+        if (c == 0xe0)
+            v->lo = 0xa0;  // Overlong encoding
+        else if (c == 0xed)
+            v->hi = 0x9f;  // UTF-16 surrogates
+    }
+    else if (c >= 0xf0 && c <= 0xf4)
+    {
+        v->need = 3;
+        if (c == 0xf0)
+            v->lo = 0x90;  // Overlong encoding
+        else if (c == 0xf4)
+            v->hi = 0x8f;  // Above U+10FFFF
+    }
+    else
+        return false;
+    return true;
+}
+
+// Check a chunk for NUL bytes and invalid UTF-8. Blocks of plain ASCII without
+// NUL bytes are skipped with vector compares, only the rest is decoded. The
+// AVX2 version does not fall back to it, so it is only needed for dispatch.
+#if SIMD_DISPATCH || !SIMD_AVX2
+static TextKind scan_text_base(Utf8Validator *v, const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+
+    while (p < end)
+    {
+#if defined(__SSE2__)
+        if (!v->need && end - p >= 16)
+        {
+            __m128i b = _mm_loadu_si128((const __m128i *)p);
+            __m128i nul = _mm_cmpeq_epi8(b, _mm_setzero_si128());
+            if ((_mm_movemask_epi8(b) | _mm_movemask_epi8(nul)) == 0)
+            {
+                p += 16;
+                continue;
+            }
+        }
+#endif
+        // Decode up to the next vector block byte by byte
+        const unsigned char *stop = end - p > 32 ? p + 32 : end;
+        for (; p < stop; p++)
+        {
+            if (*p == 0)
+                return TEXT_BINARY;
+            if (!utf8_step(v, *p))
+                return TEXT_INVALID_UTF8;
+        }
+    }
+    return TEXT_OK;
+}
+#endif
+
+#if SIMD_AVX2
+// scan_text skipping 32 byte blocks of plain ASCII with AVX2
+TARGET_AVX2 static TextKind scan_text_avx2(Utf8Validator *v, const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+
+    while (p < end)
+    {
+        if (!v->need && end - p >= 32)
+        {
+            __m256i b = _mm256_loadu_si256((const __m256i *)p);
+            __m256i nul = _mm256_cmpeq_epi8(b, _mm256_setzero_si256());
+            if ((_mm256_movemask_epi8(b) | _mm256_movemask_epi8(nul)) == 0)
+            {
+                p += 32;
+                continue;
+            }
+        }
+        const unsigned char *stop = end - p > 32 ? p + 32 : end;
+        for (; p < stop; p++)
+        {
+            if (*p == 0)
+                return TEXT_BINARY;
+            if (!utf8_step(v, *p))
+                return TEXT_INVALID_UTF8;
+        }
+    }
+    return TEXT_OK;
+}
+#endif
+
+#if SIMD_DISPATCH
+// scan_text skipping 64 byte blocks with AVX-512. A block is plain ASCII without
+// NUL bytes if every byte minus one is below 0x7f.
+TARGET_AVX512 static TextKind scan_text_avx512(Utf8Validator *v, const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+    const __m512i one = _mm512_set1_epi8(1), limit = _mm512_set1_epi8(0x7f);
+
+    while (p < end)
+    {
+        if (!v->need && end - p >= 64)
+        {
+            __m512i b = _mm512_loadu_si512((const void *)p);
+            if (_mm512_cmplt_epu8_mask(_mm512_sub_epi8(b, one), limit) == ~(__mmask64)0)
+            {
+                p += 64;
+                continue;
+            }
+        }
+        const unsigned char *stop = end - p > 64 ? p + 64 : end;
+        for (; p < stop; p++)
+        {
+            if (*p == 0)
+                return TEXT_BINARY;
+            if (!utf8_step(v, *p))
+                return TEXT_INVALID_UTF8;
+        }
+    }
+    return TEXT_OK;
+}
+
+typedef TextKind ScanTextFn(Utf8Validator *, const char *, size_t);
+
+// Pick the scan_text version for this CPU
+static ScanTextFn *resolve_scan_text(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return scan_text_avx512;
+    return __builtin_cpu_supports("avx2") ? scan_text_avx2 : scan_text_base;
+}
+
+static TextKind scan_text(Utf8Validator *v, const char *data, size_t len) IFUNC(resolve_scan_text);
+#elif SIMD_AVX2
+#define scan_text scan_text_avx2
+#else
+#define scan_text scan_text_base
+#endif
+
+// Count the newlines in a block of data
+static uint64_t count_newlines_base(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    uint64_t count = 0;
+#if defined(__SSE2__)
+    // Compare results are -1 per match, so subtracting them counts matches in
+    // 16 byte lanes. The lanes are summed with SAD before they can overflow.
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (end - p >= 16)
+    {
+        __m128i acc = _mm_setzero_si128();
+        size_t blocks = (size_t)(end - p) / 16;
+        if (blocks > 255)
+            blocks = 255;
+        for (size_t i = 0; i < blocks; i++, p += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+        count += (uint64_t)_mm_cvtsi128_si64(sums) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+#endif
+    for (; p < end; p++)
+        count += *p == '\n';
+    return count;
+}
+
+#if SIMD_AVX2
+// count_newlines with AVX2, see the baseline version for the lane counting
+TARGET_AVX2 static uint64_t count_newlines_avx2(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    uint64_t count = 0;
+    const __m256i nl = _mm256_set1_epi8('\n');
+    while (end - p >= 32)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        size_t blocks = (size_t)(end - p) / 32;
+        if (blocks > 255)
+            blocks = 255;
+        for (size_t i = 0; i < blocks; i++, p += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)p);
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        __m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+        count += (uint64_t)_mm256_extract_epi64(sums, 0) + (uint64_t)_mm256_extract_epi64(sums, 1) +
+                 (uint64_t)_mm256_extract_epi64(sums, 2) + (uint64_t)_mm256_extract_epi64(sums, 3);
+    }
+    return count + count_newlines_base(p, (size_t)(end - p));
+}
+#endif
+
+#if SIMD_DISPATCH
+// count_newlines with AVX-512, the compare mask of 64 bytes is counted directly
+TARGET_AVX512 static uint64_t count_newlines_avx512(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    uint64_t count = 0;
+    const __m512i nl = _mm512_set1_epi8('\n');
+    for (; end - p >= 64; p += 64)
+        count += (uint64_t)__builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)p), nl));
+    return count + count_newlines_base(p, (size_t)(end - p));
+}
+
+typedef uint64_t CountNewlinesFn(const char *, size_t);
+
+// Pick the count_newlines version for this CPU
+static CountNewlinesFn *resolve_count_newlines(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return count_newlines_avx512;
+    return __builtin_cpu_supports("avx2") ? count_newlines_avx2 : count_newlines_base;
+}
+
+static uint64_t count_newlines(const char *data, size_t len) IFUNC(resolve_count_newlines);
+#elif SIMD_AVX2
+#define count_newlines count_newlines_avx2
+#else
+#define count_newlines count_newlines_base
+#endif
+
+// Length of the prefix of data that needs no JSON escaping. Control characters,
+// '"' and '\\' are found with vector compares.
+static size_t json_plain_span_base(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                 _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask)
+            return (size_t)(p - data) + (size_t)__builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c < 0x20 || c == '"' || c == '\\')
+            break;
+    }
+    return (size_t)(p - data);
+}
+
+#if SIMD_AVX2
+// json_plain_span with 32 byte AVX2 compares
+TARGET_AVX2 static size_t json_plain_span_avx2(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+                                    _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask)
+            return (size_t)(p - data) + (size_t)__builtin_ctz(mask);
+        p += 32;
+    }
+    return (size_t)(p - data) + json_plain_span_base(p, (size_t)(end - p));
+}
+#endif
+
+#if SIMD_DISPATCH
+typedef size_t PlainSpanFn(const char *, size_t);
+
+// Pick the json_plain_span version for this CPU
+static PlainSpanFn *resolve_json_plain_span(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? json_plain_span_avx2 : json_plain_span_base;
+}
+
+static size_t json_plain_span(const char *data, size_t len) IFUNC(resolve_json_plain_span);
+#elif SIMD_AVX2
+#define json_plain_span json_plain_span_avx2
+#else
+#define json_plain_span json_plain_span_base
+#endif
+
+// Length of the prefix of data that needs no XML escaping: no '<', '>', '&' and
+// no control characters other than tab and newline
+static size_t xml_plain_span_base(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+#if defined(__SSE2__)
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), amp = _mm_set1_epi8('&');
+    const __m128i tab = _mm_set1_epi8('\t'), nl = _mm_set1_epi8('\n'), ctrl = _mm_set1_epi8(0x1f);
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                                       _mm_cmpeq_epi8(v, amp));
+        __m128i control = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, nl)),
+                                           _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(special, control));
+        if (mask)
+            return (size_t)(p - data) + (size_t)__builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c == '<' || c == '>' || c == '&' || (c < 0x20 && c != '\t' && c != '\n'))
+            break;
+    }
+    return (size_t)(p - data);
+}
+
+#if SIMD_AVX2
+// xml_plain_span with 32 byte AVX2 compares
+TARGET_AVX2 static size_t xml_plain_span_avx2(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>'), amp = _mm256_set1_epi8('&');
+    const __m256i tab = _mm256_set1_epi8('\t'), nl = _mm256_set1_epi8('\n'), ctrl = _mm256_set1_epi8(0x1f);
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+                                          _mm256_cmpeq_epi8(v, amp));
+        __m256i control = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, nl)),
+                                              _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(special, control));
+        if (mask)
+            return (size_t)(p - data) + (size_t)__builtin_ctz(mask);
+        p += 32;
+    }
+    return (size_t)(p - data) + xml_plain_span_base(p, (size_t)(end - p));
+}
+#endif
+
+#if SIMD_DISPATCH
+// Pick the xml_plain_span version for this CPU
+static PlainSpanFn *resolve_xml_plain_span(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? xml_plain_span_avx2 : xml_plain_span_base;
+}
+
+static size_t xml_plain_span(const char *data, size_t len) IFUNC(resolve_xml_plain_span);
+#elif SIMD_AVX2
+#define xml_plain_span xml_plain_span_avx2
+#else
+#define xml_plain_span xml_plain_span_base
+#endif
+
+// Name of the widest instruction set the SIMD kernels use on this CPU
+const char *ccm_simd_level(void)
+{
+#if SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return "avx512bw";
+    if (__builtin_cpu_supports("avx2"))
+        return "avx2";
+#endif
+#if SIMD_AVX2
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// Check if a character can be part of an identifier or number
+static bool is_ident_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Prepare a comment stripper for a new file
+static void init_stripper(CommentStripper *s, const MergeOptions *opts)
+{
+    memset(s, 0, sizeof(*s));
+    s->state = LEX_CODE;
+    s->strip = opts->strip_comments;
+    s->compact = opts->compact;
+    s->last_out = '\n';
+    s->raw_match = -1;
+}
+
+// Remember the last code bytes, needed to recognize literal prefixes, and
+// whether the token they end started with a digit
+static void stripper_track(CommentStripper *s, const char *run, size_t len)
+{
+    size_t i = len;
+    while (i > 0 && (is_ident_char(run[i - 1]) || run[i - 1] == '.'))
+        i--;
+    if (i > 0)
+        s->number = i < len && isdigit((unsigned char)run[i]);
+    else if (len > 0 && !is_ident_char(s->prev[0]) && s->prev[0] != '.')
+        s->number = isdigit((unsigned char)run[0]);
+    // Otherwise the token began before this run, possibly in an earlier chunk
+    for (size_t i = len > 3 ? len - 3 : 0; i < len; i++)
+    {
+        s->prev[2] = s->prev[1];
+        s->prev[1] = s->prev[0];
+        s->prev[0] = run[i];
+    }
+}
+
+// Write leading whitespace held back for the current line
+static size_t stripper_flush_pending(CommentStripper *s, char *out)
+{
+    size_t len = s->pending_len;
+    memcpy(out, s->pending, len);
+    s->pending_len = 0;
+    return len;
+}
+
+// Emit bytes that are copied verbatim (literals, kept comments)
+static size_t stripper_emit_raw(CommentStripper *s, char *out, const char *run, size_t len)
+{
+    if (len == 0)
+        return 0;
+    size_t o = 0;
+    if (!s->line_has_content)
+    {
+        o = stripper_flush_pending(s, out);
+        s->line_has_content = true;
+    }
+    memcpy(out + o, run, len);
+    s->last_out = run[len - 1];
+    return o + len;
+}
+
+// Emit a run of code bytes that contains no newline
+static size_t stripper_emit_code(CommentStripper *s, char *out, const char *run, size_t len)
+{
+    size_t i = 0, o = 0;
+
+    // Leading whitespace is held back until we know the line is not blank
+    while (!s->line_has_content && i < len)
+    {
+        char c = run[i];
+        if (c != ' ' && c != '\t' && c != '\r' && c != '\f' && c != '\v')
+            break;
+        if (s->pending_len == sizeof(s->pending))
+            break;
+        s->pending[s->pending_len++] = c;
+        i++;
+    }
+    o = stripper_emit_raw(s, out, run + i, len - i);
+    stripper_track(s, run, len);
+    return o;
+}
+
+// Handle the end of a line in code
+static size_t stripper_newline(CommentStripper *s, char *out, size_t o)
+{
+    bool splice = s->prev[0] == '\\' || (s->prev[0] == '\r' && s->prev[1] == '\\');
+    if (s->line_has_content)
+    {
+        // Drop whitespace that preceded a removed trailing comment
+        if (s->line_had_comment)
+        {
+            while (o > 0 && (out[o - 1] == ' ' || out[o - 1] == '\t'))
+                o--;
+        }
+        out[o++] = '\n';
+    }
+    else if (!s->compact && !s->line_had_comment)
+    {
+        o += stripper_flush_pending(s, out + o);
+        out[o++] = '\n';
+    }
+    else if (s->continued)
+    {
+        // Dropping the line would splice the next one into the previous
+        // line, e.g. into the body of a macro
+        out[o++] = '\n';
+    }
+    s->continued = splice;
+    s->pending_len = 0;
+    s->line_has_content = false;
+    s->line_had_comment = false;
+    s->last_out = '\n';
+    s->prev[0] = '\n';
+    return o;
+}
+
+// Check whether the '"' about to be read opens a raw string literal
+static bool stripper_raw_prefix(const CommentStripper *s)
+{
+    if (s->prev[0] != 'R')
+        return false;
+    if (!is_ident_char(s->prev[1]))
+        return true;
+    if ((s->prev[1] == 'L' || s->prev[1] == 'u' || s->prev[1] == 'U') && !is_ident_char(s->prev[2]))
+        return true;
+    return s->prev[1] == '8' && s->prev[2] == 'u';
+}
+
+// Check whether the '\'' about to be read is a C++14 digit separator such as 1'000
+static bool stripper_digit_separator(const CommentStripper *s)
+{
+    return is_ident_char(s->prev[0]) && s->number;
+}
+
+// Run the lexer over one chunk; out must hold len + sizeof(s->pending) + 2 bytes
+static size_t strip_chunk(CommentStripper *s, const char *in, size_t len, char *out)
+{
+    const char *p = in;
+    const char *end = in + len;
+    size_t o = 0;
+
+    while (p < end)
+    {
+        const char *q;
+        switch (s->state)
+        {
+        case LEX_CODE:
+            q = find_any4(p, end, '/', '"', '\'', '\n');
+            o += stripper_emit_code(s, out + o, p, (size_t)(q - p));
+            if (q == end)
+                return o;
+            if (*q == '/')
+            {
+                s->state = LEX_SLASH;
+            }
+            else if (*q == '\n')
+            {
+                o = stripper_newline(s, out, o);
+            }
+            else if (*q == '"')
+            {
+                s->state = stripper_raw_prefix(s) ? LEX_RAW_DELIM : LEX_STRING;
+                s->raw_len = 0;
+                o += stripper_emit_raw(s, out + o, q, 1);
+                stripper_track(s, q, 1);
+            }
+            else
+            {
+                if (!stripper_digit_separator(s))
+                    s->state = LEX_CHAR;
+                o += stripper_emit_raw(s, out + o, q, 1);
+                stripper_track(s, q, 1);
+            }
+            p = q + 1;
+            break;
+
+        case LEX_SLASH:
+            if (*p == '/' || *p == '*')
+            {
+                s->state = *p == '/' ? LEX_LINE_COMMENT : LEX_BLOCK_COMMENT;
+                if (s->strip)
+                    s->line_had_comment = true;
+                else
+                    o += stripper_emit_raw(s, out + o, *p == '/' ? "//" : "/*", 2);
+                s->escape = false;
+                p++;
+            }
+            else
+            {
+                // Not a comment, the '/' was an operator
+                s->state = LEX_CODE;
+                o += stripper_emit_code(s, out + o, "/", 1);
+            }
+            break;
+
+        case LEX_LINE_COMMENT:
+            q = find_any4(p, end, '\n', '\\', '\n', '\\');
+            // A backslash continues the comment only if just a '\r' separates it from the newline
+            if (q > p && !(q - p == 1 && *p == '\r'))
+                s->escape = false;
+            if (!s->strip)
+                o += stripper_emit_raw(s, out + o, p, (size_t)(q - p));
+            if (q == end)
+                return o;
+            if (*q == '\\')
+            {
+                s->escape = true;
+                if (!s->strip)
+                    o += stripper_emit_raw(s, out + o, q, 1);
+            }
+            else if (s->escape)
+            {
+                s->escape = false;
+                if (!s->strip)
+                    o += stripper_emit_raw(s, out + o, q, 1);
+            }
+            else
+            {
+                s->state = LEX_CODE;
+                o = stripper_newline(s, out, o);
+            }
+            p = q + 1;
+            break;
+
+        case LEX_BLOCK_COMMENT:
+            q = memchr(p, '*', (size_t)(end - p));
+            if (!q)
+                q = end;
+            else
+                s->state = LEX_BLOCK_STAR;
+            if (!s->strip)
+                o += stripper_emit_raw(s, out + o, p, (size_t)(q - p) + (q < end));
+            p = q + (q < end);
+            break;
+
+        case LEX_BLOCK_STAR:
+            if (!s->strip)
+                o += stripper_emit_raw(s, out + o, p, 1);
+            if (*p == '/')
+            {
+                s->state = LEX_CODE;
+                // A removed comment still separates tokens
+                if (s->strip && s->line_has_content && !isspace((unsigned char)s->last_out))
+                {
+                    out[o++] = ' ';
+                    s->last_out = ' ';
+                }
+                s->prev[0] = ' ';
+            }
+            else if (*p != '*')
+            {
+                s->state = LEX_BLOCK_COMMENT;
+            }
+            p++;
+            break;
+
+        case LEX_STRING:
+        case LEX_CHAR:
+            if (s->escape)
+            {
+                o += stripper_emit_raw(s, out + o, p++, 1);
+                s->escape = false;
+                break;
+            }
+            q = find_any4(p, end, s->state == LEX_STRING ? '"' : '\'', '\\', '\n', '\\');
+            o += stripper_emit_raw(s, out + o, p, (size_t)(q - p));
+            if (q == end)
+                return o;
+            if (*q == '\\')
+            {
+                s->escape = true;
+                o += stripper_emit_raw(s, out + o, q, 1);
+            }
+            else if (*q == '\n')
+            {
+                // Unterminated literal, recover at the end of the line
+                s->state = LEX_CODE;
+                o = stripper_newline(s, out, o);
+            }
+            else
+            {
+                s->state = LEX_CODE;
+                o += stripper_emit_raw(s, out + o, q, 1);
+                stripper_track(s, q, 1);
+            }
+            p = q + 1;
+            break;
+
+        case LEX_RAW_DELIM:
+            if (*p == '(')
+            {
+                s->state = LEX_RAW_BODY;
+                s->raw_match = -1;
+            }
+            else if (s->raw_len == MAX_RAW_DELIM || *p == ')' || *p == '\\' || isspace((unsigned char)*p))
+            {
+                // Not a valid raw string delimiter, treat it as an ordinary literal
+                s->state = LEX_STRING;
+                break;
+            }
+            else
+            {
+                s->raw_delim[s->raw_len++] = *p;
+            }
+            o += stripper_emit_raw(s, out + o, p++, 1);
+            break;
+
+        case LEX_RAW_BODY:
+            if (s->raw_match < 0)
+            {
+                q = memchr(p, ')', (size_t)(end - p));
+                if (!q)
+                    q = end;
+                else
+                    s->raw_match = 0;
+                o += stripper_emit_raw(s, out + o, p, (size_t)(q - p) + (q < end));
+                p = q + (q < end);
+                break;
+            }
+            if ((size_t)s->raw_match == s->raw_len && *p == '"')
+            {
+                s->state = LEX_CODE;
+                stripper_track(s, p, 1);
+            }
+            else if ((size_t)s->raw_match < s->raw_len && *p == s->raw_delim[s->raw_match])
+                s->raw_match++;
+            else
+                s->raw_match = *p == ')' ? 0 : -1;
+            o += stripper_emit_raw(s, out + o, p++, 1);
+            break;
+        }
+    }
+    return o;
+}
+
+// Flush state left over at the end of a file
+static size_t strip_finish(CommentStripper *s, char *out)
+{
+    if (s->state == LEX_SLASH)
+    {
+        s->state = LEX_CODE;
+        return stripper_emit_code(s, out, "/", 1);
+    }
+    return 0;
+}
+
+// Read the next chunk of a source file
+static size_t read_chunk(CcmContext *ctx, FILE *src, char *buf, size_t len)
+{
+    uint64_t start = trace_begin(ctx);
+    size_t n = fread(buf, 1, len, src);
+    ctx->stats.reads++;
+    ctx->stats.bytes_read += n;
+    trace_end(ctx, "read", "io", NULL, NULL, start);
+    return n;
+}
+
+// Read up to len bytes from the start of a file
+static ssize_t read_file_head(CcmContext *ctx, const char *path, char *buf, size_t len)
+{
+    ctx->stats.opens++;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    size_t n = read_chunk(ctx, f, buf, len);
+    bool failed = ferror(f);
+    fclose(f);
+    return failed ? -1 : (ssize_t)n;
+}
+
+// Find the leading comment block shared by the most C/C++ files, weighted by
+// the bytes it saves. Only the first chunk of every file is read.
+static int find_common_license(CcmContext *ctx, const FileList categories[CAT_COUNT], LicenseBlock *license)
+{
+    memset(license, 0, sizeof(*license));
+
+    size_t files = categories[CAT_HEADER].count + categories[CAT_SOURCE].count;
+    size_t table_size = 16;
+    while (table_size < files * 2)
+        table_size *= 2;
+    LicenseCandidate *table = calloc(table_size, sizeof(LicenseCandidate));
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (!table || !buffer)
+    {
+        free(table);
+        free(buffer);
+        return -1;
+    }
+
+    for (int cat = CAT_HEADER; cat <= CAT_SOURCE; cat++)
+    {
+        for (size_t i = 0; i < categories[cat].count; i++)
+        {
+            const char *path = categories[cat].items[i].path;
+            ssize_t n = read_file_head(ctx, path, buffer, COPY_BUFFER_SIZE);
+            size_t comment_end;
+            if (n <= 0 || leading_comment_length(buffer, (size_t)n, &comment_end) == 0)
+                continue;
+
+            uint32_t hash = crc32c(0, buffer, comment_end);
+            size_t slot = hash & (table_size - 1);
+            while (table[slot].path && (table[slot].hash != hash || table[slot].len != comment_end))
+                slot = (slot + 1) & (table_size - 1);
+            if (!table[slot].path)
+            {
+                table[slot].hash = hash;
+                table[slot].len = comment_end;
+                table[slot].path = path;
+            }
+            table[slot].count++;
+        }
+    }
+
+    const LicenseCandidate *best = NULL;
+    for (size_t i = 0; i < table_size; i++)
+    {
+        if (table[i].count < 2)
+            continue;
+        if (!best || (table[i].count - 1) * table[i].len > (best->count - 1) * best->len)
+            best = &table[i];
+    }
+
+    int result = 0;
+    if (best)
+    {
+        license->text = malloc(best->len);
+        if (!license->text || read_file_head(ctx, best->path, license->text, best->len) != (ssize_t)best->len)
+        {
+            ccm_error(ctx, "Error reading %s: %s", best->path, strerror(errno));
+            free(license->text);
+            license->text = NULL;
+            result = -1;
+        }
+        else
+        {
+            license->len = best->len;
+            license->hash = best->hash;
+            license->count = best->count;
+        }
+    }
+
+    free(table);
+    free(buffer);
+    return result;
+}
+
+static int compressor_submit(Compressor *c, Output *out, const char *data, size_t len);
+static int compressor_finish(Compressor *c, Output *out);
+
+// Create an unnamed file in the directory of path, or a hidden sibling temp
+// file if the filesystem does not support O_TMPFILE
+static int output_create_temp(Output *out, const char *path)
+{
+    char *copy = strdup(path);
+    if (!copy)
+        return -1;
+    const char *dir = dirname(copy);
+
+    // Linking the unnamed file needs /proc to name its descriptor
+    if (access("/proc/self/fd", X_OK) == 0)
+    {
+        out->fd = open(dir, O_WRONLY | O_TMPFILE | O_CLOEXEC, 0644);
+        if (out->fd != -1)
+        {
+            out->anonymous = true;
+            free(copy);
+            return 0;
+        }
+    }
+
+    size_t len = strlen(dir) + strlen(path) + 16;
+    out->temp_path = malloc(len);
+    if (!out->temp_path)
+    {
+        free(copy);
+        return -1;
+    }
+    char *base_copy = strdup(path);
+    snprintf(out->temp_path, len, "%s/.%s.XXXXXX", dir, base_copy ? basename(base_copy) : "merged");
+    free(base_copy);
+    free(copy);
+
+    out->fd = mkostemp(out->temp_path, O_CLOEXEC);
+    if (out->fd == -1)
+    {
+        free(out->temp_path);
+        out->temp_path = NULL;
+        return -1;
+    }
+    // mkstemp creates the file with mode 0600, use the usual mode instead
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(out->fd, 0666 & ~mask);
+    return 0;
+}
+
+// Allocate the buffer of an opened output
+static int output_init_buffer(Output *out)
+{
+    // A larger pipe buffer lets each batch go through in one write
+    struct stat st;
+    if (out->fd != -1 && fstat(out->fd, &st) == 0 && S_ISFIFO(st.st_mode))
+        fcntl(out->fd, F_SETPIPE_SZ, OUTPUT_BUFFER_SIZE);
+    out->buf = malloc(OUTPUT_BUFFER_SIZE);
+    return out->buf ? 0 : -1;
+}
+
+// Open the output. Regular files are written to a temp file that replaces the
+// target only when output_close succeeds, so readers never see a partial merge.
+static int output_open(Output *out, CcmContext *ctx, const char *path, FsyncMode fsync_mode)
+{
+    memset(out, 0, sizeof(*out));
+    out->ctx = ctx;
+    out->fsync_mode = fsync_mode;
+
+    struct stat st;
+    if (stat(path, &st) == 0 && !S_ISREG(st.st_mode))
+    {
+        // Devices and FIFOs are written directly
+        out->fd = open(path, O_WRONLY | O_CLOEXEC);
+    }
+    else
+    {
+        out->path = strdup(path);
+        if (!out->path || output_create_temp(out, path) == -1)
+        {
+            free(out->path);
+            return -1;
+        }
+    }
+    if (out->fd == -1)
+        return -1;
+
+    if (output_init_buffer(out) == -1)
+    {
+        close(out->fd);
+        if (out->temp_path)
+            unlink(out->temp_path);
+        free(out->temp_path);
+        free(out->path);
+        return -1;
+    }
+    return 0;
+}
+
+// Write to a descriptor of the caller, which is left open
+static int output_open_fd(Output *out, CcmContext *ctx, int fd)
+{
+    memset(out, 0, sizeof(*out));
+    out->ctx = ctx;
+    out->fd = fd;
+    out->keep_fd = true;
+    return output_init_buffer(out);
+}
+
+// Pass the output to a callback in blocks of up to OUTPUT_BUFFER_SIZE bytes
+static int output_open_sink(Output *out, CcmContext *ctx, CcmWriteFn sink, void *user)
+{
+    memset(out, 0, sizeof(*out));
+    out->ctx = ctx;
+    out->fd = -1;
+    out->keep_fd = true;
+    out->sink = sink;
+    out->sink_user = user;
+    return output_init_buffer(out);
+}
+
+// Open an existing regular file for patching in place. Unlike output_open,
+// a failed run leaves a partially updated file behind.
+static int output_open_in_place(Output *out, CcmContext *ctx, const char *path, FsyncMode fsync_mode)
+{
+    memset(out, 0, sizeof(*out));
+    out->ctx = ctx;
+    out->fsync_mode = fsync_mode;
+    out->in_place = true;
+    out->fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (out->fd == -1)
+        return -1;
+    out->buf = malloc(OUTPUT_BUFFER_SIZE);
+    if (!out->buf)
+    {
+        close(out->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Link the unnamed temp file under a fresh name next to the output. linkat()
+// cannot replace an existing file, so like mkostemp try random suffixes until
+// one is free; names that already exist belong to someone else and are left alone.
+static int output_link_temp(Output *out)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    static _Atomic uint64_t counter;
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", out->fd);
+    size_t len = strlen(out->path) + 16;
+    char *name = malloc(len);
+    if (!name)
+        return -1;
+
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t x = (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 32) ^
+                     (atomic_fetch_add(&counter, 1) + 1) * 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        x ^= x >> 31;
+        char suffix[7];
+        for (int i = 0; i < 6; i++, x /= sizeof(letters) - 1)
+            suffix[i] = letters[x % (sizeof(letters) - 1)];
+        suffix[6] = '\0';
+        snprintf(name, len, "%s.%s", out->path, suffix);
+        if (linkat(AT_FDCWD, proc_path, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0)
+        {
+            out->temp_path = name;
+            return 0;
+        }
+        if (errno != EEXIST)
+            break;
+    }
+    int saved_errno = errno;
+    free(name);
+    errno = saved_errno;
+    return -1;
+}
+
+// Give the finished temp file its final name
+static int output_publish(Output *out)
+{
+    if (out->fsync_mode != FSYNC_NONE && fsync(out->fd) == -1)
+        return -1;
+
+    if (out->anonymous && output_link_temp(out) == -1)
+        return -1;
+    if (rename(out->temp_path, out->path) == -1)
+        return -1;
+    free(out->temp_path);
+    out->temp_path = NULL;
+
+    // The output is published at this point, so a directory that cannot be
+    // synced only weakens durability and does not fail the merge
+    if (out->fsync_mode == FSYNC_FULL)
+    {
+        char *copy = strdup(out->path);
+        int dir_fd = copy ? open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        free(copy);
+        if (dir_fd == -1 || fsync(dir_fd) == -1)
+            ccm_error(out->ctx, "Warning: could not sync the directory of %s: %s", out->path, strerror(errno));
+        if (dir_fd != -1)
+            close(dir_fd);
+    }
+    return 0;
+}
+
+// Hand all iovecs to the sink callback
+static int output_sink_writev(Output *out, const struct iovec *iov, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (iov[i].iov_len == 0)
+            continue;
+        uint64_t start = trace_begin(out->ctx);
+        int result = out->sink(iov[i].iov_base, iov[i].iov_len, out->sink_user);
+        trace_end(out->ctx, "write", "io", NULL, NULL, start);
+        if (result != 0)
+        {
+            out->failed = true;
+            return -1;
+        }
+        out->ctx->stats.writes++;
+        out->ctx->stats.bytes_written += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// Write all iovecs, retrying on partial writes and interrupts
+static int output_writev(Output *out, struct iovec *iov, int count)
+{
+    if (out->sink)
+        return output_sink_writev(out, iov, count);
+    while (count > 0)
+    {
+        uint64_t start = trace_begin(out->ctx);
+        ssize_t n = writev(out->fd, iov, count);
+        trace_end(out->ctx, "write", "io", NULL, NULL, start);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            out->failed = true;
+            return -1;
+        }
+        out->ctx->stats.writes++;
+        out->ctx->stats.bytes_written += (uint64_t)n;
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+// Write all pending bytes, or hand them to the compressor as one block
+static int output_flush(Output *out)
+{
+    if (out->failed)
+        return -1;
+    size_t len = out->len;
+    out->len = 0;
+    if (len == 0)
+        return 0;
+    if (out->compressor)
+        return compressor_submit(out->compressor, out, out->buf, len);
+    struct iovec iov = {out->buf, len};
+    return output_writev(out, &iov, 1);
+}
+
+// Continue writing at another position of a seekable, uncompressed output
+static int output_seek(Output *out, off_t offset)
+{
+    if (output_flush(out) == -1 || lseek(out->fd, offset, SEEK_SET) == -1)
+        return -1;
+    out->offset = offset;
+    return 0;
+}
+
+// Append data to the output. Without compression, data that does not fit into the
+// buffer is written together with the pending bytes in a single writev, without
+// copying it. With compression the buffer is filled block by block.
+static int output_write(Output *out, const void *data, size_t len)
+{
+    if (out->failed)
+        return -1;
+    out->offset += (off_t)len;
+    if (len <= OUTPUT_BUFFER_SIZE - out->len)
+    {
+        memcpy(out->buf + out->len, data, len);
+        out->len += len;
+        return 0;
+    }
+    if (out->compressor)
+    {
+        const char *p = data;
+        while (len > 0)
+        {
+            size_t n = OUTPUT_BUFFER_SIZE - out->len;
+            if (n > len)
+                n = len;
+            memcpy(out->buf + out->len, p, n);
+            out->len += n;
+            p += n;
+            len -= n;
+            if (out->len == OUTPUT_BUFFER_SIZE && output_flush(out) == -1)
+                return -1;
+        }
+        return 0;
+    }
+    struct iovec iov[2] = {{out->buf, out->len}, {(void *)data, len}};
+    out->len = 0;
+    return output_writev(out, iov, 2);
+}
+
+// Append formatted text to the output
+__attribute__((format(printf, 2, 3)))
+static int output_printf(Output *out, const char *fmt, ...)
+{
+    char line[MAX_PATH_LENGTH + 256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+    return output_write(out, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+// Flush and close the output
+static int output_close(Output *out)
+{
+    int result = output_flush(out);
+    if (out->compressor && compressor_finish(out->compressor, out) == -1)
+        result = -1;
+    if (result == 0 && out->path && output_publish(out) == -1)
+        result = -1;
+    if (result == 0 && out->in_place && out->fsync_mode != FSYNC_NONE && fsync(out->fd) == -1)
+        result = -1;
+    int saved_errno = errno;
+    if (!out->keep_fd && close(out->fd) == -1)
+        result = -1;
+    if (out->temp_path)
+        unlink(out->temp_path);
+    errno = saved_errno;
+    free(out->temp_path);
+    free(out->path);
+    free(out->buf);
+    out->temp_path = NULL;
+    out->path = NULL;
+    out->buf = NULL;
+    return result;
+}
+
+// Discard the output after an error, an existing target is left untouched
+static void output_abort(Output *out)
+{
+    out->failed = true;
+    free(out->path);
+    out->path = NULL;
+    output_close(out);
+}
+
+// Current time in seconds from a monotonic clock
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// CPU time used so far by all threads of the process
+static double cpu_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Open one counter of the calling thread. Kernel activity is left out if
+// perf_event_paranoid does not allow counting it and user_only is allowed.
+static int perf_open_event(uint32_t type, uint64_t config, int group_fd, uint64_t read_format, bool user_only)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = read_format;
+    attr.disabled = group_fd == -1;
+    attr.exclude_hv = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1 && user_only && (errno == EACCES || errno == EPERM))
+    {
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+// Open and start the counters. Events that the kernel or the hardware refuse
+// are reported once and left out, the run itself is not affected.
+static void perf_start(CcmContext *ctx)
+{
+    static const uint64_t hardware[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    PerfCounters *pc = &ctx->perf;
+    int error = 0;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+    {
+        pc->fds[i] = -1;
+        pc->slots[i] = -1;
+    }
+
+    for (int i = PERF_CYCLES; i <= PERF_BRANCH_MISSES; i++)
+    {
+        uint64_t format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = perf_open_event(PERF_TYPE_HARDWARE, hardware[i], pc->leader, pc->leader == -1 ? format : 0, true);
+        if (fd == -1)
+        {
+            error = error ? error : errno;
+            continue;
+        }
+        if (pc->leader == -1)
+            pc->leader = fd;
+        pc->fds[i] = fd;
+        pc->slots[i] = pc->slot_count++;
+    }
+    // Context switches happen in the kernel, a user-only count would always be 0
+    pc->fds[PERF_CONTEXT_SWITCHES] = perf_open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1, 0, false);
+    if (pc->fds[PERF_CONTEXT_SWITCHES] == -1)
+        error = error ? error : errno;
+
+    if (pc->leader != -1)
+        ioctl(pc->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    if (pc->fds[PERF_CONTEXT_SWITCHES] != -1)
+        ioctl(pc->fds[PERF_CONTEXT_SWITCHES], PERF_EVENT_IOC_ENABLE, 0);
+    pc->enabled = true;
+
+    if (error == ENOENT || error == ENODEV || error == EOPNOTSUPP)
+    {
+        ccm_error(ctx, "Some performance counters are not supported by this CPU or virtual machine");
+    }
+    else if (error)
+    {
+        int paranoid = -1;
+        FILE *f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+        if (f)
+        {
+            if (fscanf(f, "%d", &paranoid) != 1)
+                paranoid = -1;
+            fclose(f);
+        }
+        ccm_error(ctx, "Some performance counters are unavailable: %s (perf_event_paranoid is %d)", strerror(error),
+                  paranoid);
+    }
+}
+
+// Read the current counts, scaled up if the group was multiplexed
+static void perf_read(const PerfCounters *pc, uint64_t values[PERF_EVENT_COUNT])
+{
+    memset(values, 0, PERF_EVENT_COUNT * sizeof(uint64_t));
+    if (pc->leader != -1)
+    {
+        uint64_t data[3 + PERF_EVENT_COUNT];
+        if (read(pc->leader, data, sizeof(data)) >= (ssize_t)(3 * sizeof(uint64_t)) && data[2] > 0)
+        {
+            double scale = (double)data[1] / (double)data[2];
+            for (int i = 0; i < PERF_EVENT_COUNT; i++)
+            {
+                if (pc->slots[i] != -1 && (uint64_t)pc->slots[i] < data[0])
+                    values[i] = (uint64_t)((double)data[3 + pc->slots[i]] * scale);
+            }
+        }
+    }
+    if (pc->fds[PERF_CONTEXT_SWITCHES] != -1 &&
+        read(pc->fds[PERF_CONTEXT_SWITCHES], &values[PERF_CONTEXT_SWITCHES], sizeof(uint64_t)) != sizeof(uint64_t))
+        values[PERF_CONTEXT_SWITCHES] = 0;
+}
+
+// Start timing a phase
+static PhaseStart phase_begin(CcmContext *ctx)
+{
+    PhaseStart start = {now_seconds(), cpu_seconds(), trace_begin(ctx), {0}};
+    if (ctx->perf.enabled)
+        perf_read(&ctx->perf, start.perf);
+    return start;
+}
+
+// Add the time since start to a phase
+static void phase_end(CcmContext *ctx, Phase phase, PhaseStart start)
+{
+    if (ctx->perf.enabled)
+    {
+        uint64_t now[PERF_EVENT_COUNT];
+        perf_read(&ctx->perf, now);
+        for (int i = 0; i < PERF_EVENT_COUNT; i++)
+            ctx->stats.perf[phase][i] += now[i] - start.perf[i];
+    }
+    ctx->stats.wall[phase] += now_seconds() - start.wall;
+    ctx->stats.cpu[phase] += cpu_seconds() - start.cpu;
+    trace_end(ctx, PHASE_NAMES[phase], "phase", NULL, NULL, start.trace);
+}
+
+// Compress one block into its own gzip member or zstd frame
+static bool compress_block(CompressAlgo algo, int level, CompressSlot *slot)
+{
+#ifdef HAVE_ZLIB
+    if (algo == COMPRESS_GZIP)
+    {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        // 15 + 16: maximum window with a gzip wrapper
+        if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        z.next_in = (Bytef *)slot->in;
+        z.avail_in = (uInt)slot->in_len;
+        z.next_out = (Bytef *)slot->out;
+        z.avail_out = (uInt)slot->out_cap;
+        int result = deflate(&z, Z_FINISH);
+        slot->out_len = slot->out_cap - z.avail_out;
+        deflateEnd(&z);
+        return result == Z_STREAM_END;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (algo == COMPRESS_ZSTD)
+    {
+        size_t n = ZSTD_compress(slot->out, slot->out_cap, slot->in, slot->in_len, level);
+        if (ZSTD_isError(n))
+            return false;
+        slot->out_len = n;
+        return true;
+    }
+#endif
+    (void)level;
+    (void)slot;
+    (void)algo;
+    return false;
+}
+
+// Upper bound of the compressed size of one block
+static size_t compress_bound(CompressAlgo algo, size_t len)
+{
+#ifdef HAVE_ZSTD
+    if (algo == COMPRESS_ZSTD)
+        return ZSTD_compressBound(len);
+#endif
+    (void)algo;
+    // deflateBound() plus the gzip header and trailer, valid for every level
+    return len + (len >> 12) + (len >> 14) + (len >> 25) + 13 + 18;
+}
+
+// Worker thread: compress queued blocks until the pool is stopped
+static void *compress_worker(void *arg)
+{
+    Compressor *c = arg;
+    trace_register(c->ctx, "compress");
+    pthread_mutex_lock(&c->lock);
+    for (;;)
+    {
+        while (!c->stop && c->next_job == c->next_fill)
+            pthread_cond_wait(&c->work, &c->lock);
+        if (c->next_job == c->next_fill)
+            break;
+        size_t seq = c->next_job++;
+        CompressSlot *slot = &c->slots[seq % c->slot_count];
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&c->lock);
+
+        uint64_t trace_start = trace_begin(c->ctx);
+        double start = now_seconds();
+        bool ok = compress_block(c->algo, c->level, slot);
+        double busy = now_seconds() - start;
+        if (c->ctx->trace_enabled)
+        {
+            char block[24];
+            snprintf(block, sizeof(block), "%zu", seq);
+            trace_end(c->ctx, "compress", "compress", "block", block, trace_start);
+        }
+
+        pthread_mutex_lock(&c->lock);
+        slot->failed = !ok;
+        slot->state = SLOT_DONE;
+        c->busy_seconds += busy;
+        pthread_cond_broadcast(&c->done);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// Check whether a compression format was compiled in
+bool ccm_compress_available(CcmCompress algo)
+{
+#ifdef HAVE_ZLIB
+    if (algo == CCM_COMPRESS_GZIP)
+        return true;
+#endif
+#ifdef HAVE_ZSTD
+    if (algo == CCM_COMPRESS_ZSTD)
+        return true;
+#endif
+    (void)algo;
+    return false;
+}
+
+// Start a compression pool. Two slots per thread keep every worker busy while
+// the main thread fills the next block.
+static int compressor_start(Compressor *c, CcmContext *ctx, CompressAlgo algo, int level, int threads)
+{
+    memset(c, 0, sizeof(*c));
+    c->ctx = ctx;
+    c->algo = algo;
+    c->level = level;
+    c->slot_count = (size_t)threads * 2;
+    c->slots = calloc(c->slot_count, sizeof(CompressSlot));
+    c->threads = calloc((size_t)threads, sizeof(pthread_t));
+    if (!c->slots || !c->threads)
+        goto fail;
+
+    for (size_t i = 0; i < c->slot_count; i++)
+    {
+        c->slots[i].out_cap = compress_bound(algo, OUTPUT_BUFFER_SIZE);
+        c->slots[i].in = malloc(OUTPUT_BUFFER_SIZE);
+        c->slots[i].out = malloc(c->slots[i].out_cap);
+        if (!c->slots[i].in || !c->slots[i].out)
+            goto fail;
+    }
+
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->work, NULL);
+    pthread_cond_init(&c->done, NULL);
+    c->start_time = now_seconds();
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&c->threads[i], NULL, compress_worker, c) != 0)
+            break;
+        c->thread_count++;
+    }
+    if (c->thread_count > 0)
+        return 0;
+
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->work);
+    pthread_cond_destroy(&c->done);
+fail:
+    for (size_t i = 0; c->slots && i < c->slot_count; i++)
+    {
+        free(c->slots[i].in);
+        free(c->slots[i].out);
+    }
+    free(c->slots);
+    free(c->threads);
+    return -1;
+}
+
+// Wait for the oldest submitted block and write it to fd
+static int compressor_write_next(Compressor *c, Output *out)
+{
+    CompressSlot *slot = &c->slots[c->next_write % c->slot_count];
+    pthread_mutex_lock(&c->lock);
+    while (slot->state != SLOT_DONE)
+        pthread_cond_wait(&c->done, &c->lock);
+    pthread_mutex_unlock(&c->lock);
+
+    c->next_write++;
+    if (slot->failed)
+    {
+        errno = EIO;
+        out->failed = true;
+    }
+    else if (!out->failed)
+    {
+        struct iovec iov = {slot->out, slot->out_len};
+        output_writev(out, &iov, 1);
+        c->bytes_out += slot->out_len;
+    }
+    slot->state = SLOT_FREE;
+    return out->failed ? -1 : 0;
+}
+
+// Queue a block for compression, writing finished blocks to make room
+static int compressor_submit(Compressor *c, Output *out, const char *data, size_t len)
+{
+    if (c->next_fill - c->next_write == c->slot_count && compressor_write_next(c, out) == -1)
+        return -1;
+
+    CompressSlot *slot = &c->slots[c->next_fill % c->slot_count];
+    memcpy(slot->in, data, len);
+    slot->in_len = len;
+    c->bytes_in += len;
+
+    pthread_mutex_lock(&c->lock);
+    slot->state = SLOT_QUEUED;
+    c->next_fill++;
+    pthread_cond_signal(&c->work);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+// Write all outstanding blocks, stop the workers and release the pool
+static int compressor_finish(Compressor *c, Output *out)
+{
+    int result = 0;
+    while (c->next_write < c->next_fill)
+    {
+        if (compressor_write_next(c, out) == -1)
+            result = -1;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    pthread_cond_broadcast(&c->work);
+    pthread_mutex_unlock(&c->lock);
+    for (int i = 0; i < c->thread_count; i++)
+        pthread_join(c->threads[i], NULL);
+
+    for (size_t i = 0; i < c->slot_count; i++)
+    {
+        free(c->slots[i].in);
+        free(c->slots[i].out);
+    }
+    free(c->slots);
+    free(c->threads);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->work);
+    pthread_cond_destroy(&c->done);
+    return result;
+}
+
+// Write data as the inside of a JSON string or as XML character data. Plain
+// runs are copied as they are, only the bytes that need escaping are replaced.
+static int write_escaped(Output *out, OutputFormat format, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t plain = format == FORMAT_XML ? xml_plain_span(data, len) : json_plain_span(data, len);
+        if (plain && output_write(out, data, plain) == -1)
+            return -1;
+        data += plain;
+        len -= plain;
+        if (len == 0)
+            break;
+
+        unsigned char c = (unsigned char)*data++;
+        len--;
+        char esc[8];
+        const char *rep = esc;
+        if (format == FORMAT_XML)
+        {
+            if (c == '<')
+                rep = "&lt;";
+            else if (c == '>')
+                rep = "&gt;";
+            else if (c == '&')
+                rep = "&amp;";
+            else if (c == '\r')
+                rep = "&#13;";
+            else
+                rep = "\xef\xbf\xbd";  // U+FFFD, other control characters are not allowed in XML 1.0
+        }
+        else if (c == '"')
+            rep = "\\\"";
+        else if (c == '\\')
+            rep = "\\\\";
+        else if (c == '\n')
+            rep = "\\n";
+        else if (c == '\t')
+            rep = "\\t";
+        else if (c == '\r')
+            rep = "\\r";
+        else
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+        if (output_write(out, rep, strlen(rep)) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// Append part of the current file body to the output
+static int body_write(Writer *w, const void *data, size_t len)
+{
+    if (w->opts->format != FORMAT_TEXT)
+        w->body_hash = crc32c(w->body_hash, data, len);
+    if (w->opts->format == FORMAT_JSONL || w->opts->format == FORMAT_JSON || w->opts->format == FORMAT_XML)
+        return write_escaped(w->out, w->opts->format, data, len);
+    if (w->opts->toc && len > 0)
+    {
+        w->body_lines += count_newlines(data, len);
+        w->body_last = ((const char *)data)[len - 1];
+    }
+    return output_write(w->out, data, len);
+}
+
+// Append formatted text to the current file body
+__attribute__((format(printf, 2, 3)))
+static int body_printf(Writer *w, const char *fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+    return body_write(w, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+// Format one table of contents line. All fields have a fixed width, so a line
+// without a record has the same length as the final one.
+static int format_toc_line(char *buf, size_t size, FileCategory cat, const FileEntry *entry,
+                           const SectionRecord *rec)
+{
+    char lines[24] = "", offset[24] = "";
+    if (rec)
+    {
+        snprintf(lines, sizeof(lines), "%llu", (unsigned long long)rec->lines);
+        snprintf(offset, sizeof(offset), "%llu", (unsigned long long)rec->offset);
+    }
+    return snprintf(buf, size, "# %-9s %12lld %10s %14s  %s\n", CATEGORY_NAMES[cat], (long long)entry->size, lines,
+                    offset, entry->path);
+}
+
+// Append table of contents text, or patch it in place at *pos
+static int toc_emit(Writer *w, bool patch, const char *data, size_t len, off_t *pos)
+{
+    if (patch ? pwrite(w->out->fd, data, len, *pos) != (ssize_t)len : output_write(w->out, data, len) == -1)
+        return -1;
+    if (patch)
+    {
+        w->out->ctx->stats.writes++;
+        w->out->ctx->stats.bytes_written += len;
+    }
+    *pos += (off_t)len;
+    return 0;
+}
+
+// Write the table of contents. Without records it only reserves space with
+// placeholder lines, with records the lines are patched into that space.
+static int write_toc(Writer *w, const SectionRecord *records)
+{
+    static const char title[] = "# Table of contents: category, bytes, lines, body offset, path\n";
+    char line[MAX_PATH_LENGTH + 80];
+    size_t next = 0;
+    off_t pos = w->toc_offset;
+    bool patch = records != NULL;
+
+    if (toc_emit(w, patch, title, sizeof(title) - 1, &pos) == -1)
+        return -1;
+    for (int cat = 0; cat < CAT_COUNT; cat++)
+    {
+        for (size_t i = 0; i < w->categories[cat].count; i++)
+        {
+            const FileEntry *entry = &w->categories[cat].items[i];
+            const SectionRecord *rec = NULL;
+            if (patch && next < w->section_count && records[next].path == entry->path)
+                rec = &records[next++];
+            int len = format_toc_line(line, sizeof(line), (FileCategory)cat, entry, rec);
+            if (len < 0 || (size_t)len >= sizeof(line) || toc_emit(w, patch, line, (size_t)len, &pos) == -1)
+                return -1;
+        }
+    }
+    return toc_emit(w, patch, "\n", 1, &pos);
+}
+
+// Write the output header before the first file section
+static void write_header(Writer *w)
+{
+    if (!w->is_first)
+        return;
+    w->is_first = false;
+    if (w->opts->format != FORMAT_TEXT)
+        return;
+    output_printf(w->out, "# Created by CCodemerge v%s\n# https://github.com/Lennart1978/ccodemerge\n\n", VERSION);
+    if (w->opts->toc)
+    {
+        // Reserve the table of contents, writer_finish fills in the real values
+        w->toc_offset = w->out->offset;
+        write_toc(w, NULL);
+    }
+    if (w->license->text)
+    {
+        output_printf(w->out, "# Leading comment shared by %zu files, removed from their sections:\n\n",
+                      w->license->count);
+        output_write(w->out, w->license->text, w->license->len);
+        output_write(w->out, "\n\n", 2);
+    }
+}
+
+// Start the section of one file. A file whose contents are left out names
+// the reason in omitted, the structured formats then write it as a field
+// instead of the content.
+static void begin_section(Writer *w, const FileEntry *entry, FileCategory cat, const char *omitted)
+{
+    Output *out = w->out;
+    OutputFormat format = w->opts->format;
+    write_header(w);
+    w->omitted = omitted && format != FORMAT_TEXT && format != FORMAT_ARCHIVE;
+    if (format == FORMAT_TEXT)
+    {
+        output_printf(out, "\nFile: %s\n\n", entry->path);
+    }
+    else if (format == FORMAT_JSONL || format == FORMAT_JSON)
+    {
+        if (format == FORMAT_JSON)
+            output_write(out, w->section_count ? ",\n  " : "  ", w->section_count ? 4 : 2);
+        output_write(out, "{\"path\":\"", 9);
+        write_escaped(out, format, entry->path, strlen(entry->path));
+        output_printf(out, "\",\"category\":\"%s\",\"size\":%lld,\"mtime\":%lld,", CATEGORY_NAMES[cat],
+                      (long long)entry->size, (long long)mtime_seconds(entry->mtime_ns));
+        if (w->omitted)
+            output_printf(out, "\"omitted\":\"%s\"", omitted);
+        else
+            output_write(out, "\"content\":\"", 11);
+    }
+    else if (format == FORMAT_XML)
+    {
+        // Paths are written as attribute values, so '"' needs escaping as well
+        output_write(out, "  <file path=\"", 14);
+        for (const char *p = entry->path; *p; p++)
+        {
+            if (*p == '"')
+                output_write(out, "&quot;", 6);
+            else
+                write_escaped(out, format, p, 1);
+        }
+        output_printf(out, "\" category=\"%s\" size=\"%lld\" mtime=\"%lld\"", CATEGORY_NAMES[cat],
+                      (long long)entry->size, (long long)mtime_seconds(entry->mtime_ns));
+        if (w->omitted)
+            output_printf(out, " omitted=\"%s\"/>\n", omitted);
+        else
+            output_write(out, ">\n    <content>", 15);
+    }
+    w->body_start = w->out->offset;
+    w->body_hash = 0;
+    w->body_lines = 0;
+    w->body_last = '\n';
+}
+
+// Finish the section of one file
+static int end_section(Writer *w, const FileEntry *entry, FileCategory cat)
+{
+    OutputFormat format = w->opts->format;
+    if (format == FORMAT_TEXT)
+        output_printf(w->out, "\n-------------------------- End of %s --------------------------\n", entry->path);
+    else if (w->omitted)
+    {
+        // An XML element without content closed itself in begin_section
+        if (format != FORMAT_XML)
+            output_write(w->out, "}\n", format == FORMAT_JSONL ? 2 : 1);
+    }
+    else if (format == FORMAT_JSONL || format == FORMAT_JSON)
+        output_printf(w->out, "\",\"hash\":\"crc32c:%08x\"}%s", w->body_hash, format == FORMAT_JSONL ? "\n" : "");
+    else if (format == FORMAT_XML)
+        output_printf(w->out, "</content>\n    <hash>crc32c:%08x</hash>\n  </file>\n", w->body_hash);
+
+    if (w->section_count == w->section_capacity)
+    {
+        size_t new_cap = w->section_capacity ? w->section_capacity * 2 : 256;
+        SectionRecord *tmp = realloc(w->sections, new_cap * sizeof(SectionRecord));
+        if (!tmp)
+            return -1;
+        w->sections = tmp;
+        w->section_capacity = new_cap;
+    }
+    SectionRecord *rec = &w->sections[w->section_count++];
+    rec->path = entry->path;
+    rec->category = cat;
+    rec->offset = (uint64_t)(w->body_start - w->data_offset);
+    rec->length = (uint64_t)(w->out->offset - w->body_start);
+    rec->hash = w->body_hash;
+    // A last line without a newline still counts
+    rec->lines = w->body_lines + (rec->length > 0 && w->body_last != '\n');
+    return w->out->failed ? -1 : 0;
+}
+
+// Compare function for sorting section records by path (used by qsort)
+static int compare_sections(const void *a, const void *b)
+{
+    return strcmp(((const SectionRecord *)a)->path, ((const SectionRecord *)b)->path);
+}
+
+// Size of the archive header, table of contents and names for a list of files
+static off_t archive_index_size(const FileList categories[CAT_COUNT])
+{
+    off_t size = sizeof(ArchiveHeader);
+    for (int cat = 0; cat < CAT_COUNT; cat++)
+    {
+        for (size_t i = 0; i < categories[cat].count; i++)
+            size += (off_t)(sizeof(ArchiveEntry) + strlen(categories[cat].items[i].path) + 1);
+    }
+    return size;
+}
+
+// Start the output. An archive reserves room for its index, which is filled
+// in by writer_finish once all body offsets are known.
+static int writer_start(Writer *w, Output *out, const MergeOptions *opts, const LicenseBlock *license,
+                        const FileList categories[CAT_COUNT])
+{
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->opts = opts;
+    w->license = license;
+    w->is_first = true;
+    w->categories = categories;
+
+    if (opts->toc)
+    {
+        struct stat st;
+        if (out->compressor || fstat(out->fd, &st) == -1 || !S_ISREG(st.st_mode))
+        {
+            ccm_error(out->ctx, "The table of contents needs an uncompressed, seekable output file");
+            return -1;
+        }
+    }
+
+    if (opts->format == FORMAT_JSON)
+        output_write(out, "[\n", 2);
+    else if (opts->format == FORMAT_XML)
+        output_printf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<ccodemerge version=\"%s\">\n", VERSION);
+
+    if (opts->format == FORMAT_ARCHIVE)
+    {
+        struct stat st;
+        if (out->compressor || fstat(out->fd, &st) == -1 || !S_ISREG(st.st_mode))
+        {
+            ccm_error(out->ctx, "The archive format needs an uncompressed, seekable output file");
+            return -1;
+        }
+        w->data_offset = archive_index_size(categories);
+        if (lseek(out->fd, w->data_offset, SEEK_SET) == -1)
+            return -1;
+        out->offset = w->data_offset;
+    }
+    return 0;
+}
+
+// Write the archive header, table of contents and names into the reserved space
+static int write_archive_index(Writer *w)
+{
+    if (output_flush(w->out) == -1)
+        return -1;
+
+    qsort(w->sections, w->section_count, sizeof(SectionRecord), compare_sections);
+
+    size_t toc_size = w->section_count * sizeof(ArchiveEntry);
+    size_t names_size = 0;
+    for (size_t i = 0; i < w->section_count; i++)
+        names_size += strlen(w->sections[i].path) + 1;
+
+    size_t index_size = sizeof(ArchiveHeader) + toc_size + names_size;
+    char *index = calloc(1, index_size);
+    if (!index)
+        return -1;
+
+    ArchiveHeader *header = (ArchiveHeader *)index;
+    memcpy(header->magic, ARCHIVE_MAGIC, sizeof(header->magic));
+    header->version = htole32(ARCHIVE_VERSION);
+    header->count = htole32((uint32_t)w->section_count);
+    header->toc_offset = htole64(sizeof(ArchiveHeader));
+    header->names_offset = htole64(sizeof(ArchiveHeader) + toc_size);
+    header->names_size = htole64(names_size);
+    header->data_offset = htole64((uint64_t)w->data_offset);
+    header->data_size = htole64((uint64_t)(w->out->offset - w->data_offset));
+
+    ArchiveEntry *toc = (ArchiveEntry *)(index + sizeof(ArchiveHeader));
+    char *names = index + sizeof(ArchiveHeader) + toc_size;
+    size_t name_offset = 0;
+    for (size_t i = 0; i < w->section_count; i++)
+    {
+        const SectionRecord *rec = &w->sections[i];
+        size_t len = strlen(rec->path);
+        memcpy(names + name_offset, rec->path, len + 1);
+        toc[i].name_offset = htole64(name_offset);
+        toc[i].name_len = htole32((uint32_t)len);
+        toc[i].category = htole32((uint32_t)rec->category);
+        toc[i].offset = htole64(rec->offset);
+        toc[i].length = htole64(rec->length);
+        toc[i].hash = htole32(rec->hash);
+        name_offset += len + 1;
+    }
+
+    ssize_t written = pwrite(w->out->fd, index, index_size, 0);
+    w->out->ctx->stats.writes++;
+    if (written > 0)
+        w->out->ctx->stats.bytes_written += (uint64_t)written;
+    free(index);
+    return written == (ssize_t)index_size ? 0 : -1;
+}
+
+// Finish the output after the last file
+static int writer_finish(Writer *w)
+{
+    int result = 0;
+    if (w->opts->format == FORMAT_ARCHIVE)
+        result = write_archive_index(w);
+    else if (w->opts->toc && !w->is_first)
+        result = output_flush(w->out) == -1 ? -1 : write_toc(w, w->sections);
+    else if (w->opts->format == FORMAT_JSON)
+        result = output_write(w->out, w->section_count ? "\n]\n" : "]\n", w->section_count ? 3 : 2);
+    else if (w->opts->format == FORMAT_XML)
+        result = output_write(w->out, "</ccodemerge>\n", 14);
+    free(w->sections);
+    w->sections = NULL;
+    return result;
+}
+
+// Validate the part of a file after the first chunk, then seek back to offset
+static TextKind validate_rest(CcmContext *ctx, FILE *src, Utf8Validator *v, off_t offset, char *buffer, size_t size)
+{
+    TextKind kind = TEXT_OK;
+    size_t bytes;
+    while (kind == TEXT_OK && (bytes = read_chunk(ctx, src, buffer, size)) > 0)
+        kind = scan_text(v, buffer, bytes);
+    if (kind == TEXT_OK && v->need)
+        kind = TEXT_INVALID_UTF8;
+    if (fseeko(src, offset, SEEK_SET) == -1)
+        return TEXT_BINARY;
+    return kind;
+}
+
+// Write data to the output, optionally through the comment stripper.
+// scratch must hold COPY_BUFFER_SIZE + sizeof(stripper->pending) + 2 bytes.
+static int write_chunk(Writer *w, CommentStripper *stripper, const char *data, size_t len, char *scratch)
+{
+    if (!stripper)
+        return body_write(w, data, len);
+
+    while (len > 0)
+    {
+        size_t n = len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE;
+        size_t stripped = strip_chunk(stripper, data, n, scratch);
+        if (body_write(w, scratch, stripped) == -1)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Find the end of the first `lines` lines of data
+static size_t find_head_end(const char *data, size_t len, size_t lines)
+{
+    size_t pos = 0;
+    while (lines-- > 0 && pos < len)
+    {
+        const char *nl = memchr(data + pos, '\n', len - pos);
+        if (!nl)
+            return len;
+        pos = (size_t)(nl - data) + 1;
+    }
+    return pos;
+}
+
+// Find the start of the last `lines` lines of data
+static size_t find_tail_start(const char *data, size_t len, size_t lines)
+{
+    size_t pos = len;
+    if (lines == 0)
+        return len;
+    // A final newline terminates the last line, it does not start a new one
+    if (pos > 0 && data[pos - 1] == '\n')
+        pos--;
+    while (pos > 0)
+    {
+        const char *nl = memrchr(data, '\n', pos);
+        if (!nl)
+            return 0;
+        if (--lines == 0)
+            return (size_t)(nl - data) + 1;
+        pos = (size_t)(nl - data);
+    }
+    return 0;
+}
+
+// Write the first and last lines of a file that exceeds the size cap. The file is
+// mapped, so only the pages holding the sampled lines are ever read.
+static int write_sampled(Writer *w, int fd, const FileEntry *entry, size_t skip, CommentStripper *stripper,
+                         char *scratch)
+{
+    const MergeOptions *opts = w->opts;
+    CcmContext *ctx = w->out->ctx;
+    // Never map past the current end, a file that shrank since the scan would fault
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        ccm_error(ctx, "Error accessing %s: %s", entry->path, strerror(errno));
+        return -1;
+    }
+    size_t size = (size_t)(st.st_size < entry->size ? st.st_size : entry->size);
+    if (size <= skip)
+        return 0;
+
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        ccm_error(ctx, "Error mapping %s: %s", entry->path, strerror(errno));
+        return -1;
+    }
+
+    size_t head_end = skip + find_head_end(map + skip, size - skip, opts->head_lines);
+    size_t tail_start = find_tail_start(map, size, opts->tail_lines);
+    if (tail_start < head_end)
+        tail_start = head_end;
+
+    ctx->stats.bytes_read += (head_end - skip) + (size - tail_start);
+    int result = write_chunk(w, stripper, map + skip, head_end - skip, scratch);
+    if (result == 0 && tail_start > head_end)
+    {
+        if (stripper)
+        {
+            size_t stripped = strip_finish(stripper, scratch);
+            if (body_write(w, scratch, stripped) == -1)
+                result = -1;
+            // The tail starts in unknown lexer state, assume ordinary code
+            init_stripper(stripper, opts);
+        }
+        body_printf(w, "\n[... %lld bytes omitted ...]\n\n", (long long)(tail_start - head_end));
+    }
+    if (result == 0)
+        result = write_chunk(w, stripper, map + tail_start, size - tail_start, scratch);
+
+    munmap(map, size);
+    return result;
+}
+
+// Write a single file's contents to the output file.
+// Returns 0 on success, 1 if the file was omitted as non-text and -1 on error.
+static int write_file(Writer *w, const FileEntry *entry, FileCategory cat)
+{
+    const MergeOptions *opts = w->opts;
+    const LicenseBlock *license = w->license;
+    CcmContext *ctx = w->out->ctx;
+    const char *path = entry->path;
+    if (entry->size == 0)
+        return 0;
+
+    ctx->stats.opens++;
+    FILE *src = fopen(path, "r");
+    if (!src)
+    {
+        ccm_error(ctx, "Error opening %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    // Comment and blank-line stripping only applies to C/C++ files
+    CommentStripper stripper;
+    bool transform = (opts->strip_comments || opts->compact) && (cat == CAT_HEADER || cat == CAT_SOURCE);
+    if (transform)
+        init_stripper(&stripper, opts);
+
+    char buffer[COPY_BUFFER_SIZE];
+    char stripped[COPY_BUFFER_SIZE + sizeof(stripper.pending) + 2];
+    size_t bytes = read_chunk(ctx, src, buffer, sizeof(buffer));
+    if (ferror(src))
+    {
+        ccm_error(ctx, "Read error for %s: %s", path, strerror(errno));
+        fclose(src);
+        return -1;
+    }
+
+    // Sniff the first chunk (and optionally the whole file) before anything is written
+    TextKind kind = TEXT_OK;
+    if (opts->binary_mode != BINARY_COPY)
+    {
+        Utf8Validator validator = {0};
+        kind = scan_text(&validator, buffer, bytes);
+        bool at_eof = (off_t)bytes >= entry->size;
+        if (kind == TEXT_OK && at_eof && validator.need)
+            kind = TEXT_INVALID_UTF8;
+        if (kind == TEXT_OK && !at_eof && opts->validate_utf8)
+            kind = validate_rest(ctx, src, &validator, (off_t)bytes, stripped, COPY_BUFFER_SIZE);
+    }
+
+    if (kind != TEXT_OK && opts->binary_mode == BINARY_SKIP)
+    {
+        fclose(src);
+        return 1;
+    }
+
+    begin_section(w, entry, cat, kind == TEXT_OK ? NULL : kind == TEXT_BINARY ? "binary" : "non-utf8");
+
+    if (kind != TEXT_OK)
+    {
+        if (!w->omitted)
+            body_printf(w, "[%s omitted: %lld bytes]\n", kind == TEXT_BINARY ? "Binary file" : "Non-UTF-8 file",
+                        (long long)entry->size);
+        fclose(src);
+        return end_section(w, entry, cat) == -1 ? -1 : 1;
+    }
+
+    // Drop the shared leading comment, it was already written in the header
+    const char *data = buffer;
+    off_t consumed = 0;
+    if (license->text && (cat == CAT_HEADER || cat == CAT_SOURCE))
+    {
+        size_t comment_end;
+        size_t skip = leading_comment_length(buffer, bytes, &comment_end);
+        if (skip && comment_end == license->len && memcmp(buffer, license->text, license->len) == 0)
+        {
+            data += skip;
+            bytes -= skip;
+            consumed += (off_t)skip;
+        }
+    }
+
+    CommentStripper *active = transform ? &stripper : NULL;
+    bool oversized = opts->max_file_size && entry->size > opts->max_file_size;
+    bool truncated = false;
+    if (oversized && (opts->head_lines || opts->tail_lines))
+    {
+        if (write_sampled(w, fileno(src), entry, (size_t)consumed, active, stripped) == -1)
+        {
+            ccm_error(ctx, "Write error for %s: %s", path, strerror(errno));
+            fclose(src);
+            return -1;
+        }
+    }
+    else
+    {
+        do
+        {
+            // Cut at the size cap, preferably at the end of a line
+            if (opts->max_file_size && consumed + (off_t)bytes > opts->max_file_size)
+            {
+                bytes = consumed < opts->max_file_size ? (size_t)(opts->max_file_size - consumed) : 0;
+                const char *nl = memrchr(data, '\n', bytes);
+                if (nl)
+                    bytes = (size_t)(nl - data) + 1;
+                truncated = true;
+            }
+            consumed += (off_t)bytes;
+
+            if (write_chunk(w, active, data, bytes, stripped) == -1)
+            {
+                ccm_error(ctx, "Write error for %s: %s", path, strerror(errno));
+                fclose(src);
+                return -1;
+            }
+            data = buffer;
+        } while (!truncated && (bytes = read_chunk(ctx, src, buffer, sizeof(buffer))) > 0);
+
+        if (ferror(src))
+        {
+            ccm_error(ctx, "Read error for %s: %s", path, strerror(errno));
+            fclose(src);
+            return -1;
+        }
+    }
+
+    if (transform)
+    {
+        bytes = strip_finish(&stripper, stripped);
+        if (body_write(w, stripped, bytes) == -1)
+        {
+            ccm_error(ctx, "Write error for %s: %s", path, strerror(errno));
+            fclose(src);
+            return -1;
+        }
+    }
+
+    if (truncated)
+        body_printf(w, "\n[... truncated: %lld of %lld bytes omitted ...]\n", (long long)(entry->size - consumed),
+                    (long long)entry->size);
+
+    fclose(src);
+    if (end_section(w, entry, cat) == -1)
+    {
+        ccm_error(ctx, "Write error for %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Hash everything besides the file contents that shapes a text output, so an
+// index from a run with other options is not reused
+static uint32_t options_fingerprint(const MergeOptions *opts, const LicenseBlock *license)
+{
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), "%s %d %d %d %d %d %lld %zu %zu %zu", VERSION, opts->strip_comments,
+                     opts->compact, opts->dedup_license, opts->validate_utf8, (int)opts->binary_mode,
+                     (long long)opts->max_file_size, opts->head_lines, opts->tail_lines, license->count);
+    uint32_t hash = crc32c(0, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+    return license->text ? crc32c(hash, license->text, license->len) : hash;
+}
+
+// Release a loaded index
+static void free_index(MergeIndex *index)
+{
+    free(index->records);
+    free(index->data);
+    memset(index, 0, sizeof(*index));
+}
+
+// Load the section index of an output. Fails if there is none or if it does
+// not describe the output as it is on disk now.
+static int load_index(MergeIndex *index, const char *index_path, const char *output_path, uint32_t fingerprint)
+{
+    memset(index, 0, sizeof(*index));
+    struct stat out_st, st;
+    if (stat(output_path, &out_st) == -1 || !S_ISREG(out_st.st_mode))
+        return -1;
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(IndexHeader) || !(index->data = malloc(st.st_size + 1)))
+    {
+        close(fd);
+        return -1;
+    }
+    ssize_t n = read(fd, index->data, (size_t)st.st_size);
+    close(fd);
+
+    const IndexHeader *h = (const IndexHeader *)index->data;
+    uint32_t count = le32toh(h->count);
+    uint64_t names_size = le64toh(h->names_size);
+    if (n != st.st_size || memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        le32toh(h->version) != INDEX_VERSION || le32toh(h->fingerprint) != fingerprint ||
+        sizeof(IndexHeader) + (uint64_t)count * sizeof(IndexEntry) + names_size != (uint64_t)st.st_size ||
+        le64toh(h->output_size) != (uint64_t)out_st.st_size || le64toh(h->output_inode) != (uint64_t)out_st.st_ino ||
+        (int64_t)le64toh(h->output_mtime_sec) != out_st.st_mtim.tv_sec ||
+        (int64_t)le64toh(h->output_mtime_nsec) != out_st.st_mtim.tv_nsec)
+    {
+        free_index(index);
+        return -1;
+    }
+
+    const IndexEntry *entries = (const IndexEntry *)(index->data + sizeof(IndexHeader));
+    char *names = index->data + sizeof(IndexHeader) + (size_t)count * sizeof(IndexEntry);
+    names[names_size] = '\0';
+    index->records = malloc((count ? count : 1) * sizeof(IndexRecord));
+    if (!index->records)
+    {
+        free_index(index);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        IndexRecord *rec = &index->records[i];
+        uint32_t name = le32toh(entries[i].name_offset);
+        rec->path = name < names_size ? names + name : "";
+        rec->category = (FileCategory)le32toh(entries[i].category);
+        rec->size = (off_t)le64toh(entries[i].size);
+        rec->mtime_ns = (int64_t)le64toh(entries[i].mtime_ns);
+        rec->start = (off_t)le64toh(entries[i].start);
+        rec->length = (off_t)le64toh(entries[i].length);
+        if (rec->start + rec->length > out_st.st_size)
+        {
+            free_index(index);
+            return -1;
+        }
+    }
+    index->count = count;
+    index->output_size = out_st.st_size;
+    index->started_ns = (int64_t)le64toh(h->started_ns);
+    return 0;
+}
+
+// Write the section index of a finished output, replacing the old one atomically
+static int save_index(CcmContext *ctx, const char *index_path, const char *output_path, const IndexRecord *records,
+                      size_t count, uint32_t fingerprint, int64_t started_ns)
+{
+    struct stat st;
+    if (stat(output_path, &st) == -1)
+        return -1;
+
+    uint64_t names_size = 0;
+    for (size_t i = 0; i < count; i++)
+        names_size += strlen(records[i].path) + 1;
+    if (names_size > UINT32_MAX)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    IndexHeader header = {0};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = htole32(INDEX_VERSION);
+    header.count = htole32((uint32_t)count);
+    header.fingerprint = htole32(fingerprint);
+    header.names_size = htole64(names_size);
+    header.output_size = htole64((uint64_t)st.st_size);
+    header.output_inode = htole64((uint64_t)st.st_ino);
+    header.output_mtime_sec = (int64_t)htole64((uint64_t)st.st_mtim.tv_sec);
+    header.output_mtime_nsec = (int64_t)htole64((uint64_t)st.st_mtim.tv_nsec);
+    header.started_ns = (int64_t)htole64((uint64_t)started_ns);
+
+    Output out;
+    if (output_open(&out, ctx, index_path, FSYNC_NONE) == -1)
+        return -1;
+    output_write(&out, &header, sizeof(header));
+    uint32_t name_offset = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        IndexEntry entry = {0};
+        entry.start = htole64((uint64_t)records[i].start);
+        entry.length = htole64((uint64_t)records[i].length);
+        entry.size = (int64_t)htole64((uint64_t)records[i].size);
+        entry.mtime_ns = (int64_t)htole64((uint64_t)records[i].mtime_ns);
+        entry.name_offset = htole32(name_offset);
+        entry.category = htole32((uint32_t)records[i].category);
+        output_write(&out, &entry, sizeof(entry));
+        name_offset += (uint32_t)strlen(records[i].path) + 1;
+    }
+    for (size_t i = 0; i < count; i++)
+        output_write(&out, records[i].path, strlen(records[i].path) + 1);
+    if (out.failed)
+    {
+        output_abort(&out);
+        return -1;
+    }
+    return output_close(&out);
+}
+
+// Position the output for entry n of an incremental run. Returns 1 if the
+// entry is unchanged and can be skipped. A changed entry at the same place
+// in the file list is rewritten over its old section. Once the file list
+// diverges, or a rewritten section changes length, everything from there on
+// is rewritten and *tail is set.
+static int incremental_seek(Writer *w, const MergeIndex *old, size_t n, const FileEntry *entry, FileCategory cat,
+                            bool *tail)
+{
+    if (*tail)
+        return 0;
+    off_t pos;
+    if (n < old->count && old->records[n].category == cat && strcmp(old->records[n].path, entry->path) == 0)
+    {
+        // File systems stamp with a coarse clock, an edit in the tick of the
+        // last read leaves the time alone. Such recent files are rewritten.
+        if (old->records[n].size == entry->size && old->records[n].mtime_ns == entry->mtime_ns &&
+            old->records[n].mtime_ns < old->started_ns)
+            return 1;
+        pos = old->records[n].start;
+    }
+    else
+    {
+        pos = n < old->count ? old->records[n].start : old->output_size;
+        *tail = true;
+    }
+    if (output_seek(w->out, pos) == -1)
+        return -1;
+    // The header goes in front of the first section that is written
+    w->is_first = pos == 0;
+    return 0;
+}
+
+// Memory-mapped archive opened for reading
+typedef struct
+{
+    const char *map;
+    size_t size;
+    uint32_t count;
+    const ArchiveEntry *toc;
+    const char *names;
+    size_t names_size;
+    const char *data;
+    size_t data_size;
+} ArchiveReader;
+
+// Whether len bytes at offset fit into size bytes. Written without adding, so
+// that offsets and lengths from a corrupt file cannot wrap around.
+static bool range_fits(uint64_t offset, uint64_t len, uint64_t size)
+{
+    return offset <= size && len <= size - offset;
+}
+
+// Map an archive and validate its header
+static int archive_open(CcmContext *ctx, ArchiveReader *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        ccm_error(ctx, "Error opening %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ArchiveHeader))
+    {
+        ccm_error(ctx, "%s is not a CCodemerge archive", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        ccm_error(ctx, "Error mapping %s: %s", path, strerror(errno));
+        return -1;
+    }
+    r->map = map;
+    r->size = (size_t)st.st_size;
+
+    const ArchiveHeader *h = map;
+    uint64_t toc_offset = le64toh(h->toc_offset);
+    uint64_t names_offset = le64toh(h->names_offset);
+    uint64_t data_offset = le64toh(h->data_offset);
+    r->count = le32toh(h->count);
+    r->names_size = le64toh(h->names_size);
+    r->data_size = le64toh(h->data_size);
+    if (memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) != 0 || le32toh(h->version) != ARCHIVE_VERSION ||
+        toc_offset > r->size || toc_offset % sizeof(uint64_t) != 0 ||
+        r->count > (r->size - toc_offset) / sizeof(ArchiveEntry) ||
+        !range_fits(names_offset, r->names_size, r->size) || !range_fits(data_offset, r->data_size, r->size))
+    {
+        ccm_error(ctx, "%s is not a valid CCodemerge archive", path);
+        munmap((void *)r->map, r->size);
+        return -1;
+    }
+    r->toc = (const ArchiveEntry *)(r->map + toc_offset);
+    r->names = r->map + names_offset;
+    r->data = r->map + data_offset;
+    return 0;
+}
+
+// Get the path of a table of contents entry, NULL if it is out of bounds
+static const char *archive_name(const ArchiveReader *r, const ArchiveEntry *e, size_t *len)
+{
+    uint64_t offset = le64toh(e->name_offset);
+    *len = le32toh(e->name_len);
+    // The terminating NUL must be inside the names as well
+    if (offset >= r->names_size || *len >= r->names_size - offset)
+        return NULL;
+    return r->names + offset;
+}
+
+// Find a file by path with a binary search over the sorted table of contents
+static const ArchiveEntry *archive_find(const ArchiveReader *r, const char *path)
+{
+    size_t path_len = strlen(path);
+    size_t lo = 0, hi = r->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t len;
+        const char *name = archive_name(r, &r->toc[mid], &len);
+        if (!name)
+            return NULL;
+        int cmp = memcmp(name, path, len < path_len ? len : path_len);
+        if (cmp == 0)
+            cmp = len < path_len ? -1 : len > path_len;
+        if (cmp == 0)
+            return &r->toc[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+// Print the table of contents of an archive
+int ccm_archive_list(CcmContext *ctx, const char *archive, FILE *stream)
+{
+    ArchiveReader r;
+    if (archive_open(ctx, &r, archive) == -1)
+        return -1;
+    for (uint32_t i = 0; i < r.count; i++)
+    {
+        size_t len;
+        const char *name = archive_name(&r, &r.toc[i], &len);
+        uint32_t cat = le32toh(r.toc[i].category);
+        if (!name)
+            continue;
+        fprintf(stream, "%-9s %12llu  %08x  %.*s\n", cat < CAT_COUNT ? CATEGORY_NAMES[cat] : "?",
+                (unsigned long long)le64toh(r.toc[i].length), le32toh(r.toc[i].hash), (int)len, name);
+    }
+    munmap((void *)r.map, r.size);
+    return 0;
+}
+
+// Write the bodies of the given files from an archive to fd
+int ccm_archive_extract(CcmContext *ctx, const char *archive, const char *const *paths, int count, int fd)
+{
+    ArchiveReader r;
+    if (archive_open(ctx, &r, archive) == -1)
+        return -1;
+    Output out;
+    if (output_open_fd(&out, ctx, fd) == -1)
+    {
+        munmap((void *)r.map, r.size);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < count; i++)
+    {
+        // Paths are stored absolute, accept relative ones for files that still exist
+        const ArchiveEntry *e = archive_find(&r, paths[i]);
+        char *abs_path = e ? NULL : realpath(paths[i], NULL);
+        if (abs_path)
+            e = archive_find(&r, abs_path);
+        free(abs_path);
+        if (!e)
+        {
+            ccm_error(ctx, "%s: not found in %s", paths[i], archive);
+            result = -1;
+            continue;
+        }
+
+        uint64_t offset = le64toh(e->offset);
+        uint64_t length = le64toh(e->length);
+        if (!range_fits(offset, length, r.data_size))
+        {
+            ccm_error(ctx, "%s: corrupt entry in %s", paths[i], archive);
+            result = -1;
+            continue;
+        }
+        if (crc32c(0, r.data + offset, length) != le32toh(e->hash))
+        {
+            ccm_error(ctx, "%s: checksum mismatch in %s", paths[i], archive);
+            result = -1;
+        }
+        if (output_write(&out, r.data + offset, length) == -1)
+            break;
+    }
+    if (output_close(&out) == -1)
+    {
+        ccm_error(ctx, "Write error: %s", strerror(errno));
+        result = -1;
+    }
+    munmap((void *)r.map, r.size);
+    return result;
+}
+
+// Write the recorded events as a Chrome trace, which chrome://tracing and
+// ui.perfetto.dev can open. Must only be called once all threads have finished.
+int ccm_write_trace(CcmContext *ctx, const char *path)
+{
+    Output out;
+    if (output_open(&out, ctx, path, FSYNC_NONE) == -1)
+        return -1;
+    output_printf(&out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *sep = "";
+    TraceBuffer *b = atomic_exchange(&ctx->trace_buffers, NULL);
+    while (b)
+    {
+        output_printf(&out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                      sep, b->tid, b->thread_name);
+        sep = ",\n";
+        uint64_t head = atomic_load_explicit(&b->head, memory_order_acquire);
+        for (uint64_t i = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0; i < head; i++)
+        {
+            const TraceEvent *e = &b->events[i % TRACE_BUFFER_EVENTS];
+            output_printf(&out, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                          e->name, e->cat, b->tid, (double)(e->start_ns - ctx->trace_origin) / 1e3,
+                          (double)e->dur_ns / 1e3);
+            if (e->arg_name)
+            {
+                output_printf(&out, ",\"args\":{\"%s\":\"", e->arg_name);
+                write_escaped(&out, FORMAT_JSON, e->arg, strlen(e->arg));
+                output_write(&out, "\"}", 2);
+            }
+            output_write(&out, "}", 1);
+        }
+        TraceBuffer *next = b->next;
+        if (b == trace_local)
+            trace_local = NULL;
+        free(b);
+        b = next;
+    }
+    output_printf(&out, "\n]}\n");
+    return output_close(&out);
+}
+
+
+// Open the unnamed spill file of a set on its first spill
+static int spill_open(CcmFileSet *files)
+{
+    if (files->spill_fd != -1)
+        return 0;
+    files->spill_fd = open(files->temp_dir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    if (files->spill_fd != -1)
+        return 0;
+    // No O_TMPFILE support, use a named file that is removed at once
+    size_t len = strlen(files->temp_dir) + 32;
+    char *path = malloc(len);
+    if (!path)
+        return -1;
+    snprintf(path, len, "%s/.ccodemerge.XXXXXX", files->temp_dir);
+    files->spill_fd = mkostemp(path, O_CLOEXEC);
+    if (files->spill_fd != -1)
+        unlink(path);
+    free(path);
+    return files->spill_fd == -1 ? -1 : 0;
+}
+
+// Start a new run at the end of the spill file
+static int spill_begin(SpillWriter *w, CcmFileSet *files, int level)
+{
+    *w = (SpillWriter){files, malloc(SPILL_BUFFER_SIZE), 0, {files->spill_size, 0, 0, level}};
+    return w->buf ? 0 : -1;
+}
+
+// Append the buffered records to the spill file
+static int spill_flush(SpillWriter *w)
+{
+    errno = 0;
+    if (pwrite(w->files->spill_fd, w->buf, w->len, w->files->spill_size) != (ssize_t)w->len)
+    {
+        // A short write without an error is a full disk
+        if (errno == 0)
+            errno = ENOSPC;
+        return -1;
+    }
+    w->files->spill_size += (off_t)w->len;
+    w->run.length += (off_t)w->len;
+    w->len = 0;
+    return 0;
+}
+
+// Append an entry to the run of a writer
+static int spill_write(SpillWriter *w, const FileEntry *e)
+{
+    uint32_t path_len = (uint32_t)strlen(e->path);
+    if (w->len + SPILL_RECORD_SIZE + path_len + 1 > SPILL_BUFFER_SIZE && spill_flush(w) == -1)
+        return -1;
+    int64_t size = (int64_t)e->size, mtime = e->mtime_ns;
+    memcpy(w->buf + w->len, &size, 8);
+    memcpy(w->buf + w->len + 8, &mtime, 8);
+    memcpy(w->buf + w->len + 16, &path_len, 4);
+    memcpy(w->buf + w->len + SPILL_RECORD_SIZE, e->path, path_len + 1);
+    w->len += SPILL_RECORD_SIZE + path_len + 1;
+    w->run.count++;
+    return 0;
+}
+
+// Finish the run of a writer unless result reports an earlier error
+static int spill_end(SpillWriter *w, int result)
+{
+    if (result == 0 && w->len > 0)
+        result = spill_flush(w);
+    free(w->buf);
+    return result;
+}
+
+// Append a run to the runs of a category
+static int add_run(CcmFileSet *files, FileCategory cat, SpillRun run)
+{
+    if (files->run_count[cat] == files->run_capacity[cat])
+    {
+        size_t new_cap = files->run_capacity[cat] ? files->run_capacity[cat] * 2 : 8;
+        SpillRun *tmp = realloc(files->runs[cat], new_cap * sizeof(SpillRun));
+        if (!tmp)
+            return -1;
+        files->runs[cat] = tmp;
+        files->run_capacity[cat] = new_cap;
+    }
+    files->runs[cat][files->run_count[cat]++] = run;
+    return 0;
+}
+
+// Make sure the reader holds at least need unconsumed bytes
+static int run_fill(RunReader *r, size_t need)
+{
+    if (r->len - r->start >= need)
+        return 0;
+    memmove(r->buf, r->buf + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+    while (r->len < need)
+    {
+        ssize_t n = pread(r->fd, r->buf + r->len, SPILL_BUFFER_SIZE - r->len, r->pos);
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        r->len += (size_t)n;
+        r->pos += n;
+    }
+    return 0;
+}
+
+// Read the next entry of a run. Returns 1, 0 at the end of the run or -1.
+static int run_next(RunReader *r)
+{
+    if (r->remaining == 0)
+        return 0;
+    if (run_fill(r, SPILL_RECORD_SIZE) == -1)
+        return -1;
+    int64_t size, mtime;
+    uint32_t path_len;
+    memcpy(&size, r->buf + r->start, 8);
+    memcpy(&mtime, r->buf + r->start + 8, 8);
+    memcpy(&path_len, r->buf + r->start + 16, 4);
+    if (path_len >= MAX_PATH_LENGTH)
+    {
+        errno = EIO;
+        return -1;
+    }
+    if (run_fill(r, SPILL_RECORD_SIZE + path_len + 1) == -1)
+        return -1;
+    r->entry = (FileEntry){r->buf + r->start + SPILL_RECORD_SIZE, (off_t)size, mtime};
+    r->start += SPILL_RECORD_SIZE + path_len + 1;
+    r->remaining--;
+    return 1;
+}
+
+// Current entry of a cursor source, reader_count stands for the memory list
+static const FileEntry *cursor_head(const FileCursor *c, size_t source)
+{
+    if (source == c->reader_count)
+        return &c->memory->items[c->memory_index];
+    return &c->readers[source].entry;
+}
+
+// Restore the heap order below position i
+static void cursor_sift_down(FileCursor *c, size_t i)
+{
+    for (;;)
+    {
+        size_t smallest = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < c->heap_size; child++)
+        {
+            if (strcmp(cursor_head(c, c->heap[child])->path, cursor_head(c, c->heap[smallest])->path) < 0)
+                smallest = child;
+        }
+        if (smallest == i)
+            return;
+        size_t tmp = c->heap[i];
+        c->heap[i] = c->heap[smallest];
+        c->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Start merging sorted runs of the spill file and an optional sorted list
+static int cursor_open_runs(FileCursor *c, int fd, const SpillRun *runs, size_t run_count, const FileList *memory)
+{
+    memset(c, 0, sizeof(*c));
+    c->memory = memory;
+    c->readers = calloc(run_count + 1, sizeof(RunReader));
+    c->heap = calloc(run_count + 1, sizeof(size_t));
+    if (!c->readers || !c->heap)
+        return -1;
+    for (size_t i = 0; i < run_count; i++)
+    {
+        RunReader *r = &c->readers[c->reader_count++];
+        r->buf = malloc(SPILL_BUFFER_SIZE);
+        if (!r->buf)
+            return -1;
+        r->fd = fd;
+        r->pos = runs[i].offset;
+        r->remaining = runs[i].count;
+        int result = run_next(r);
+        if (result == -1)
+            return -1;
+        if (result == 1)
+            c->heap[c->heap_size++] = i;
+    }
+    if (memory && memory->count > 0)
+        c->heap[c->heap_size++] = c->reader_count;
+    for (size_t i = c->heap_size / 2; i-- > 0;)
+        cursor_sift_down(c, i);
+    return 0;
+}
+
+// Start iterating a category of a sorted set
+static int cursor_open(FileCursor *c, const CcmFileSet *files, FileCategory cat)
+{
+    return cursor_open_runs(c, files->spill_fd, files->runs[cat], files->run_count[cat], &files->categories[cat]);
+}
+
+// Next file in path order, NULL at the end or on a read error. The entry
+// stays valid until the next call.
+static const FileEntry *cursor_next(FileCursor *c)
+{
+    // The source returned last is still on top, advance it
+    if (c->started && c->heap_size > 0)
+    {
+        size_t top = c->heap[0];
+        bool more;
+        if (top == c->reader_count)
+        {
+            more = ++c->memory_index < c->memory->count;
+        }
+        else
+        {
+            int result = run_next(&c->readers[top]);
+            if (result == -1)
+            {
+                c->failed = true;
+                return NULL;
+            }
+            more = result == 1;
+        }
+        if (!more)
+            c->heap[0] = c->heap[--c->heap_size];
+        cursor_sift_down(c, 0);
+    }
+    c->started = true;
+    return c->heap_size > 0 ? cursor_head(c, c->heap[0]) : NULL;
+}
+
+// Release the buffers of a cursor
+static void cursor_close(FileCursor *c)
+{
+    for (size_t i = 0; i < c->reader_count; i++)
+        free(c->readers[i].buf);
+    free(c->readers);
+    free(c->heap);
+}
+
+// Runs merged at once, so that their read buffers fit the memory limit
+static size_t spill_fan_in(const CcmFileSet *files)
+{
+    size_t fan_in = files->memory_limit / SPILL_BUFFER_SIZE;
+    return fan_in < 2 ? 2 : fan_in;
+}
+
+// Merge count runs of a category, starting at first, into one run that takes
+// their place
+static int merge_runs(CcmFileSet *files, FileCategory cat, size_t first, size_t count)
+{
+    SpillRun *runs = files->runs[cat] + first;
+    FileCursor c;
+    SpillWriter w;
+    int result = cursor_open_runs(&c, files->spill_fd, runs, count, NULL);
+    if (result == 0 && spill_begin(&w, files, runs[0].level + 1) == 0)
+    {
+        const FileEntry *e;
+        while (result == 0 && (e = cursor_next(&c)))
+            result = spill_write(&w, e);
+        if (c.failed)
+            result = -1;
+        result = spill_end(&w, result);
+    }
+    else
+    {
+        result = -1;
+    }
+    cursor_close(&c);
+    if (result == -1)
+        return -1;
+
+    // Give the blocks of the merged runs back, the file only ever grows
+    for (size_t i = 0; i < count; i++)
+        (void)fallocate(files->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, runs[i].offset, runs[i].length);
+    runs[0] = w.run;
+    memmove(runs + 1, runs + count, (files->run_count[cat] - first - count) * sizeof(SpillRun));
+    files->run_count[cat] -= count - 1;
+    return 0;
+}
+
+// Merge the newest runs of a category whenever fan-in many of them share a
+// level. A category then keeps fewer than fan-in runs per level, and every
+// entry is rewritten once per level.
+static int compact_runs(CcmFileSet *files, FileCategory cat)
+{
+    size_t fan_in = spill_fan_in(files);
+    // Levels only decrease from the oldest run to the newest
+    while (files->run_count[cat] >= fan_in)
+    {
+        const SpillRun *runs = files->runs[cat];
+        size_t first = files->run_count[cat] - fan_in;
+        if (runs[first].level != runs[files->run_count[cat] - 1].level)
+            break;
+        if (merge_runs(files, cat, first, fan_in) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// Append the in-memory entries of a set to its spill file as one sorted run
+// per category, and release them
+static int spill_files(CcmFileSet *files)
+{
+    if (spill_open(files) == -1)
+        return -1;
+    for (int cat = 0; cat < CAT_COUNT; cat++)
+    {
+        FileList *list = &files->categories[cat];
+        if (list->count == 0)
+            continue;
+        if (files->unsorted[cat])
+            sort_entries(list->items, list->count);
+        files->unsorted[cat] = false;
+        SpillWriter w;
+        if (spill_begin(&w, files, 0) == -1)
+            return -1;
+        int result = 0;
+        for (size_t i = 0; i < list->count && result == 0; i++)
+            result = spill_write(&w, &list->items[i]);
+        if (spill_end(&w, result) == -1 || add_run(files, (FileCategory)cat, w.run) == -1)
+            return -1;
+        files->spilled[cat] += list->count;
+        free_filelist(list);
+        if (compact_runs(files, (FileCategory)cat) == -1)
+            return -1;
+    }
+    files->path_bytes = 0;
+    return 0;
+}
+
+// Create a context
+CcmContext *ccm_new(void)
+{
+    CcmContext *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+    ctx->perf.leader = -1;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+        ctx->perf.fds[i] = -1;
+    ctx->trace_id = atomic_fetch_add(&trace_next_context, 1) + 1;
+    ctx->categories = (1u << CAT_COUNT) - 1;
+    return ctx;
+}
+
+// Release a context with its trace buffers and counters
+void ccm_free(CcmContext *ctx)
+{
+    if (!ctx)
+        return;
+    TraceBuffer *b = atomic_load(&ctx->trace_buffers);
+    while (b)
+    {
+        TraceBuffer *next = b->next;
+        if (b == trace_local)
+            trace_local = NULL;
+        free(b);
+        b = next;
+    }
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+    {
+        if (ctx->perf.fds[i] != -1)
+            close(ctx->perf.fds[i]);
+    }
+    for (size_t i = 0; i < ctx->exclude_count; i++)
+        free(ctx->excludes[i]);
+    free(ctx->excludes);
+    for (size_t i = 0; i < ctx->extension_count; i++)
+        free(ctx->extensions[i].suffix);
+    free(ctx->extensions);
+    free(ctx);
+}
+
+// Route error and warning messages to fn
+void ccm_set_error_handler(CcmContext *ctx, CcmErrorFn fn, void *user)
+{
+    ctx->error_fn = fn;
+    ctx->error_user = user;
+}
+
+// Last error message of the context
+const char *ccm_last_error(const CcmContext *ctx)
+{
+    return ctx->error;
+}
+
+// Report the progress of ccm_merge to fn
+void ccm_set_progress_handler(CcmContext *ctx, CcmProgressFn fn, void *user)
+{
+    ctx->progress_fn = fn;
+    ctx->progress_user = user;
+}
+
+// Category of a file name
+CcmCategory ccm_classify(const char *filename)
+{
+    return (CcmCategory)categorize_file(filename);
+}
+
+// Short name of a category
+const char *ccm_category_name(CcmCategory category)
+{
+    return (unsigned)category < CAT_COUNT ? CATEGORY_NAMES[category] : "?";
+}
+
+// Limit the scan to a set of categories
+void ccm_set_categories(CcmContext *ctx, uint32_t mask)
+{
+    ctx->categories = mask & ((1u << CAT_COUNT) - 1);
+}
+
+// Skip files and directories matching a glob
+int ccm_add_exclude(CcmContext *ctx, const char *glob)
+{
+    char **tmp = realloc(ctx->excludes, (ctx->exclude_count + 1) * sizeof(char *));
+    if (!tmp)
+        return -1;
+    ctx->excludes = tmp;
+    ctx->excludes[ctx->exclude_count] = strdup(glob);
+    if (!ctx->excludes[ctx->exclude_count])
+        return -1;
+    ctx->exclude_count++;
+    return 0;
+}
+
+// Merge files with a name suffix into a category
+int ccm_add_extension(CcmContext *ctx, const char *ext, CcmCategory category)
+{
+    if ((unsigned)category >= CAT_COUNT || *ext == '\0')
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    Extension *tmp = realloc(ctx->extensions, (ctx->extension_count + 1) * sizeof(Extension));
+    if (!tmp)
+        return -1;
+    ctx->extensions = tmp;
+    size_t len = strlen(ext) + 2;
+    char *suffix = malloc(len);
+    if (!suffix)
+        return -1;
+    snprintf(suffix, len, "%s%s", ext[0] == '.' ? "" : ".", ext);
+    ctx->extensions[ctx->extension_count++] = (Extension){suffix, (FileCategory)category};
+    return 0;
+}
+
+// Scan a directory tree and pass every accepted file to visit
+int ccm_scan(CcmContext *ctx, const char *root, CcmVisitFn visit, void *user)
+{
+    trace_register(ctx, "main");
+    PhaseStart phase = phase_begin(ctx);
+    int result = scan_directory(ctx, root, strlen(root), visit, user);
+    phase_end(ctx, PHASE_SCAN, phase);
+    return result;
+}
+
+// Create an empty file set
+CcmFileSet *ccm_files_new(void)
+{
+    CcmFileSet *files = calloc(1, sizeof(*files));
+    if (!files)
+        return NULL;
+    for (int i = 0; i < CAT_COUNT; i++)
+        init_filelist(&files->categories[i]);
+    files->spill_fd = -1;
+    return files;
+}
+
+// Spill sorted runs to temp_dir whenever the set outgrows limit bytes
+int ccm_files_set_memory_limit(CcmFileSet *files, size_t limit, const char *temp_dir)
+{
+    char *copy = strdup(temp_dir);
+    if (!copy)
+        return -1;
+    free(files->temp_dir);
+    files->temp_dir = copy;
+    files->memory_limit = limit < CCM_SORT_MEMORY_MIN ? CCM_SORT_MEMORY_MIN : limit;
+    return 0;
+}
+
+// Release a file set and its paths
+void ccm_files_free(CcmFileSet *files)
+{
+    if (!files)
+        return;
+    for (int i = 0; i < CAT_COUNT; i++)
+        free_filelist(&files->categories[i]);
+    if (files->spill_fd != -1)
+        close(files->spill_fd);
+    for (int i = 0; i < CAT_COUNT; i++)
+        free(files->runs[i]);
+    free(files->temp_dir);
+    free(files);
+}
+
+// Add a copy of an entry to its category
+int ccm_files_add(CcmFileSet *files, const CcmEntry *entry)
+{
+    if ((unsigned)entry->category >= CAT_COUNT)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    FileList *list = &files->categories[entry->category];
+    // A sorted scan adds most files in order, their categories need no sort
+    if (!files->unsorted[entry->category] && list->count > 0 &&
+        strcmp(list->items[list->count - 1].path, entry->path) > 0)
+        files->unsorted[entry->category] = true;
+    if (add_to_filelist(list, entry->path, (off_t)entry->size, entry_mtime_ns(entry)) == -1)
+        return -1;
+    files->path_bytes += strlen(entry->path) + 1;
+    if (files->memory_limit && ccm_files_memory(files) > files->memory_limit)
+        return spill_files(files);
+    return 0;
+}
+
+// Number of files in a category, or in all of them
+size_t ccm_files_count(const CcmFileSet *files, CcmCategory category)
+{
+    if ((unsigned)category < CAT_COUNT)
+        return files->categories[category].count + files->spilled[category];
+    size_t total = 0;
+    for (int i = 0; i < CAT_COUNT; i++)
+        total += files->categories[i].count + files->spilled[i];
+    return total;
+}
+
+// File number index of a category
+CcmEntry ccm_files_get(const CcmFileSet *files, CcmCategory category, size_t index)
+{
+    const FileEntry *e = &files->categories[category].items[index];
+    return public_entry(e, (FileCategory)category);
+}
+
+// Whether a set has spilled runs to disk
+bool ccm_files_spilled(const CcmFileSet *files)
+{
+    return files->spill_fd != -1;
+}
+
+// Visit every file of a sorted set in merge order
+int ccm_files_foreach(CcmContext *ctx, const CcmFileSet *files, CcmVisitFn visit, void *user)
+{
+    int result = 0;
+    for (int cat = 0; cat < CAT_COUNT && result == 0; cat++)
+    {
+        FileCursor cursor;
+        if (cursor_open(&cursor, files, (FileCategory)cat) == -1)
+            cursor.failed = true;
+        const FileEntry *e;
+        while (!cursor.failed && result == 0 && (e = cursor_next(&cursor)))
+        {
+            CcmEntry entry = public_entry(e, (FileCategory)cat);
+            result = visit(&entry, user);
+        }
+        if (cursor.failed)
+        {
+            ccm_error(ctx, "Error reading sorted runs: %s", strerror(errno));
+            result = -1;
+        }
+        cursor_close(&cursor);
+    }
+    return result;
+}
+
+// Heap memory held by a set
+size_t ccm_files_memory(const CcmFileSet *files)
+{
+    size_t bytes = sizeof(*files) + files->path_bytes;
+    for (int i = 0; i < CAT_COUNT; i++)
+        bytes += files->categories[i].capacity * sizeof(FileEntry);
+    return bytes;
+}
+
+// Sort every category by path, and merge spilled runs in passes until the
+// cursor merges at most fan-in of them
+int ccm_files_sort(CcmContext *ctx, CcmFileSet *files)
+{
+    PhaseStart phase = phase_begin(ctx);
+    size_t fan_in = spill_fan_in(files);
+    int result = 0;
+    for (int i = 0; i < CAT_COUNT && result == 0; i++)
+    {
+        if (files->unsorted[i])
+            sort_entries(files->categories[i].items, files->categories[i].count);
+        files->unsorted[i] = false;
+        // The newest runs are the smallest
+        while (result == 0 && files->run_count[i] > fan_in)
+            result = merge_runs(files, (FileCategory)i, files->run_count[i] - fan_in, fan_in);
+    }
+    if (result == -1)
+        ccm_error(ctx, "Error merging sorted runs: %s", strerror(errno));
+    phase_end(ctx, PHASE_SORT, phase);
+    return result;
+}
+
+// Scan visitor of ccm_scan_files
+static int add_entry(const CcmEntry *entry, void *user)
+{
+    return ccm_files_add(user, entry);
+}
+
+// Scan a tree into a set and sort it
+int ccm_scan_files(CcmContext *ctx, const char *root, CcmFileSet *files)
+{
+    int result = ccm_scan(ctx, root, add_entry, files);
+    if (result == -1 && errno == ENOMEM)
+        ccm_error(ctx, "Memory allocation error");
+    if (result != 0)
+        return -1;
+    return ccm_files_sort(ctx, files);
+}
+
+// Check options and sink before a merge
+int ccm_check_options(CcmContext *ctx, const CcmOptions *opts, const CcmSink *sink)
+{
+    if (opts->format != CCM_FORMAT_TEXT && (opts->toc || opts->dedup_license))
+    {
+        ccm_error(ctx, "The table of contents and license deduplication are only supported by the text format");
+        return -1;
+    }
+    if ((opts->format == CCM_FORMAT_JSONL || opts->format == CCM_FORMAT_JSON || opts->format == CCM_FORMAT_XML) &&
+        opts->binary_mode == CCM_BINARY_COPY)
+    {
+        ccm_error(ctx, "Copying binary files would produce invalid %s output",
+                  opts->format == CCM_FORMAT_XML ? "XML" : "JSON");
+        return -1;
+    }
+    if (opts->compress != CCM_COMPRESS_NONE && !ccm_compress_available(opts->compress))
+    {
+        ccm_error(ctx, "%s compression is not available in this build",
+                  opts->compress == CCM_COMPRESS_ZSTD ? "zstd" : "gzip");
+        return -1;
+    }
+    if (opts->compress_level < 0 || opts->compress_level > (opts->compress == CCM_COMPRESS_ZSTD ? 22 : 9))
+    {
+        ccm_error(ctx, "Invalid compression level: %d", opts->compress_level);
+        return -1;
+    }
+    if (opts->max_file_size < 0 || opts->jobs < 0)
+    {
+        ccm_error(ctx, "Invalid file size or number of jobs");
+        return -1;
+    }
+    if ((opts->head_lines || opts->tail_lines) && !opts->max_file_size)
+    {
+        ccm_error(ctx, "Head and tail lines require a maximum file size");
+        return -1;
+    }
+    if (sink->type == CCM_SINK_FILE && !sink->path)
+    {
+        ccm_error(ctx, "File sink without a path");
+        return -1;
+    }
+    if (sink->type == CCM_SINK_CALLBACK && !sink->write)
+    {
+        ccm_error(ctx, "Callback sink without a write function");
+        return -1;
+    }
+    if (sink->incremental && (sink->type != CCM_SINK_FILE || opts->format != CCM_FORMAT_TEXT || opts->toc ||
+                              opts->compress != CCM_COMPRESS_NONE))
+    {
+        ccm_error(ctx, "Incremental merging needs an uncompressed text output file without a table of contents");
+        return -1;
+    }
+    return 0;
+}
+
+// Memory sink, collects the output of a CCM_SINK_BUFFER merge
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+} BufferSink;
+
+// Append output to a BufferSink
+static int buffer_sink_write(const void *data, size_t len, void *user)
+{
+    BufferSink *b = user;
+    if (len > b->capacity - b->size)
+    {
+        size_t new_cap = b->capacity ? b->capacity : OUTPUT_BUFFER_SIZE;
+        while (new_cap - b->size < len)
+            new_cap *= 2;
+        char *tmp = realloc(b->data, new_cap);
+        if (!tmp)
+            return -1;
+        b->data = tmp;
+        b->capacity = new_cap;
+    }
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+    return 0;
+}
+
+// One merge from opening its output to closing it. The writer points into
+// the struct, so it must stay where merge_open put it.
+typedef struct
+{
+    CcmContext *ctx;
+    CcmSink *sink;
+    const char *output_name;
+    MergeOptions opts;
+    CompressAlgo compress;
+    LicenseBlock license;
+    char index_path[MAX_PATH_LENGTH + sizeof(INDEX_SUFFIX)];
+    uint32_t fingerprint;
+    int64_t started_ns;    // Coarse real time before the first file was read
+    MergeIndex old_index;
+    IndexRecord *records;  // Sections written, for the incremental index
+    bool patching;         // The old output is updated in place
+    bool tail;             // A section changed its length, everything from here on is rewritten
+    Output output;
+    BufferSink buffer;
+    Compressor compressor;
+    Writer writer;
+    size_t processed;
+    size_t total_files;
+    double write_start;
+    PhaseStart phase;
+    CcmMergeResult res;
+} MergeRun;
+
+// Open the output of a merge and write everything before the first file
+static int merge_open(MergeRun *run, CcmContext *ctx, const CcmFileSet *files, const CcmOptions *options,
+                      CcmSink *sink)
+{
+    memset(run, 0, sizeof(*run));
+    run->ctx = ctx;
+    run->sink = sink;
+    // The clock file systems stamp with, so no edit after this is stamped earlier
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    run->started_ns = (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+    const FileList *categories = files->categories;
+    run->total_files = ccm_files_count(files, CCM_CAT_COUNT);
+    run->opts = (MergeOptions){options->strip_comments, options->compact, options->dedup_license,
+                               options->validate_utf8, (BinaryMode)options->binary_mode,
+                               (off_t)options->max_file_size, options->head_lines, options->tail_lines,
+                               (OutputFormat)options->format, options->toc};
+    const MergeOptions *opts = &run->opts;
+    run->compress = (CompressAlgo)options->compress;
+    int compress_level = options->compress_level ? options->compress_level
+                                                 : run->compress == COMPRESS_ZSTD ? 3 : 6;
+    long jobs = options->jobs ? options->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1)
+        jobs = 1;
+    run->output_name = sink->type == CCM_SINK_FILE ? sink->path : "output";
+    run->res.files = run->total_files;
+    // These need random access to all entries, a spilled set only streams them
+    if (ccm_files_spilled(files) && (opts->toc || opts->dedup_license || opts->format == FORMAT_ARCHIVE || sink->incremental))
+    {
+        ccm_error(ctx, "The file list was spilled to disk, which rules out the table of contents, license "
+                       "deduplication, the archive format and incremental merging");
+        return -1;
+    }
+
+    run->phase = phase_begin(ctx);
+
+    // Stripped comments leave nothing to deduplicate
+    if (opts->dedup_license && !opts->strip_comments && find_common_license(ctx, categories, &run->license) == -1)
+        return -1;
+
+    // An incremental run patches the output in place if the index of the last
+    // run still describes it, and otherwise writes it from scratch
+    if (sink->incremental)
+    {
+        snprintf(run->index_path, sizeof(run->index_path), "%s" INDEX_SUFFIX, sink->path);
+        run->fingerprint = options_fingerprint(opts, &run->license);
+        run->records = malloc((run->total_files ? run->total_files : 1) * sizeof(IndexRecord));
+        if (!run->records)
+        {
+            ccm_error(ctx, "Memory allocation error");
+            free(run->license.text);
+            return -1;
+        }
+        run->patching = load_index(&run->old_index, run->index_path, sink->path, run->fingerprint) == 0;
+        // The old index stops matching as soon as the first byte is patched
+        if (run->patching)
+            unlink(run->index_path);
+    }
+
+    int open_result;
+    switch (sink->type)
+    {
+    case CCM_SINK_FD:
+        open_result = output_open_fd(&run->output, ctx, sink->fd);
+        break;
+    case CCM_SINK_BUFFER:
+        open_result = output_open_sink(&run->output, ctx, buffer_sink_write, &run->buffer);
+        break;
+    case CCM_SINK_CALLBACK:
+        open_result = output_open_sink(&run->output, ctx, sink->write, sink->user);
+        break;
+    default:
+        open_result = run->patching
+                          ? output_open_in_place(&run->output, ctx, sink->path, (FsyncMode)sink->fsync)
+                          : output_open(&run->output, ctx, sink->path, (FsyncMode)sink->fsync);
+        break;
+    }
+    if (open_result == -1)
+    {
+        ccm_error(ctx, "Error creating output %s: %s", run->output_name, strerror(errno));
+        free_index(&run->old_index);
+        free(run->records);
+        free(run->license.text);
+        return -1;
+    }
+
+    if (run->compress != COMPRESS_NONE)
+    {
+        if (compressor_start(&run->compressor, ctx, run->compress, compress_level, (int)jobs) == -1)
+        {
+            ccm_error(ctx, "Error starting compression: %s", strerror(errno));
+            output_abort(&run->output);
+            free(run->buffer.data);
+            free_index(&run->old_index);
+            free(run->records);
+            free(run->license.text);
+            return -1;
+        }
+        run->output.compressor = &run->compressor;
+    }
+    run->write_start = now_seconds();
+
+    if (writer_start(&run->writer, &run->output, opts, &run->license, categories) == -1)
+    {
+        output_abort(&run->output);
+        free(run->buffer.data);
+        free_index(&run->old_index);
+        free(run->records);
+        free(run->license.text);
+        return -1;
+    }
+    return 0;
+}
+
+// Write the section of the next file, or keep it from the old output
+static int merge_entry(MergeRun *run, const FileEntry *entry, FileCategory cat)
+{
+    size_t n = run->processed;
+    int step = run->patching ? incremental_seek(&run->writer, &run->old_index, n, entry, cat, &run->tail) : 0;
+    if (step == 1)
+    {
+        run->records[n] = run->old_index.records[n];
+        run->records[n].path = entry->path;
+    }
+    else if (step == 0)
+    {
+        off_t start = run->output.offset;
+        uint64_t trace_start = trace_begin(run->ctx);
+        step = write_file(&run->writer, entry, cat);
+        trace_end(run->ctx, "file", "merge", "path", entry->path, trace_start);
+        if (step == 1)
+            run->res.omitted++;
+        run->res.rewritten++;
+        if (run->records)
+            run->records[n] = (IndexRecord){entry->path, cat, entry->size, entry->mtime_ns, start,
+                                            run->output.offset - start};
+        // A section that changed its length moves everything behind it
+        if (run->patching && !run->tail && run->records[n].length != run->old_index.records[n].length)
+            run->tail = true;
+    }
+    if (step == -1)
+        return -1;
+    run->processed++;
+    if (run->ctx->progress_fn)
+        run->ctx->progress_fn(run->processed, run->total_files, run->ctx->progress_user);
+    return 0;
+}
+
+// Write the files of categories [first, last) of a sorted set
+static int merge_categories(MergeRun *run, const CcmFileSet *files, int first, int last)
+{
+    for (int cat = first; cat < last; cat++)
+    {
+        FileCursor cursor;
+        if (cursor_open(&cursor, files, (FileCategory)cat) == -1)
+            cursor.failed = true;
+        const FileEntry *entry;
+        while (!cursor.failed && (entry = cursor_next(&cursor)))
+        {
+            if (merge_entry(run, entry, (FileCategory)cat) == -1)
+            {
+                cursor_close(&cursor);
+                return -1;
+            }
+        }
+        if (cursor.failed)
+        {
+            ccm_error(run->ctx, "Error reading sorted runs: %s", strerror(errno));
+            cursor_close(&cursor);
+            return -1;
+        }
+        cursor_close(&cursor);
+    }
+    return 0;
+}
+
+// Drop a merge that failed, leaving a file sink untouched
+static void merge_abort(MergeRun *run)
+{
+    writer_finish(&run->writer);
+    output_abort(&run->output);
+    free(run->buffer.data);
+    free_index(&run->old_index);
+    free(run->records);
+    free(run->license.text);
+}
+
+// Finish the output of a merge and publish it
+static int merge_close(MergeRun *run, CcmMergeResult *result)
+{
+    CcmContext *ctx = run->ctx;
+    CcmSink *sink = run->sink;
+    int close_result = writer_finish(&run->writer);
+    if (run->patching)
+    {
+        // Cut off what is left of removed files or a longer old tail
+        off_t end = run->output.offset;
+        if (!run->tail)
+            end = run->total_files < run->old_index.count ? run->old_index.records[run->total_files].start
+                                                           : run->old_index.output_size;
+        if (output_flush(&run->output) == -1 || ftruncate(run->output.fd, end) == -1)
+            close_result = -1;
+    }
+    if (output_close(&run->output) == -1)
+        close_result = -1;
+    phase_end(ctx, PHASE_WRITE, run->phase);
+    if (close_result == -1)
+        ccm_error(ctx, "Write error for %s: %s", run->output_name, strerror(errno));
+    else if (sink->incremental &&
+             save_index(ctx, run->index_path, sink->path, run->records, run->total_files, run->fingerprint,
+                        run->started_ns) == -1)
+        ccm_error(ctx, "Warning: could not save %s: %s", run->index_path, strerror(errno));
+    free_index(&run->old_index);
+    free(run->records);
+    free(run->license.text);
+
+    if (close_result == -1)
+    {
+        free(run->buffer.data);
+        return -1;
+    }
+    if (sink->type == CCM_SINK_BUFFER)
+    {
+        sink->data = run->buffer.data;
+        sink->size = run->buffer.size;
+    }
+    run->res.files = run->total_files;
+    run->res.patched = run->patching;
+    if (run->compress != COMPRESS_NONE)
+    {
+        run->res.compressed_in = run->compressor.bytes_in;
+        run->res.compressed_out = run->compressor.bytes_out;
+        run->res.compress_threads = run->compressor.thread_count;
+        run->res.compress_busy = run->compressor.busy_seconds;
+        run->res.compress_wall = now_seconds() - run->write_start;
+    }
+    if (result)
+        *result = run->res;
+    return 0;
+}
+
+// Merge a sorted set into a sink
+int ccm_merge(CcmContext *ctx, const CcmFileSet *files, const CcmOptions *options, CcmSink *sink,
+              CcmMergeResult *result)
+{
+    if (ccm_check_options(ctx, options, sink) == -1)
+        return -1;
+    trace_register(ctx, "main");
+    MergeRun run;
+    if (merge_open(&run, ctx, files, options, sink) == -1)
+        return -1;
+    if (merge_categories(&run, files, 0, CAT_COUNT) == -1)
+    {
+        merge_abort(&run);
+        return -1;
+    }
+    return merge_close(&run, result);
+}
+
+// State of ccm_merge_stream while the scan runs
+typedef struct
+{
+    MergeRun *run;
+    CcmFileSet *files;
+    FileCategory cat;              // Category written during the scan
+    bool restart;                  // The order broke, the output is written again from the set
+    FileList pending;              // Linked files of cat not written yet, sorted from pending_start on
+    size_t pending_start;
+    char last[MAX_PATH_LENGTH];    // Path written last
+} StreamState;
+
+// Write a file during the scan
+static int stream_write(StreamState *st, const FileEntry *entry)
+{
+    if (merge_entry(st->run, entry, st->cat) == -1)
+        return -1;
+    snprintf(st->last, sizeof(st->last), "%s", entry->path);
+    return 0;
+}
+
+// Write the pending linked files up to path, all of them for NULL
+static int stream_flush(StreamState *st, const char *path)
+{
+    FileList *pending = &st->pending;
+    while (st->pending_start < pending->count &&
+           (!path || strcmp(pending->items[st->pending_start].path, path) <= 0))
+    {
+        FileEntry *entry = &pending->items[st->pending_start++];
+        int result = stream_write(st, entry);
+        free(entry->path);
+        if (result == -1)
+            return -1;
+    }
+    if (st->pending_start == pending->count)
+        st->pending_start = pending->count = 0;
+    return 0;
+}
+
+// Scan visitor of ccm_merge_stream. Files that are not symbolic links arrive
+// in path order and are written at once. A link resolves to a path anywhere,
+// so it waits until the scan passes that path.
+static int stream_visit(const CcmEntry *entry, void *user)
+{
+    StreamState *st = user;
+    CcmContext *ctx = st->run->ctx;
+    bool linked = ctx->entry_linked;
+    if (ccm_files_add(st->files, entry) == -1)
+    {
+        ccm_error(ctx, "Error adding %s: %s", entry->path, strerror(errno));
+        return -1;
+    }
+    st->run->total_files++;
+    if ((FileCategory)entry->category != st->cat || st->restart)
+        return 0;
+
+    if (st->last[0] && strcmp(entry->path, st->last) < 0)
+    {
+        // A link into a part of the tree that was written already, or
+        // overlapping roots. Only sinks that can be discarded recover.
+        CcmSinkType type = st->run->sink->type;
+        if (type != CCM_SINK_FILE && type != CCM_SINK_BUFFER)
+        {
+            ccm_error(ctx, "%s sorts before files already written to the %s, merge without streaming", entry->path,
+                      st->run->output_name);
+            return -1;
+        }
+        st->restart = true;
+        merge_abort(st->run);
+        return 0;
+    }
+
+    FileEntry file = {(char *)entry->path, (off_t)entry->size, entry_mtime_ns(entry)};
+    if (linked)
+    {
+        FileList *pending = &st->pending;
+        if (add_to_filelist(pending, file.path, file.size, file.mtime_ns) == -1)
+        {
+            ccm_error(ctx, "Memory allocation error");
+            return -1;
+        }
+        for (size_t i = pending->count - 1;
+             i > st->pending_start && strcmp(pending->items[i - 1].path, pending->items[i].path) > 0; i--)
+        {
+            FileEntry tmp = pending->items[i];
+            pending->items[i] = pending->items[i - 1];
+            pending->items[i - 1] = tmp;
+        }
+        return 0;
+    }
+    if (stream_flush(st, file.path) == -1 || stream_write(st, &file) == -1)
+        return -1;
+    return 0;
+}
+
+// Root directory of ccm_merge_stream
+typedef struct
+{
+    const char *path;
+    DirName real;  // Resolved path, sorting as a directory
+} StreamRoot;
+
+// Order roots by their resolved paths
+static int compare_stream_roots(const void *a, const void *b)
+{
+    return compare_dir_names(&((const StreamRoot *)a)->real, &((const StreamRoot *)b)->real);
+}
+
+// Scan roots and merge them, writing the first category during the scan
+int ccm_merge_stream(CcmContext *ctx, const char *const *roots, int root_count, CcmFileSet *files,
+                     const CcmOptions *options, CcmSink *sink, CcmMergeResult *result)
+{
+    if (ccm_check_options(ctx, options, sink) == -1)
+        return -1;
+    if (options->toc || options->dedup_license || options->format == CCM_FORMAT_ARCHIVE || sink->incremental)
+    {
+        ccm_error(ctx, "Streaming writes files before the scan ends, which rules out the table of contents, "
+                       "license deduplication, the archive format and incremental merging");
+        return -1;
+    }
+    if (ccm_files_count(files, CCM_CAT_COUNT) > 0)
+    {
+        ccm_error(ctx, "Streaming needs an empty file set");
+        return -1;
+    }
+    trace_register(ctx, "main");
+
+    // The roots are walked in the order of their resolved paths
+    StreamRoot *order = calloc(root_count > 0 ? (size_t)root_count : 1, sizeof(StreamRoot));
+    if (!order)
+    {
+        ccm_error(ctx, "Memory allocation error");
+        return -1;
+    }
+    int result_code = -1;
+    int resolved = 0;
+    for (; resolved < root_count; resolved++)
+    {
+        order[resolved].path = roots[resolved];
+        order[resolved].real = (DirName){realpath(roots[resolved], NULL), true};
+        if (!order[resolved].real.name)
+        {
+            ccm_error(ctx, "Error opening %s: %s", roots[resolved], strerror(errno));
+            goto free_roots;
+        }
+    }
+    qsort(order, (size_t)root_count, sizeof(StreamRoot), compare_stream_roots);
+
+    MergeRun run;
+    StreamState st = {0};
+    st.run = &run;
+    st.files = files;
+    st.cat = CAT_COUNT;
+    for (int cat = 0; cat < CAT_COUNT && st.cat == CAT_COUNT; cat++)
+    {
+        if (ctx->categories & (1u << cat))
+            st.cat = (FileCategory)cat;
+    }
+    init_filelist(&st.pending);
+    if (merge_open(&run, ctx, files, options, sink) == -1)
+        goto free_roots;
+
+    ctx->sorted_scan = true;
+    PhaseStart phase = phase_begin(ctx);
+    int scan_result = 0;
+    for (int i = 0; i < root_count && scan_result == 0; i++)
+        scan_result = scan_directory(ctx, order[i].path, strlen(order[i].path), stream_visit, &st);
+    if (scan_result == 0 && !st.restart)
+        scan_result = stream_flush(&st, NULL);
+    phase_end(ctx, PHASE_SCAN, phase);
+    ctx->sorted_scan = false;
+    for (size_t i = st.pending_start; i < st.pending.count; i++)
+        free(st.pending.items[i].path);
+    free(st.pending.items);
+
+    if (scan_result != 0)
+    {
+        if (!st.restart)
+            merge_abort(&run);
+        goto free_roots;
+    }
+    if (ccm_files_sort(ctx, files) == -1)
+    {
+        if (!st.restart)
+            merge_abort(&run);
+        goto free_roots;
+    }
+    if (st.restart)
+    {
+        result_code = ccm_merge(ctx, files, options, sink, result);
+        goto free_roots;
+    }
+    // The write phase starts where the scan ended
+    run.phase = phase_begin(ctx);
+    if (merge_categories(&run, files, st.cat + 1, CAT_COUNT) == -1)
+    {
+        merge_abort(&run);
+        goto free_roots;
+    }
+    result_code = merge_close(&run, result);
+
+free_roots:
+    for (int i = 0; i < resolved; i++)
+        free(order[i].real.name);
+    free(order);
+    return result_code;
+}
+
+// Record trace spans from now on
+void ccm_enable_trace(CcmContext *ctx)
+{
+    if (ctx->trace_enabled)
+        return;
+    ctx->trace_enabled = true;
+    ctx->trace_origin = trace_clock();
+}
+
+// Start counting hardware events of the calling thread
+void ccm_enable_perf_counters(CcmContext *ctx)
+{
+    if (!ctx->perf.enabled)
+        perf_start(ctx);
+}
+
+// Copy the counters accumulated so far
+void ccm_get_stats(const CcmContext *ctx, CcmStats *stats)
+{
+    const RunStats *st = &ctx->stats;
+    memset(stats, 0, sizeof(*stats));
+    memcpy(stats->wall, st->wall, sizeof(stats->wall));
+    memcpy(stats->cpu, st->cpu, sizeof(stats->cpu));
+    stats->directories = st->directories;
+    stats->entries = st->entries;
+    stats->stats = st->stats;
+    stats->opens = st->opens;
+    stats->bytes_read = st->bytes_read;
+    stats->bytes_written = st->bytes_written;
+    stats->reads = st->reads;
+    stats->writes = st->writes;
+    memcpy(stats->perf, st->perf, sizeof(stats->perf));
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+        stats->perf_available[i] = ctx->perf.enabled && ctx->perf.fds[i] != -1;
+}
@@ -0,0 +1,369 @@
+#!/bin/sh
+# Regression tests: merge small generated trees and compare the file bodies
+# with the expected output.
+#
+# Usage: tests/run.sh [CCODEMERGE]
+
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+ccodemerge=${1:-$here/../ccodemerge}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+count=0
+
+# Print the body of every file section of a text merge read from stdin
+bodies() {
+    awk '/^File: / { body = 1; skip = 1; n = 0; next }
+         body && /^-+ End of / { for (i = 1; i < n; i++) print line[i]; body = 0; next }
+         body { if (skip) { skip = 0; next } line[++n] = $0 }'
+}
+
+# Print SIZE bytes of declarations and padding, without comments or quotes
+filler() {
+    awk -v size="$1" 'BEGIN { n = int(size / 15); for (i = 0; i < n; i++) printf "int a%08d;\n", i
+                              for (i = n * 15; i < size; i++) printf " " }'
+}
+
+# check NAME OPTIONS: merge $work/NAME with OPTIONS and compare with $work/NAME.expected
+check() {
+    count=$((count + 1))
+    if (cd "$work/$1" && "$ccodemerge" $2 -o - . 2>/dev/null) | bodies >"$work/$1.actual" &&
+        cmp -s "$work/$1.expected" "$work/$1.actual"; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        diff "$work/$1.expected" "$work/$1.actual" | head -n 20 || true
+        failed=$((failed + 1))
+    fi
+}
+
+# skip NAME TOOL: count NAME as skipped if TOOL is missing, return 1 then
+skip() {
+    if command -v "$2" >/dev/null 2>&1; then
+        return 1
+    fi
+    echo "skip  $1 ($2 not found)"
+    return 0
+}
+
+# assert NAME COMMAND...: run COMMAND and count NAME as passed if it succeeds
+assert() {
+    name=$1
+    shift
+    count=$((count + 1))
+    if "$@" >"$work/$name.log" 2>&1; then
+        echo "ok    $name"
+    else
+        echo "FAIL  $name"
+        head -n 20 "$work/$name.log"
+        failed=$((failed + 1))
+    fi
+}
+
+# A comment-only line after a backslash continuation must stay as an empty
+# line, or the next line would join the macro
+mkdir "$work/continued-comment"
+printf '#define X 1 \\\n  // cont\nint y;\n' >"$work/continued-comment/a.c"
+printf '#define X 1 \\\n\nint y;\n' >"$work/continued-comment.expected"
+check continued-comment -s
+
+# The same for a blank line with --compact
+mkdir "$work/continued-blank"
+printf '#define X 1 \\\n\nint y;\n\nint z;\n' >"$work/continued-blank/a.c"
+printf '#define X 1 \\\n\nint y;\nint z;\n' >"$work/continued-blank.expected"
+check continued-blank -c
+
+# u8'x' split after "u8" by the 64 KiB chunk boundary is a character
+# literal, not a digit separator
+mkdir "$work/chunk-char-prefix"
+filler 65534 >"$work/chunk-char-prefix/a.c"
+cp "$work/chunk-char-prefix/a.c" "$work/chunk-char-prefix.expected"
+printf "u8'x'; // '\nint b;\n" >>"$work/chunk-char-prefix/a.c"
+printf "u8'x';\nint b;\n" >>"$work/chunk-char-prefix.expected"
+check chunk-char-prefix -s
+
+# A digit separator split the same way
+mkdir "$work/chunk-digit-separator"
+filler 65535 >"$work/chunk-digit-separator/a.c"
+cp "$work/chunk-digit-separator/a.c" "$work/chunk-digit-separator.expected"
+printf "1'000; // '\nint b;\n" >>"$work/chunk-digit-separator/a.c"
+printf "1'000;\nint b;\n" >>"$work/chunk-digit-separator.expected"
+check chunk-digit-separator -s
+
+# The most common leading comment is written once and dropped from the files
+# that start with exactly that comment. A comment that differs only in its
+# last line, or continues past it, stays in place.
+mkdir "$work/dedup-license"
+license='/* Copyright Example\n * Licensed MIT\n */\n'
+printf "$license#include \"a.h\"\nint a;\n" >"$work/dedup-license/a.c"
+printf "${license}int b;\n" >"$work/dedup-license/b.c"
+printf '/* Copyright Example\n * Licensed MIT, mostly\n */\nint c;\n' >"$work/dedup-license/c.c"
+printf '/* Copyright Example\n * Licensed MIT\n * and more\n */\nint d;\n' >"$work/dedup-license/d.c"
+{
+    printf '#include "a.h"\nint a;\nint b;\n'
+    cat "$work/dedup-license/c.c" "$work/dedup-license/d.c"
+} >"$work/dedup-license.expected"
+check dedup-license -d
+
+# The shared comment appears once, in the header
+dedup_header() {
+    (cd "$work/dedup-license" && "$ccodemerge" -d -o - .) >"$work/dedup-header.out" &&
+        awk '/^File: / { exit } { print }' "$work/dedup-header.out" >"$work/dedup-header.head" &&
+        grep -q '^# Leading comment shared by 2 files' "$work/dedup-header.head" &&
+        [ "$(grep -c '^ \* Licensed MIT$' "$work/dedup-header.head")" -eq 1 ]
+}
+assert dedup-header dedup_header
+
+# NUL bytes mark a file as binary, bytes that are not UTF-8 as non-text. Both
+# are summarized by default, left out with skip and copied with copy.
+mkdir "$work/binary"
+printf 'int a;\n' >"$work/binary/a.c"
+printf 'x\000y\n' >"$work/binary/b.c"
+printf 'caf\351\n' >"$work/binary/c.c"
+printf 'int a;\n[Binary file omitted: 4 bytes]\n[Non-UTF-8 file omitted: 5 bytes]\n' >"$work/binary-summary.expected"
+mkdir "$work/binary-summary" "$work/binary-skip" "$work/binary-copy"
+cp "$work"/binary/*.c "$work/binary-summary"
+cp "$work"/binary/*.c "$work/binary-skip"
+cp "$work"/binary/*.c "$work/binary-copy"
+check binary-summary "-b summary"
+printf 'int a;\n' >"$work/binary-skip.expected"
+check binary-skip "-b skip"
+cat "$work"/binary/a.c "$work"/binary/b.c "$work"/binary/c.c >"$work/binary-copy.expected"
+check binary-copy "-b copy"
+
+# Only the first chunk is sniffed, unless -u validates the whole file
+mkdir "$work/utf8-late" "$work/utf8-validate"
+filler 70000 >"$work/utf8-late/a.c"
+printf 'caf\351\n' >>"$work/utf8-late/a.c"
+cp "$work/utf8-late/a.c" "$work/utf8-late.expected"
+cp "$work/utf8-late/a.c" "$work/utf8-validate"
+check utf8-late ""
+printf '[Non-UTF-8 file omitted: 70005 bytes]\n' >"$work/utf8-validate.expected"
+check utf8-validate -u
+
+# Files over --max-file-size are cut at a line end and marked, smaller files
+# are left alone
+mkdir "$work/max-size" "$work/head-tail"
+seq 1 100 | sed 's/.*/int v&;/' >"$work/max-size/big.c"
+printf 'int small;\n' >"$work/max-size/small.c"
+cp "$work"/max-size/*.c "$work/head-tail"
+{
+    seq 1 12 | sed 's/.*/int v&;/'
+    printf '\n[... truncated: 793 of 892 bytes omitted ...]\nint small;\n'
+} >"$work/max-size.expected"
+check max-size "-m 100"
+
+# With head and tail lines, the middle is left out instead
+{
+    printf 'int v1;\nint v2;\n\n[... 848 bytes omitted ...]\n\n'
+    seq 98 100 | sed 's/.*/int v&;/'
+    printf 'int small;\n'
+} >"$work/head-tail.expected"
+check head-tail "-m 100 -H 2 -T 3"
+
+# patch FILE OFFSET BYTES: overwrite the file at OFFSET with the printf escapes in BYTES
+patch() {
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# An archive lists every file and gives back each body unchanged
+mkdir "$work/archive"
+printf 'int a;\n' >"$work/archive/a.c"
+printf '#pragma once\nint b(void);\n' >"$work/archive/b.h"
+(cd "$work/archive" && "$ccodemerge" -f archive -o "$work/archive.cma" . >/dev/null 2>&1)
+archive_roundtrip() {
+    "$ccodemerge" list "$work/archive.cma" >"$work/archive.list" &&
+        [ "$(wc -l <"$work/archive.list")" -eq 2 ] &&
+        grep -q "$work/archive/a.c\$" "$work/archive.list" &&
+        "$ccodemerge" extract "$work/archive.cma" "$work/archive/a.c" >"$work/archive.a" &&
+        "$ccodemerge" extract "$work/archive.cma" "$work/archive/b.h" >"$work/archive.b" &&
+        cmp "$work/archive/a.c" "$work/archive.a" && cmp "$work/archive/b.h" "$work/archive.b"
+}
+assert archive-roundtrip archive_roundtrip
+
+# A changed body is reported as a checksum mismatch. Headers come first, so
+# the data starts with b.h.
+archive_checksum() {
+    cp "$work/archive.cma" "$work/checksum.cma" &&
+        data=$(od -An -tu8 -j40 -N8 "$work/checksum.cma" | tr -d ' ') &&
+        patch "$work/checksum.cma" "$data" 'X' &&
+        ! "$ccodemerge" extract "$work/checksum.cma" "$work/archive/b.h" >/dev/null 2>"$work/checksum.err" &&
+        grep -q 'checksum mismatch' "$work/checksum.err"
+}
+assert archive-checksum archive_checksum
+
+# Offsets and lengths that wrap around 2^64 are rejected, not followed
+archive_corrupt_header() {
+    cp "$work/archive.cma" "$work/header.cma" &&
+        patch "$work/header.cma" 24 '\000\000\000\000\377\377\377\377\100\000\000\000\001\000\000\000'
+    "$ccodemerge" list "$work/header.cma" 2>"$work/header.err"
+    [ $? -eq 1 ] && grep -q 'not a valid' "$work/header.err"
+}
+assert archive-corrupt-header archive_corrupt_header
+
+# The same for the body of a table of contents entry
+archive_corrupt_entry() {
+    cp "$work/archive.cma" "$work/entry.cma" &&
+        patch "$work/entry.cma" 80 '\360\377\377\377\377\377\377\377\040\000\000\000\000\000\000\000'
+    "$ccodemerge" extract "$work/entry.cma" "$work/archive/a.c" >/dev/null 2>"$work/entry.err"
+    [ $? -eq 1 ] && grep -q 'corrupt entry' "$work/entry.err"
+}
+assert archive-corrupt-entry archive_corrupt_entry
+
+# Structured formats escape what they must, at every offset of the vector
+# blocks, and keep UTF-8 as is. XML cannot hold most control characters, they
+# become U+FFFD. A binary file gets an omitted field instead of content.
+mkdir "$work/escape"
+for i in $(seq 0 40); do
+    printf '%*s"q" back\\slash \001\037\t\r <&> caf\303\251 \342\202\254 \360\237\230\200\n' "$i" ''
+done >"$work/escape/a.c"
+printf 'x\000y' >"$work/escape/b.c"
+cat >"$work/escape.py" <<'PY'
+import json, sys, xml.etree.ElementTree as ET
+fmt, src, out = sys.argv[1:]
+text = open(src, encoding="utf-8", newline="").read()
+data = open(out, encoding="utf-8", newline="").read()
+if fmt == "json":
+    records = json.loads(data)
+elif fmt == "jsonl":
+    records = [json.loads(line) for line in data.split("\n") if line]
+else:
+    records = [dict(f.attrib, content=f.findtext("content")) for f in ET.fromstring(data)]
+    records = [{k: v for k, v in r.items() if v is not None} for r in records]
+    text = "".join(c if c >= " " or c in "\t\n\r" else "\ufffd" for c in text)
+by_name = {r["path"].rsplit("/", 1)[1]: r for r in records}
+assert by_name["a.c"]["content"] == text, "content differs"
+assert by_name["b.c"].get("omitted") == "binary" and "content" not in by_name["b.c"], "binary record"
+PY
+escape() {
+    (cd "$work/escape" && "$ccodemerge" -f "$1" -o "$work/escape.$1" . >/dev/null 2>&1) &&
+        python3 "$work/escape.py" "$1" "$work/escape/a.c" "$work/escape.$1"
+}
+escape_xml() {
+    escape xml && xmllint --noout "$work/escape.xml"
+}
+if ! skip escape-json python3; then
+    assert escape-json escape json
+    assert escape-jsonl escape jsonl
+    assert escape-json-tool python3 -m json.tool "$work/escape.json"
+    skip escape-xml xmllint || assert escape-xml escape_xml
+fi
+
+# -i patches the previous output in place. After every edit the result must
+# match a plain merge, and the report shows whether it patched (same inode) or
+# fell back to a full rewrite. Old modification times keep the racy-mtime rule
+# from rewriting files that did not change.
+mkdir "$work/incr"
+for f in a b c d; do
+    printf 'int %s = 1;\n' "$f" >"$work/incr/$f.c"
+done
+touch -d 2020-01-01 "$work/incr"/*.c
+(cd "$work/incr" && "$ccodemerge" -i -o "$work/incr.out" .) >/dev/null 2>&1 || true
+# incr REPORT [EDIT...]: run EDIT, rerun -i and compare with a plain merge
+incr() {
+    report=$1
+    shift
+    (cd "$work/incr" && "$@") && inode=$(ls -i "$work/incr.out") &&
+        (cd "$work/incr" && "$ccodemerge" -i -o "$work/incr.out" . && "$ccodemerge" -o "$work/incr.plain" .) >"$work/incr.report" 2>&1 &&
+        grep -q "^$report" "$work/incr.report" && cmp "$work/incr.out" "$work/incr.plain" &&
+        case $report in
+            Updated*) [ "$(ls -i "$work/incr.out")" = "$inode" ] ;;
+            *) [ "$(ls -i "$work/incr.out")" != "$inode" ] ;;
+        esac
+}
+edit() {
+    printf '%s\n' "$2" >"$1" && touch -d 2021-01-01 "$1"
+}
+assert incremental-same-size incr "Updated 1 of 4" edit b.c 'int b = 2;'
+assert incremental-length incr "Updated 2 of 4" edit c.c 'int c = 12345;'
+assert incremental-delete incr "Updated 3 of 3" rm a.c
+assert incremental-stale incr "Successfully merged 3" sh -c "echo x >>'$work/incr.out'"
+
+# Batch result lines have their own format switch; --stats is refused, since
+# the result lines replace its report
+mkdir "$work/batch"
+printf 'int x;\n' >"$work/batch/a.c"
+printf '%s\t%s\n' "$work/batch" "$work/batch.txt" >"$work/batch.manifest"
+batch_json() {
+    "$ccodemerge" --batch="$work/batch.manifest" --batch-format=json >"$work/batch.json" &&
+        python3 -c 'import json, sys
+lines = [json.loads(l) for l in open(sys.argv[1])]
+assert lines[0]["ok"] and lines[0]["files"] == 1 and lines[1]["repositories"] == 1' "$work/batch.json"
+}
+batch_stats() {
+    ! "$ccodemerge" --batch="$work/batch.manifest" --stats
+}
+skip batch-json python3 || assert batch-json batch_json
+assert batch-stats batch_stats
+
+# A file list spilled at the smallest --sort-memory goes through several runs
+# and merge passes, and must give the same output as one kept in memory. Long
+# directory names make the list big enough to merge runs on disk.
+mkdir "$work/large"
+awk -v root="$work/large" 'BEGIN {
+    long = sprintf("%0120d", 0)
+    gsub(/0/, "d", long)
+    for (d = 0; d < 80; d++) {
+        dir = sprintf("%s/%s%02d", root, long, (d * 17) % 80)
+        system("mkdir " dir)
+        for (f = 0; f < 200; f++) {
+            path = sprintf("%s/f%03d.%s", dir, (f * 37) % 200, f % 3 ? "c" : "h")
+            printf "int v%d_%d;\n", d, f >path
+            close(path)
+        }
+    }
+}'
+# Bytes from 0x80 up must sort after ASCII, as unsigned chars, in memory and
+# in the spilled runs alike
+for name in a z "$(printf '\200')" "$(printf '\303\251')" "$(printf '\377')"; do
+    mkdir "$work/large/$name"
+    printf 'int x;\n' >"$work/large/$name/$name.c"
+done
+high_order() {
+    LC_ALL=C grep -a '^File: ' "$work/large.plain" |
+        LC_ALL=C sed -n 's|^File: .*/\([^/]*\)/\1\.c$|\1|p' >"$work/high.actual" &&
+        printf 'a\nz\n\200\n\303\251\n\377\n' | cmp - "$work/high.actual"
+}
+# Links at the end of the walk to files it has already passed break the order
+# of a streamed header or source category, so the output is written again from
+# the collected list
+ln -s "$(printf '%0120d' 0 | tr 0 d)00/f000.h" "$work/large/zz.h"
+ln -s "$(printf '%0120d' 0 | tr 0 d)00/f001.c" "$work/large/zz.c"
+# large BASE OPTIONS: merge $work/large with BASE and OPTIONS and compare with
+# a merge with BASE alone
+large() {
+    (cd "$work/large" && "$ccodemerge" $1 -o "$work/large.plain" . && "$ccodemerge" $1 $2 -o "$work/large.out" .) \
+        >/dev/null 2>&1 && cmp "$work/large.plain" "$work/large.out"
+}
+assert large-spill large "" --sort-memory=256K
+assert large-high-order high_order
+assert large-spill-floor sh -c "! '$ccodemerge' --sort-memory=255K -o - '$work/large'"
+assert large-stream large "" --stream
+assert large-stream-source large --include-category=source --stream
+assert large-stream-spill large --include-category=header,source "--stream --sort-memory=256K"
+stream_stdout() {
+    ! (cd "$work/large" && "$ccodemerge" --stream --include-category=source -o - . >/dev/null) 2>"$work/stream.err" &&
+        grep -q 'sorts before files already written' "$work/stream.err"
+}
+assert large-stream-stdout stream_stdout
+
+# Publishing links the output under a fresh name before the rename, so files
+# next to it that only look like temp names are left alone and none remain
+mkdir "$work/publish" "$work/publish-out"
+printf 'int x;\n' >"$work/publish/a.c"
+for name in out.txt.tmp.1 out.txt.tmp.$$ out.txt.aaaaaa; do
+    echo keep >"$work/publish-out/$name"
+done
+publish() {
+    (cd "$work/publish" && "$ccodemerge" --fsync=full -o "$work/publish-out/out.txt" . &&
+        "$ccodemerge" --fsync=full -o "$work/publish-out/out.txt" .) >/dev/null 2>&1 &&
+        [ "$(LC_ALL=C ls "$work/publish-out" | tr '\n' ' ')" = "out.txt out.txt.aaaaaa out.txt.tmp.1 out.txt.tmp.$$ " ] &&
+        [ "$(cat "$work/publish-out"/out.txt.*)" = "$(printf 'keep\nkeep\nkeep')" ] &&
+        grep -q 'int x;' "$work/publish-out/out.txt"
+}
+assert publish publish
+
+echo "$((count - failed)) of $count tests passed"
+[ "$failed" -eq 0 ]